@@ -1,407 +1,3697 @@
 #include <torch/script.h>
 #include "bg_matte.h"
+#include "matte_kernel.h"
+#include "matte_trace.h"
+#include "matte_alloc.h"
 #include <torch/csrc/api/include/torch/cuda.h>
+#include <ATen/Parallel.h>
+#include <ATen/CPUGeneratorImpl.h>
+#include <torch/csrc/jit/passes/fold_conv_bn.h>
+#include <torch/csrc/jit/passes/quantization/insert_observers.h>
+#include <torch/csrc/jit/passes/quantization/insert_quant_dequant.h>
+#include <torch/csrc/jit/passes/quantization/finalize.h>
+#include <torch/csrc/autograd/profiler.h>
 #include <QFile>
+#include <QFileInfo>
+#include <QCryptographicHash>
+#include <QVector>
+#include <QPair>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSemaphore>
+#include <QThread>
+#include <QFutureInterface>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <limits>
+#include <thread>
+#include <QtMath>
 
 namespace bgmatt
 {
+	//! Result images kept for reuse, one held by the caller still leaves a free one
+	static constexpr int RESULT_CACHE_SIZE = 3;
+
+	//! Frame sizes with a prepared target background, e.g. 720p and 1080p plus a still
+	static constexpr int TARGET_BGR_CACHE_SIZE = 3;
+
+	//! Rows of the streaming window when no tile size is set
+	static constexpr int DEFAULT_STREAM_TILE_SIZE = 1024;
+
+	//! Sizes larger than every shape bucket are padded to a multiple of this, the largest backbone stride
+	static constexpr int BUCKET_ALIGN = 32;
+
+	//! forward() calls per bucket at load, the profiling executor optimizes after its profiled runs
+	static constexpr int WARMUP_RUNS = 3;
+
+	//! Min/max observer of the int8 calibration. Activations are quint8 in [0, 127], the reduced range of fbgemm,
+	//! weights are symmetric qint8. calculate_qparams is read by the quantization passes.
+	static const char *const MINMAX_OBSERVER_SOURCE = R"JIT(
+def forward(self, x: Tensor) -> Tensor:
+    x_detached = x.detach()
+    self.min_val = torch.min(torch.min(x_detached), self.min_val)
+    self.max_val = torch.max(torch.max(x_detached), self.max_val)
+    return x
+
+def calculate_qparams(self) -> Tuple[Tensor, Tensor]:
+    min_val = torch.clamp(self.min_val, max=0.0)
+    max_val = torch.clamp(self.max_val, min=0.0)
+    if self.symmetric:
+        scale = torch.clamp(torch.max(min_val.neg(), max_val) / (float(self.quant_max - self.quant_min) / 2), min=1e-8)
+        zero_point = torch.zeros_like(scale)
+    else:
+        scale = torch.clamp((max_val - min_val) / float(self.quant_max - self.quant_min), min=1e-8)
+        zero_point = torch.clamp(torch.round(min_val / scale).neg() + self.quant_min, self.quant_min, self.quant_max)
+    return scale.reshape(1), zero_point.to(torch.int64).reshape(1)
+)JIT";
+
+	//! Target background prepared for one frame size on the current device
+	struct TargetBgr
+	{
+		QSize size;
+		torch::Tensor tensor;  //!< NCHW in the model precision, 1x1 for the default color
+		kernel::CompositeBgr sBgr;  //!< Planes of tensor for the CPU kernel
+	};
+
+	//! FIFO between pipeline stages holding at most nCapacity items. Push waits while it is full, so a slow
+	//! stage holds back the one before it. Pop returns false once closed and drained, Push false once closed.
+	template<class T>
+	class CBlockingQueue
+	{
+	public:
+		explicit CBlockingQueue(size_t nCapacity) :m_nCapacity(qMax<size_t>(1, nCapacity))
+		{
+		}
+
+		bool Push(T t)
+		{
+			QMutexLocker locker(&m_mutex);
+			while (m_queue.size() >= m_nCapacity && !m_bClosed)
+			{
+				m_conditionNotFull.wait(&m_mutex);
+			}
+
+			if (m_bClosed)
+			{
+				return false;
+			}
+
+			m_queue.push_back(std::move(t));
+			m_condition.wakeOne();
+			return true;
+		}
+
+		bool Pop(T &t)
+		{
+			QMutexLocker locker(&m_mutex);
+			while (m_queue.empty() && !m_bClosed)
+			{
+				m_condition.wait(&m_mutex);
+			}
+
+			if (m_queue.empty())
+			{
+				return false;
+			}
+
+			t = std::move(m_queue.front());
+			m_queue.pop_front();
+			m_conditionNotFull.wakeOne();
+			return true;
+		}
+
+		void Close()
+		{
+			QMutexLocker locker(&m_mutex);
+			m_bClosed = true;
+			m_condition.wakeAll();
+			m_conditionNotFull.wakeAll();
+		}
+
+	private:
+		QMutex m_mutex;
+		QWaitCondition m_condition;  //!< Not empty
+		QWaitCondition m_conditionNotFull;
+		std::deque<T> m_queue;
+		const size_t m_nCapacity;
+		bool m_bClosed = false;
+	};
+
+	class CMattePrivate;
+
+	//! One frame on its way through the pipeline
+	struct MatteJob
+	{
+		QImage imgSrc;
+		quint64 nTag = 0;
+		qint64 nFrame = 0;
+		QSize sizeBucket;  //!< Picks the tensor workspace of every stage
+		QImage imgTargetBgr;  //!< Background of this frame only, prepared by the preprocessing stage
+		std::shared_ptr<const TargetBgr> pTargetBgr;
+		QImage::Format eFormat = QImage::Format_Invalid;
+		QFutureInterface<QImage> future;
+		torch::Tensor tensorHost;
+		torch::Tensor tensorSrc;
+		torch::Tensor tensorPha;
+		torch::Tensor tensorFgr;
+		bool bOk = true;
+		MatteStageTimes sTimes;
+	};
+
+	//! Frames kept per stage for the rolling latencies
+	static constexpr int STATS_WINDOW = 256;
+
+	//! Frames completed within this many milliseconds make the frame rate
+	static constexpr double STATS_FPS_SPAN_MS = 2000;
+
+	//! Stage latencies of the last STATS_WINDOW frames and the frame counters. Written once per frame
+	//! by the thread completing it, read by GetStats on any thread.
+	class CMatteStats
+	{
+	public:
+		void Record(const MatteStageTimes &sTimes, bool bOk)
+		{
+			QMutexLocker locker(&m_mutex);
+			if (!bOk)
+			{
+				++m_nFailed;
+				return;
+			}
+
+			const double afMs[MATTE_STAGE_COUNT] = {
+				sTimes.fIngestMs, sTimes.fUploadMs, sTimes.fModelMs, sTimes.fCompositeMs, sTimes.fDownloadMs, sTimes.fConvertMs };
+			for (int i = 0; i < MATTE_STAGE_COUNT; ++i)
+			{
+				m_aafWindowMs[i][m_nNext] = static_cast<float>(afMs[i]);
+			}
+
+			m_aDone[m_nNext] = std::chrono::steady_clock::now();
+			m_nNext = (m_nNext + 1) % STATS_WINDOW;
+			m_nFilled = qMin(m_nFilled + 1, STATS_WINDOW);
+			++m_nProcessed;
+		}
+
+		void Skip()
+		{
+			QMutexLocker locker(&m_mutex);
+			++m_nSkipped;
+		}
+
+		void Reset()
+		{
+			QMutexLocker locker(&m_mutex);
+			m_nNext = 0;
+			m_nFilled = 0;
+			m_nProcessed = 0;
+			m_nFailed = 0;
+			m_nSkipped = 0;
+		}
+
+		MatteStats Snapshot() const
+		{
+			MatteStats sStats;
+			std::vector<float> vMs;
+			const auto now = std::chrono::steady_clock::now();
+
+			QMutexLocker locker(&m_mutex);
+			sStats.nProcessed = m_nProcessed;
+			sStats.nFailed = m_nFailed;
+			sStats.nSkipped = m_nSkipped;
+
+			for (int i = 0; i < MATTE_STAGE_COUNT; ++i)
+			{
+				vMs.assign(m_aafWindowMs[i], m_aafWindowMs[i] + m_nFilled);
+				StageStats(vMs, sStats.asStages[i]);
+			}
+
+			//! The oldest and newest completion within the span
+			int nFrames = 0;
+			std::chrono::steady_clock::time_point first = now;
+			std::chrono::steady_clock::time_point last;
+			for (int i = 0; i < m_nFilled; ++i)
+			{
+				const auto &done = m_aDone[i];
+				if (std::chrono::duration<double, std::milli>(now - done).count() <= STATS_FPS_SPAN_MS)
+				{
+					++nFrames;
+					first = qMin(first, done);
+					last = qMax(last, done);
+				}
+			}
+
+			const std::chrono::duration<double> span = last - first;
+			sStats.fFps = nFrames > 1 && span.count() > 0 ? (nFrames - 1) / span.count() : 0;
+
+			return sStats;
+		}
+
+	private:
+		static void StageStats(std::vector<float> &vMs, MatteStageStats &sStage)
+		{
+			sStage.nSamples = static_cast<int>(vMs.size());
+			if (vMs.empty())
+			{
+				return;
+			}
+
+			std::sort(vMs.begin(), vMs.end());
+			auto fnRank = [&](double fRank) {
+				const auto nRank = static_cast<int>(std::ceil(fRank / 100 * vMs.size()));
+				return static_cast<double>(vMs[qBound(1, nRank, static_cast<int>(vMs.size())) - 1]);
+			};
+
+			double fSum = 0;
+			for (auto fMs : vMs)
+			{
+				fSum += fMs;
+				const auto nBucket = fMs < 0.125f ? 0 : static_cast<int>(std::floor(std::log2(fMs))) + 4;
+				++sStage.anHistogram[qMin(nBucket, STATS_HISTOGRAM_BUCKETS - 1)];
+			}
+
+			sStage.fMeanMs = fSum / vMs.size();
+			sStage.fP50Ms = fnRank(50);
+			sStage.fP95Ms = fnRank(95);
+			sStage.fP99Ms = fnRank(99);
+			sStage.fMaxMs = vMs.back();
+		}
+
+		mutable QMutex m_mutex;
+		float m_aafWindowMs[MATTE_STAGE_COUNT][STATS_WINDOW];
+		std::chrono::steady_clock::time_point m_aDone[STATS_WINDOW];
+		int m_nNext = 0;
+		int m_nFilled = 0;
+		quint64 m_nProcessed = 0;
+		quint64 m_nFailed = 0;
+		quint64 m_nSkipped = 0;
+	};
+
+	//! Frames waiting in front of each pipeline stage. One is enough to keep the stage busy, a stage that
+	//! falls behind fills its queue and the stage before it waits instead of piling up tensors.
+	static constexpr size_t STAGE_QUEUE_CAPACITY = 1;
+
+	//! Preprocessing, inference and postprocessing on their own threads, so frame N+1 is read while
+	//! frame N runs forward() and frame N-1 is composited. Frames leave in submission order.
+	class CMattePipeline
+	{
+	public:
+		CMattePipeline(CMattePrivate *d, int nDepth);
+		~CMattePipeline();
+
+		QFuture<QImage> Submit(const QImage &imgSrc, quint64 nTag, const QImage &imgTargetBgr);
+		void SetDepth(int nDepth);
+		void WaitForDone();
+
+		//! Frames submitted and not completed
+		int InFlight() const;
+
+	private:
+		void RunPre();
+		void RunInfer();
+		void RunPost();
+		void Finish(const std::shared_ptr<MatteJob> &pJob, const QImage &imgRes);
+
+		CMattePrivate *d;
+		int m_nDepth;
+		QSemaphore m_semInFlight;
+		CBlockingQueue<std::shared_ptr<MatteJob>> m_queuePre;
+		CBlockingQueue<std::shared_ptr<MatteJob>> m_queueInfer;
+		CBlockingQueue<std::shared_ptr<MatteJob>> m_queuePost;
+		std::thread m_threadPre;
+		std::thread m_threadInfer;
+		std::thread m_threadPost;
+	};
+
 	class CMattePrivate
 	{
 	public:
 		CMattePrivate() = default;
 		virtual ~CMattePrivate() = default;
 
-		bool IsCudaAvailable() const
+		bool IsCudaAvailable() const
+		{
+			auto bCuda = torch::cuda::is_available();
+			auto bCudnn = torch::cuda::cudnn_is_available();
+			if (!bCuda || !bCudnn)
+			{
+				return false;
+			}
+
+			return true;
+		}
+
+		//! Pick the device and precision, fp16 TorchScript weights run as fp32 on CPU
+		bool ResolveDevice()
+		{
+			auto eDevice = m_eRequestedDevice;
+			if (MatteDevice::MD_AUTO == eDevice)
+			{
+				eDevice = IsCudaAvailable() ? MatteDevice::MD_CUDA : MatteDevice::MD_CPU;
+			}
+			else if (MatteDevice::MD_CUDA == eDevice && !IsCudaAvailable())
+			{
+				return false;
+			}
+
+			m_eDevice = eDevice;
+			m_sDevice = MatteDevice::MD_CUDA == eDevice ? torch::Device(torch::kCUDA) : torch::Device(torch::kCPU);
+
+			//! The shipped models are fp16, the CPU runs them in fp32 unless bf16 is native and ran. Int8 starts from fp32.
+			m_strPrecisionNote.clear();
+			if (MatteDevice::MD_CUDA == eDevice)
+			{
+				m_ePrecision = MattePrecision::MP_FP32 == m_eRequestedPrecision ? MattePrecision::MP_FP32 : MattePrecision::MP_FP16;
+				if (MattePrecision::MP_BF16 == m_eRequestedPrecision || MattePrecision::MP_INT8 == m_eRequestedPrecision)
+				{
+					m_strPrecisionNote = "bf16 and int8 are CPU modes, CUDA runs fp16";
+				}
+			}
+			else if (MattePrecision::MP_BF16 == m_eRequestedPrecision && kernel::HasBf16() && m_strBf16Failure.isEmpty())
+			{
+				m_ePrecision = MattePrecision::MP_BF16;
+			}
+			else
+			{
+				m_ePrecision = MattePrecision::MP_FP32;
+				if (MattePrecision::MP_BF16 == m_eRequestedPrecision)
+				{
+					m_strPrecisionNote = m_strBf16Failure.isEmpty() ? QString("The CPU has no AVX512_BF16, fp32 is used") : m_strBf16Failure;
+				}
+				else if (MattePrecision::MP_FP16 == m_eRequestedPrecision)
+				{
+					m_strPrecisionNote = "fp16 runs as fp32 on the CPU";
+				}
+			}
+
+			switch (m_ePrecision)
+			{
+			case MattePrecision::MP_FP16:
+				m_nPrecision = torch::kFloat16;
+				break;
+
+			case MattePrecision::MP_BF16:
+				m_nPrecision = torch::kBFloat16;
+				break;
+
+			default:
+				m_nPrecision = torch::kFloat32;
+				break;
+			}
+
+			return true;
+		}
+
+		//! Replace the target background and drop the prepared ones, the next composite prepares it again
+		void SetTargetBgr(const QImage &imgTargetBgr)
+		{
+			QMutexLocker locker(&m_mutexTargetBgr);
+			m_imgTargetBgr = imgTargetBgr;
+			m_vTargetBgr.clear();
+		}
+
+		QImage GetTargetBgr() const
+		{
+			QMutexLocker locker(&m_mutexTargetBgr);
+			return m_imgTargetBgr;
+		}
+
+		//! Drop the prepared backgrounds, the next composite prepares m_imgTargetBgr again
+		void ResetTargetBgr()
+		{
+			QMutexLocker locker(&m_mutexTargetBgr);
+			m_vTargetBgr.clear();
+		}
+
+		//! m_imgTargetBgr resized, converted and uploaded for a frame size, most recently used first.
+		//! The default color is one 1x1 entry broadcast over any size. The entry stays valid after it leaves the cache.
+		std::shared_ptr<const TargetBgr> TargetBgrFor(int nWidth, int nHeight)
+		{
+			//! Held while preparing, a setter waits for at most one size
+			QMutexLocker locker(&m_mutexTargetBgr);
+			const QSize size = m_imgTargetBgr.isNull() ? QSize(1, 1) : QSize(nWidth, nHeight);
+
+			for (int i = 0; i < m_vTargetBgr.size(); ++i)
+			{
+				if (m_vTargetBgr[i]->size == size)
+				{
+					if (i > 0)
+					{
+						auto pTarget = m_vTargetBgr[i];
+						m_vTargetBgr.remove(i);
+						m_vTargetBgr.prepend(pTarget);
+					}
+
+					return m_vTargetBgr.first();
+				}
+			}
+
+			TargetBgr sTarget;
+
+			if (m_imgTargetBgr.isNull())
+			{
+				const auto &afColor = sTarget.sBgr.afColor;
+				sTarget.tensor = torch::tensor({ afColor[0], afColor[1], afColor[2] }).toType(m_nPrecision).to(m_sDevice).view({ 1, 3, 1, 1 });
+			}
+			else
+			{
+				sTarget = PrepareCovering(m_imgTargetBgr, nWidth, nHeight);
+			}
+
+			sTarget.size = size;
+
+			if (m_vTargetBgr.size() >= TARGET_BGR_CACHE_SIZE)
+			{
+				m_vTargetBgr.removeLast();
+			}
+
+			m_vTargetBgr.prepend(std::make_shared<const TargetBgr>(std::move(sTarget)));
+			return m_vTargetBgr.first();
+		}
+
+		//! The part rect of the target background covering a nWidth x nHeight frame, e.g. a band of rows or a tile.
+		//! Only the source pixels of the part are scaled, nothing of the frame size is kept.
+		std::shared_ptr<const TargetBgr> TargetBgrPart(int nWidth, int nHeight, const QRect &rect)
+		{
+			const auto img = GetTargetBgr();
+			if (img.isNull())
+			{
+				return TargetBgrFor(nWidth, nHeight);
+			}
+
+			const qreal fScale = qMax(qreal(nWidth) / img.width(), qreal(nHeight) / img.height());
+			const qreal fLeft = (img.width() * fScale - nWidth) / 2 + rect.left();
+			const qreal fTop = (img.height() * fScale - nHeight) / 2 + rect.top();
+
+			const int nX0 = qFloor(fLeft / fScale);
+			const int nY0 = qFloor(fTop / fScale);
+			const int nX1 = qMin(img.width(), qCeil((fLeft + rect.width()) / fScale));
+			const int nY1 = qMin(img.height(), qCeil((fTop + rect.height()) / fScale));
+
+			return std::make_shared<const TargetBgr>(PrepareTargetBgr(img.copy(nX0, nY0, nX1 - nX0, nY1 - nY0).scaled(rect.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation)));
+		}
+
+		//! imgTarget scaled to cover a nWidth x nHeight frame keeping the aspect ratio, center cropped and prepared
+		TargetBgr PrepareCovering(const QImage &imgTarget, int nWidth, int nHeight) const
+		{
+			auto img = imgTarget;
+			if (img.size() != QSize(nWidth, nHeight))
+			{
+				img = img.scaled(QSize(nWidth, nHeight), Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
+				img = img.copy((img.width() - nWidth) / 2, (img.height() - nHeight) / 2, nWidth, nHeight);
+			}
+
+			return PrepareTargetBgr(img);
+		}
+
+		TargetBgr PrepareTargetBgr(const QImage &img) const
+		{
+			TargetBgr sTarget;
+			sTarget.size = img.size();
+
+			torch::Tensor tensorHost;
+			sTarget.tensor = ImageToTensor(img, tensorHost);
+
+			//! The CPU kernel blends in fp32 whatever the model precision
+			if (m_sDevice.is_cpu())
+			{
+				sTarget.tensor = sTarget.tensor.to(torch::kFloat32);
+				sTarget.sBgr.pPlanes = sTarget.tensor.data_ptr<float>();
+			}
+
+			return sTarget;
+		}
+
+		//! One pass from the scanlines to planar NCHW in m_nPrecision on m_sDevice.
+		//! The CPU writes normalized floats, CUDA uploads bytes and normalizes on the device.
+		//! tensorHost is reused while the size stays the same and may alias the result.
+		torch::Tensor ImageToTensor(const QImage &img, torch::Tensor &tensorHost, MatteStageTimes *pTimes = nullptr) const
+		{
+			return ImagesToTensor(&img, 1, tensorHost, pTimes);
+		}
+
+		//! nCount images of the same size as one NCHW batch, the ingest and upload times go to pTimes if given
+		torch::Tensor ImagesToTensor(const QImage *pImages, int nCount, torch::Tensor &tensorHost, MatteStageTimes *pTimes = nullptr) const
+		{
+			trace::CScope scope("ingest");
+			const auto start = std::chrono::steady_clock::now();
+			const bool bCpu = m_sDevice.is_cpu();
+			const auto nType = bCpu ? torch::kFloat32 : torch::kUInt8;
+			const auto nWidth = pImages[0].width();
+			const auto nHeight = pImages[0].height();
+
+			if (!tensorHost.defined() ||
+				tensorHost.scalar_type() != nType ||
+				tensorHost.size(0) != nCount ||
+				tensorHost.size(2) != nHeight ||
+				tensorHost.size(3) != nWidth)
+			{
+				tensorHost = torch::empty({ nCount, 3, nHeight, nWidth }, torch::TensorOptions(nType).pinned_memory(!bCpu));
+			}
+
+			const int64_t nPlaneStride = static_cast<int64_t>(nWidth) * nHeight;
+
+			for (int i = 0; i < nCount; ++i)
+			{
+				Q_ASSERT(pImages[i].width() == nWidth && pImages[i].height() == nHeight);
+
+				if (bCpu)
+				{
+					kernel::ImageToPlanar(pImages[i], tensorHost[i].data_ptr<float>(), nPlaneStride);
+				}
+				else
+				{
+					kernel::ImageToPlanar(pImages[i], tensorHost[i].data_ptr<uint8_t>(), nPlaneStride);
+				}
+			}
+
+			if (bCpu)
+			{
+				auto tensor = torch::kFloat32 == m_nPrecision ? tensorHost : tensorHost.to(m_nPrecision);
+				if (pTimes)
+				{
+					pTimes->fIngestMs = ElapsedMs(start);
+				}
+
+				return tensor;
+			}
+
+			if (pTimes)
+			{
+				pTimes->fIngestMs = ElapsedMs(start);
+			}
+
+			trace::CScope scopeUpload("upload");
+			const auto startUpload = std::chrono::steady_clock::now();
+			auto tensor = tensorHost.to(m_sDevice, true).to(m_nPrecision).div_(255);
+			if (pTimes)
+			{
+				pTimes->fUploadMs = ElapsedMs(startUpload);
+			}
+
+			return tensor;
+		}
+
+		//! Model specific forward pass, pha and fgr are NCHW on m_sDevice
+		virtual bool Infer(const torch::Tensor &tensorSrc, torch::Tensor &tensorPha, torch::Tensor &tensorFgr)
+		{
+			return false;
+		}
+
+		//! Frames of size SetImage hands to MatteTiled instead of making tensors of the frame size
+		virtual bool TilesFrame(const QSize &size) const
+		{
+			return false;
+		}
+
+		//! Matte imgSrc into imgDst piece by piece, for the frames of TilesFrame
+		virtual bool MatteTiled(const QImage &imgSrc, QImage::Format eFormat, QImage &imgDst)
+		{
+			return false;
+		}
+
+		//! Run forward() on zeros of the bucket until the profiling executor has optimized the graph for it
+		virtual void WarmUp(const QSize &sizeBucket, int nRuns = WARMUP_RUNS)
+		{
+		}
+
+		//! One forward() at the input size in bf16. libtorch lacks CPU bf16 kernels for some of the ops,
+		//! false records why and makes the next ResolveDevice choose fp32.
+		bool ProbeBf16()
+		{
+			if (MattePrecision::MP_BF16 != m_ePrecision)
+			{
+				return true;
+			}
+
+			try
+			{
+				torch::NoGradGuard no_grad;
+				alloc::CWorkspaceScope workspace(m_sizeInput.width(), m_sizeInput.height());
+				WarmUp(m_sizeInput, 1);
+				return true;
+			}
+			catch (const std::exception &e)
+			{
+				m_strBf16Failure = QString("bf16 forward() failed, fp32 is used: %1").arg(QString::fromUtf8(e.what()).section('\n', 0, 0));
+				return false;
+			}
+		}
+
+		//! Smallest bucket holding size, aligned up to BUCKET_ALIGN when none does. size itself without buckets.
+		QSize BucketFor(const QSize &size) const
+		{
+			if (m_vBuckets.isEmpty())
+			{
+				return size;
+			}
+
+			QSize sizeBucket;
+			for (const auto &bucket : m_vBuckets)
+			{
+				if (bucket.width() >= size.width() && bucket.height() >= size.height() &&
+					(!sizeBucket.isValid() || bucket.width() * bucket.height() < sizeBucket.width() * sizeBucket.height()))
+				{
+					sizeBucket = bucket;
+				}
+			}
+
+			if (!sizeBucket.isValid())
+			{
+				sizeBucket = QSize((size.width() + BUCKET_ALIGN - 1) / BUCKET_ALIGN * BUCKET_ALIGN,
+					(size.height() + BUCKET_ALIGN - 1) / BUCKET_ALIGN * BUCKET_ALIGN);
+			}
+
+			return sizeBucket;
+		}
+
+		//! Infer a frame padded to its bucket by replicating the right and bottom edges, the outputs are cropped back
+		bool InferFrame(const torch::Tensor &tensorSrc, torch::Tensor &tensorPha, torch::Tensor &tensorFgr)
+		{
+			const auto nHeight = tensorSrc.size(2);
+			const auto nWidth = tensorSrc.size(3);
+			FollowInputSize(QSize(static_cast<int>(nWidth), static_cast<int>(nHeight)));
+			const auto sizeBucket = BucketFor(QSize(static_cast<int>(nWidth), static_cast<int>(nHeight)));
+			if (sizeBucket.width() == nWidth && sizeBucket.height() == nHeight)
+			{
+				return Infer(tensorSrc, tensorPha, tensorFgr);
+			}
+
+			auto tensorPadded = torch::replication_pad2d(tensorSrc, { 0, sizeBucket.width() - nWidth, 0, sizeBucket.height() - nHeight });
+			if (!Infer(tensorPadded, tensorPha, tensorFgr))
+			{
+				return false;
+			}
+
+			tensorPha = tensorPha.narrow(2, 0, nHeight).narrow(3, 0, nWidth);
+			tensorFgr = tensorFgr.narrow(2, 0, nHeight).narrow(3, 0, nWidth);
+			return true;
+		}
+
+		void WarmUpBuckets()
+		{
+			torch::NoGradGuard no_grad;
+			for (const auto &bucket : m_vBuckets)
+			{
+				//! Fills the workspace of the bucket, its frames then find their blocks there
+				alloc::CWorkspaceScope workspace(bucket.width(), bucket.height());
+				WarmUp(bucket);
+			}
+		}
+
+		//! Reuse imgDst or a cached result that nobody else holds, false if a new buffer is needed
+		bool TakeResultBuffer(int nWidth, int nHeight, QImage::Format eFormat, QImage &imgDst)
+		{
+			auto fnMatch = [&](const QImage &img) {
+				return !img.isNull() && img.width() == nWidth && img.height() == nHeight && img.format() == eFormat;
+			};
+
+			//! imgDst may be a previous result, drop our own reference before checking it
+			if (!imgDst.isNull())
+			{
+				for (auto &img : m_vResCache)
+				{
+					if (img.constBits() == imgDst.constBits())
+					{
+						img = QImage();
+					}
+				}
+
+				if (fnMatch(imgDst) && imgDst.isDetached())
+				{
+					return true;
+				}
+			}
+
+			for (auto &img : m_vResCache)
+			{
+				if (fnMatch(img) && img.isDetached())
+				{
+					imgDst = img;
+					img = QImage();
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void KeepResultBuffer(const QImage &imgDst)
+		{
+			for (auto &img : m_vResCache)
+			{
+				if (img.isNull())
+				{
+					img = imgDst;
+					return;
+				}
+			}
+
+			m_vResCache.removeFirst();
+			m_vResCache.append(imgDst);
+		}
+
+		//! Load the module on m_sDevice in m_nPrecision, the file hash keys the prepared modules
+		void LoadModule(const QString &strModuleAbsolutePath)
+		{
+			m_sModelSource = torch::jit::load(strModuleAbsolutePath.toStdString(), m_sDevice);
+			m_sModelSource.to(m_sDevice, m_nPrecision);
+			m_sModel = m_sModelSource;
+			m_strModulePath = strModuleAbsolutePath;
+			m_baModuleHash.clear();
+			m_bQuantized = false;
+
+			if (m_bPrepareModule)
+			{
+				QFile file(strModuleAbsolutePath);
+				QCryptographicHash hash(QCryptographicHash::Sha1);
+				if (file.open(QFile::ReadOnly) && hash.addData(&file))
+				{
+					m_baModuleHash = hash.result();
+				}
+			}
+		}
+
+		//! Attributes baked into the prepared module, part of its cache key
+		virtual std::string PreparedAttributes() const
+		{
+			return std::string();
+		}
+
+		//! Attributes the int8 module keeps settable, the input size changes them after quantization
+		virtual std::vector<std::string> MutableAttributes() const
+		{
+			return std::vector<std::string>();
+		}
+
+		//! Drop the recurrent state of a video model
+		virtual void ResetState()
+		{
+		}
+
+		//! <model>.<key>.prepared.pt next to the model, keyed by model hash, device, precision and attributes
+		QString PreparedModulePath() const
+		{
+			const auto strDevice = m_sDevice.str();
+			const auto strPrecision = std::string(c10::toString(m_nPrecision));
+			const auto strAttributes = PreparedAttributes();
+
+			QCryptographicHash hash(QCryptographicHash::Sha1);
+			hash.addData(m_baModuleHash);
+			hash.addData(strDevice.c_str(), static_cast<int>(strDevice.size()) + 1);
+			hash.addData(strPrecision.c_str(), static_cast<int>(strPrecision.size()) + 1);
+			hash.addData(strAttributes.c_str(), static_cast<int>(strAttributes.size()) + 1);
+
+			QFileInfo info(m_strModulePath);
+			return info.absolutePath() + "/" + info.completeBaseName() + "." + QString::fromLatin1(hash.result().toHex().left(16)) + ".prepared.pt";
+		}
+
+		//! Freeze m_sModelSource with its attributes baked in, which folds BatchNorm and the constant conv
+		//! add/mul/div into the convolutions. The result is saved for later starts, a broken cache is rebuilt.
+		void PrepareModule()
+		{
+			//! The int8 module is built once per load, only its mutable attributes follow the source
+			if (m_bQuantized)
+			{
+				for (const auto &strName : MutableAttributes())
+				{
+					m_sModel.setattr(strName, m_sModelSource.attr(strName));
+				}
+
+				return;
+			}
+
+			if (!m_bPrepareModule || m_baModuleHash.isEmpty())
+			{
+				m_sModel = m_sModelSource;
+				return;
+			}
+
+			const auto strPrepared = PreparedModulePath();
+			if (QFile::exists(strPrepared))
+			{
+				try
+				{
+					m_sModel = torch::jit::load(strPrepared.toStdString(), m_sDevice);
+					return;
+				}
+				catch (const c10::Error &)
+				{
+				}
+			}
+
+			m_sModelSource.eval();
+			m_sModel = torch::jit::freeze(m_sModelSource);
+
+			try
+			{
+				m_sModel.save(strPrepared.toStdString());
+			}
+			catch (const c10::Error &)
+			{
+				//! A read-only model folder only costs the freeze on every start
+				QFile::remove(strPrepared);
+			}
+		}
+
+		//! Min/max observer module for the quantization passes
+		static torch::jit::Module MinMaxObserver(c10::ScalarType nType, int64_t nQuantMin, int64_t nQuantMax, bool bSymmetric)
+		{
+			torch::jit::Module observer(c10::QualifiedName("__torch__.bgmatt.MinMaxObserver"));
+			observer.register_buffer("min_val", torch::tensor(std::numeric_limits<float>::infinity()));
+			observer.register_buffer("max_val", torch::tensor(-std::numeric_limits<float>::infinity()));
+
+			//! dtype and qscheme are read back as ints by toScalarType and toQScheme
+			observer.register_attribute("dtype", c10::IntType::get(), static_cast<int64_t>(nType));
+			observer.register_attribute("qscheme", c10::IntType::get(),
+				static_cast<int64_t>(bSymmetric ? c10::kPerTensorSymmetric : c10::kPerTensorAffine));
+			observer.register_attribute("quant_min", c10::IntType::get(), nQuantMin);
+			observer.register_attribute("quant_max", c10::IntType::get(), nQuantMax);
+			observer.register_attribute("symmetric", c10::BoolType::get(), bSymmetric);
+			observer.define(MINMAX_OBSERVER_SOURCE);
+
+			return observer;
+		}
+
+		//! One pass over vSamples from an empty state, keeps pha of every sample in pvPha if given
+		bool RunSamples(const std::vector<torch::Tensor> &vSamples, std::vector<torch::Tensor> *pvPha, double &fMsPerFrame)
+		{
+			ResetState();
+			const auto start = std::chrono::steady_clock::now();
+
+			for (const auto &tensorSrc : vSamples)
+			{
+				torch::Tensor tensorPha;
+				torch::Tensor tensorFgr;
+				if (!InferFrame(tensorSrc, tensorPha, tensorFgr))
+				{
+					return false;
+				}
+
+				if (pvPha)
+				{
+					pvPha->push_back(tensorPha.to(torch::kFloat32));
+				}
+			}
+
+			const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			fMsPerFrame = elapsed.count() / vSamples.size();
+			ResetState();
+
+			return true;
+		}
+
+		//! Post-training static quantization on the CPU. BatchNorm is folded into the convolutions, observers
+		//! record the ranges over the calibration images and the convolutions are swapped for fbgemm int8 ones.
+		//! pha of the fp32 and int8 modules is compared over the same images. m_sModel stays fp32 on failure.
+		bool QuantizeInt8()
+		{
+			m_sQuantReport = QuantizationReport();
+			if (!m_sDevice.is_cpu() || m_vCalibration.isEmpty())
+			{
+				if (m_sDevice.is_cpu())
+				{
+					m_strPrecisionNote = "int8 needs calibration images, fp32 is used";
+				}
+
+				return false;
+			}
+
+			torch::NoGradGuard no_grad;
+			std::vector<torch::Tensor> vSamples;
+			for (const auto &img : m_vCalibration)
+			{
+				torch::Tensor tensorHost;
+				vSamples.push_back(ImageToTensor(img, tensorHost));
+			}
+
+			//! The parameters of the input size stay fixed and frames run whole, the observers are not thread safe
+			const auto bAutoInputSize = m_bAutoInputSize;
+			m_bAutoInputSize = false;
+			m_bCalibrating = true;
+
+			const auto sModelFp32 = m_sModel;
+			std::vector<torch::Tensor> vPhaFp32;
+			std::vector<torch::Tensor> vPhaInt8;
+			bool bOk = false;
+
+			try
+			{
+				if (RunSamples(vSamples, &vPhaFp32, m_sQuantReport.fFp32Ms))
+				{
+					m_sModelSource.eval();
+					auto sObserved = torch::jit::FoldConvBatchNorm(m_sModelSource);
+
+					torch::jit::QConfigDict dictQConfig;
+					dictQConfig[""] = std::make_tuple(MinMaxObserver(torch::kQUInt8, 0, 127, false), MinMaxObserver(torch::kQInt8, -128, 127, true));
+					torch::jit::InsertObservers(sObserved, "forward", dictQConfig, true);
+
+					double fCalibrationMs = 0;
+					m_sModel = sObserved;
+					if (RunSamples(vSamples, nullptr, fCalibrationMs))
+					{
+						torch::jit::InsertQuantDeQuant(sObserved, "forward", true, false);
+						m_sModel = torch::jit::Finalize(sObserved, torch::jit::QuantType::STATIC, MutableAttributes());
+						bOk = RunSamples(vSamples, &vPhaInt8, m_sQuantReport.fInt8Ms);
+					}
+				}
+			}
+			catch (const std::exception &e)
+			{
+				//! The JIT passes report with their own exception types
+				m_strPrecisionNote = QString("int8 quantization failed, fp32 is used: %1").arg(QString::fromUtf8(e.what()).section('\n', 0, 0));
+				bOk = false;
+			}
+
+			m_bCalibrating = false;
+			m_bAutoInputSize = bAutoInputSize;
+			ResetState();
+
+			if (!bOk)
+			{
+				if (m_strPrecisionNote.isEmpty())
+				{
+					m_strPrecisionNote = "int8 calibration failed, fp32 is used";
+				}
+
+				m_sModel = sModelFp32;
+				return false;
+			}
+
+			double fSum = 0;
+			int64_t nElements = 0;
+			for (size_t i = 0; i < vPhaFp32.size(); ++i)
+			{
+				auto tensorDiff = (vPhaInt8[i] - vPhaFp32[i]).abs_();
+				fSum += tensorDiff.sum().item<double>();
+				nElements += tensorDiff.numel();
+				m_sQuantReport.fMaxAbsError = qMax(m_sQuantReport.fMaxAbsError, tensorDiff.max().item<double>());
+			}
+
+			m_sQuantReport.bOk = true;
+			m_sQuantReport.nSamples = static_cast<int>(vSamples.size());
+			m_sQuantReport.fMeanAbsError = fSum / qMax<int64_t>(1, nElements);
+			m_bQuantized = true;
+			m_ePrecision = MattePrecision::MP_INT8;
+
+			return true;
+		}
+
+		//! nFrames forward passes of imgSrc under the legacy autograd profiler, after one unprofiled pass so the
+		//! executor has specialized the graph for the size. The graph is inlined, the ops carry no module names,
+		//! but their input shapes tell the working resolution from the full one.
+		OperatorProfileReport ProfileOperators(const QImage &imgSrc, int nFrames, const QString &strTracePath)
+		{
+			namespace profiler = torch::autograd::profiler;
+
+			OperatorProfileReport sReport;
+			if (!m_bModuleLoaded || imgSrc.isNull() || nFrames < 1)
+			{
+				return sReport;
+			}
+
+			torch::NoGradGuard no_grad;
+			torch::Tensor tensorHost;
+			const auto tensorSrc = ImageToTensor(imgSrc, tensorHost);
+			const std::vector<torch::Tensor> vSamples(nFrames, tensorSrc);
+
+			profiler::thread_event_lists eventLists;
+			bool bProfiling = false;
+			try
+			{
+				double fWarmUpMs = 0;
+				if (!RunSamples({ tensorSrc }, nullptr, fWarmUpMs))
+				{
+					return sReport;
+				}
+
+				profiler::enableProfilerLegacy(profiler::ProfilerConfig(m_sDevice.is_cuda() ? profiler::ProfilerState::CUDA : profiler::ProfilerState::CPU, true));
+				bProfiling = true;
+				sReport.bOk = RunSamples(vSamples, nullptr, sReport.fFrameMs);
+				if (m_sDevice.is_cuda())
+				{
+					torch::cuda::synchronize();
+				}
+
+				bProfiling = false;
+				eventLists = profiler::disableProfilerLegacy();
+			}
+			catch (const c10::Error &)
+			{
+				if (bProfiling)
+				{
+					profiler::disableProfilerLegacy();
+				}
+
+				sReport.bOk = false;
+			}
+
+			if (!sReport.bOk)
+			{
+				return sReport;
+			}
+
+			sReport.nFrames = nFrames;
+			AggregateOperators(eventLists, sReport);
+
+			if (!strTracePath.isEmpty())
+			{
+				std::vector<profiler::LegacyEvent *> vEvents;
+				for (auto &list : eventLists)
+				{
+					for (auto &event : list)
+					{
+						vEvents.push_back(&event);
+					}
+				}
+
+				std::ostringstream stream;
+				profiler::writeProfilerEventsToStream(stream, vEvents);
+
+				QFile file(strTracePath);
+				if (file.open(QFile::WriteOnly | QFile::Truncate))
+				{
+					file.write(QByteArray::fromStdString(stream.str()));
+				}
+			}
+
+			return sReport;
+		}
+
+		//! Input shapes of an op as "[1, 3, 1080, 1920], [64, 3, 3, 3]", non-tensor inputs are []
+		static QString ShapesString(const std::vector<std::vector<int64_t>> &vShapes)
+		{
+			QStringList listShapes;
+			for (const auto &vShape : vShapes)
+			{
+				QStringList listDims;
+				for (const auto nDim : vShape)
+				{
+					listDims << QString::number(static_cast<qint64>(nDim));
+				}
+
+				listShapes << "[" + listDims.join(", ") + "]";
+			}
+
+			return listShapes.join(", ");
+		}
+
+		//! Pair the push and pop ranges of each thread by handle and sum them by name, and by name and shapes.
+		//! The self time of a range is its time minus that of the ranges opened inside it.
+		static void AggregateOperators(const torch::autograd::profiler::thread_event_lists &eventLists, OperatorProfileReport &sReport)
+		{
+			using torch::autograd::profiler::LegacyEvent;
+
+			struct OpenRange
+			{
+				const LegacyEvent *pEvent;
+				double fChildUs;
+			};
+
+			std::map<QString, OperatorProfile> mapOperators;
+			std::map<QPair<QString, QString>, OperatorProfile> mapShapes;
+
+			for (const auto &list : eventLists)
+			{
+				std::vector<OpenRange> vOpen;
+				for (const auto &event : list)
+				{
+					const auto strKind = event.kindStr();
+					if ("push" == strKind)
+					{
+						vOpen.push_back({ &event, 0 });
+						continue;
+					}
+
+					if ("pop" != strKind)
+					{
+						continue;
+					}
+
+					auto iter = std::find_if(vOpen.rbegin(), vOpen.rend(), [&](const OpenRange &range) {
+						return range.pEvent->handle() == event.handle();
+					});
+					if (vOpen.rend() == iter)
+					{
+						continue;
+					}
+
+					const auto range = *iter;
+					vOpen.erase(std::next(iter).base(), vOpen.end());
+
+					const auto fTotalUs = range.pEvent->cpuElapsedUs(event);
+					const auto fCudaUs = range.pEvent->hasCuda() && event.hasCuda() ? range.pEvent->cudaElapsedUs(event) : 0.0;
+					if (!vOpen.empty())
+					{
+						vOpen.back().fChildUs += fTotalUs;
+					}
+
+					const auto strName = QString::fromUtf8(range.pEvent->name());
+					const auto strShapes = ShapesString(range.pEvent->shapes());
+					for (auto pProfile : { &mapOperators[strName], &mapShapes[qMakePair(strName, strShapes)] })
+					{
+						pProfile->nCalls += 1;
+						pProfile->fSelfMs += (fTotalUs - range.fChildUs) / 1000;
+						pProfile->fTotalMs += fTotalUs / 1000;
+						pProfile->fCudaMs += fCudaUs / 1000;
+					}
+				}
+			}
+
+			auto fnBySelfTime = [](const OperatorProfile &a, const OperatorProfile &b) {
+				return a.fSelfMs > b.fSelfMs;
+			};
+
+			for (auto &item : mapOperators)
+			{
+				item.second.strName = item.first;
+				sReport.vOperators.push_back(item.second);
+			}
+
+			for (auto &item : mapShapes)
+			{
+				item.second.strName = item.first.first;
+				item.second.strShapes = item.first.second;
+				sReport.vShapes.push_back(item.second);
+			}
+
+			std::sort(sReport.vOperators.begin(), sReport.vOperators.end(), fnBySelfTime);
+			std::sort(sReport.vShapes.begin(), sReport.vShapes.end(), fnBySelfTime);
+		}
+
+		//! Pixel format written for the output mode, eFormat is the requested one
+		QImage::Format WriteFormat(QImage::Format eFormat) const
+		{
+			switch (m_eOutputMode)
+			{
+			case MatteOutput::MO_ALPHA:
+				return QImage::Format_Alpha8 == eFormat ? QImage::Format_Alpha8 : QImage::Format_Grayscale8;
+
+			case MatteOutput::MO_PREMULTIPLIED:
+				return QImage::Format_ARGB32_Premultiplied;
+
+			default:
+				return kernel::IsOutputFormat(eFormat) ? eFormat : QImage::Format_RGB32;
+			}
+		}
+
+		//! Download HxWxC bytes into a recycled buffer, or wrap them when there is none
+		void DownloadResult(const torch::Tensor &tensorPacked, QImage::Format eFormat, QImage &imgDst)
+		{
+			const auto nHeight = static_cast<int>(tensorPacked.size(0));
+			const auto nWidth = static_cast<int>(tensorPacked.size(1));
+			const auto nBytes = static_cast<int>(tensorPacked.size(2));
+
+			//! The packing queued before belongs to the composite
+			SyncDevice();
+			trace::CScope scope("download");
+			const auto start = std::chrono::steady_clock::now();
+
+			if (TakeResultBuffer(nWidth, nHeight, eFormat, imgDst))
+			{
+				torch::from_blob(imgDst.bits(), { nHeight, nWidth, nBytes }, { imgDst.bytesPerLine(), nBytes, 1 }, torch::kUInt8).copy_(tensorPacked);
+			}
+			else
+			{
+				//! The image owns the downloaded tensor, scanlines stay 4-byte aligned for QImage
+				auto nBytesPerLine = (nWidth * nBytes + 3) & ~3;
+				auto tensorHost = torch::empty({ nHeight, nBytesPerLine }, torch::kUInt8);
+				tensorHost.narrow(1, 0, nWidth * nBytes).view({ nHeight, nWidth, nBytes }).copy_(tensorPacked);
+
+				auto pTensor = new torch::Tensor(tensorHost);
+				imgDst = QImage(pTensor->data_ptr<uint8_t>(), nWidth, nHeight, nBytesPerLine, eFormat,
+					[](void *p) { delete static_cast<torch::Tensor *>(p); }, pTensor);
+			}
+
+			m_sStageTimes.fDownloadMs = ElapsedMs(start);
+		}
+
+		//! Write pha and fgr straight into the pixels of imgDst in the current output mode.
+		//! The CPU runs the fused kernels, CUDA composites and packs on the device.
+		//! Alpha-only converts and downloads the single pha channel, no background is involved outside MO_COMPOSITE.
+		//! A valid sizeFrame marks pha and fgr as the block at ptOrigin of a larger frame.
+		//! pTargetBgr, prepared for this frame, replaces the target background set by SetTargetBgr.
+		bool Compose(const torch::Tensor &tensorPha, const torch::Tensor &tensorFgr, QImage::Format eFormat, QImage &imgDst,
+			const QSize &sizeFrame = QSize(), const QPoint &ptOrigin = QPoint(), const std::shared_ptr<const TargetBgr> &pTargetBgr = nullptr)
+		{
+			trace::CScope scope("composite");
+			const auto start = std::chrono::steady_clock::now();
+			m_sStageTimes.fDownloadMs = 0;
+			const auto eWriteFormat = WriteFormat(eFormat);
+			const auto nHeight = static_cast<int>(tensorPha.size(2));
+			const auto nWidth = static_cast<int>(tensorPha.size(3));
+			const int64_t nPlaneStride = static_cast<int64_t>(nWidth) * nHeight;
+
+			auto pTarget = pTargetBgr;
+			if (MatteOutput::MO_COMPOSITE == m_eOutputMode && !pTarget)
+			{
+				if (sizeFrame.isValid() && sizeFrame != QSize(nWidth, nHeight))
+				{
+					pTarget = TargetBgrPart(sizeFrame.width(), sizeFrame.height(), QRect(ptOrigin, QSize(nWidth, nHeight)));
+				}
+				else
+				{
+					pTarget = TargetBgrFor(nWidth, nHeight);
+				}
+			}
+
+			if (m_sDevice.is_cpu())
+			{
+				auto tensorPhaF = tensorPha.to(torch::kFloat32).contiguous();
+
+				if (!TakeResultBuffer(nWidth, nHeight, eWriteFormat, imgDst))
+				{
+					imgDst = QImage(nWidth, nHeight, eWriteFormat);
+				}
+
+				if (MatteOutput::MO_ALPHA == m_eOutputMode)
+				{
+					kernel::AlphaToImage(tensorPhaF.data_ptr<float>(), imgDst);
+				}
+				else
+				{
+					auto tensorFgrF = tensorFgr.to(torch::kFloat32).contiguous();
+
+					if (MatteOutput::MO_PREMULTIPLIED == m_eOutputMode)
+					{
+						kernel::Premultiply(tensorPhaF.data_ptr<float>(), tensorFgrF.data_ptr<float>(), nPlaneStride, imgDst);
+					}
+					else
+					{
+						kernel::Composite(tensorPhaF.data_ptr<float>(), tensorFgrF.data_ptr<float>(), nPlaneStride, pTarget->sBgr, imgDst);
+					}
+				}
+			}
+			else
+			{
+				auto fnToBytes = [](const torch::Tensor &tensor) {
+					return tensor.mul(255).add_(0.5).clamp_(0, 255).to(torch::kUInt8);
+				};
+
+				if (MatteOutput::MO_ALPHA == m_eOutputMode)
+				{
+					DownloadResult(fnToBytes(tensorPha[0]).permute({ 1, 2, 0 }), eWriteFormat, imgDst);
+				}
+				else
+				{
+					const bool bPremultiplied = MatteOutput::MO_PREMULTIPLIED == m_eOutputMode;
+					auto tensorRes = bPremultiplied ? tensorPha * tensorFgr : tensorPha * tensorFgr + (1 - tensorPha) * pTarget->tensor;
+
+					//! Pack in the byte order of the format on the device, then download once
+					int anByte[4];
+					const auto nBytes = kernel::OutputLayout(eWriteFormat, anByte);
+					auto tensorBytes = fnToBytes(tensorRes[0]);
+
+					std::vector<torch::Tensor> vPlanes(nBytes);
+					for (int i = 0; i < 3; ++i)
+					{
+						vPlanes[anByte[i]] = tensorBytes[i];
+					}
+
+					if (4 == nBytes)
+					{
+						vPlanes[anByte[3]] = bPremultiplied ? fnToBytes(tensorPha[0][0]) : torch::full({ nHeight, nWidth }, 255, tensorBytes.options());
+					}
+
+					DownloadResult(torch::stack(vPlanes, 2), eWriteFormat, imgDst);
+				}
+			}
+
+			KeepResultBuffer(imgDst);
+			m_sStageTimes.fCompositeMs = ElapsedMs(start) - m_sStageTimes.fDownloadMs;
+
+			const auto startConvert = std::chrono::steady_clock::now();
+			if (eWriteFormat != eFormat && MatteOutput::MO_COMPOSITE == m_eOutputMode)
+			{
+				trace::CScope scopeConvert("convert");
+				imgDst = imgDst.convertToFormat(eFormat);
+			}
+
+			m_sStageTimes.fConvertMs = ElapsedMs(startConvert);
+			return true;
+		}
+
+		//! Wait for the queued device work when stage timing is on
+		void SyncDevice() const
+		{
+			if (m_bStageTiming && m_sDevice.is_cuda())
+			{
+				torch::cuda::synchronize();
+			}
+		}
+
+		//! Milliseconds since start, 0 when neither the stats nor stage timing are on
+		double ElapsedMs(std::chrono::steady_clock::time_point start) const
+		{
+			if (!BGMATT_ENABLE_STATS && !m_bStageTiming)
+			{
+				return 0;
+			}
+
+			SyncDevice();
+			const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			return elapsed.count();
+		}
+
+		//! Complete the stages of a frame with the ones of the last Compose, publish them and count the frame
+		void FinishFrame(MatteStageTimes sTimes, bool bOk)
+		{
+			if (bOk)
+			{
+				sTimes.fCompositeMs = m_sStageTimes.fCompositeMs;
+				sTimes.fDownloadMs = m_sStageTimes.fDownloadMs;
+				sTimes.fConvertMs = m_sStageTimes.fConvertMs;
+
+				if (m_bStageTiming)
+				{
+					QMutexLocker locker(&m_mutexStageTimes);
+					m_sLastStageTimes = sTimes;
+				}
+			}
+
+#if BGMATT_ENABLE_STATS
+			m_stats.Record(sTimes, bOk);
+#endif
+		}
+
+		//! A frame refused before inference
+		void SkipFrame()
+		{
+#if BGMATT_ENABLE_STATS
+			m_stats.Skip();
+#endif
+		}
+
+		//! Model parameters for frames of size, nWorkingSide is the short side of the coarse pass, 0 for the model default
+		virtual void ApplyInputSize(const QSize &size, int nWorkingSide)
+		{
+			m_sizeInput = size;
+			m_nWorkingSide = nWorkingSide;
+		}
+
+		//! Re-derive the parameters when the frame size changes, if the input size follows the frames
+		void FollowInputSize(const QSize &size)
+		{
+			if (m_bAutoInputSize && size != m_sizeInput)
+			{
+				ApplyInputSize(size, m_nWorkingSide);
+			}
+		}
+
+		//! Run the module loaded by other, the weights are shared and only read by forward()
+		//! The weights are shared, the attributes are not: each object gets its own shallow copy of the module,
+		//! so setting the size attributes on one never reaches a forward() running on another.
+		//! A frozen module has them as constants and is only ever replaced, it stays shared.
+		virtual void ShareModule(const CMattePrivate &other)
+		{
+			m_sModelSource = other.m_sModelSource.copy();
+			if (other.m_sModel._ivalue() == other.m_sModelSource._ivalue())
+			{
+				m_sModel = m_sModelSource;
+			}
+			else
+			{
+				m_sModel = other.m_bQuantized ? other.m_sModel.copy() : other.m_sModel;
+			}
+
+			m_strModulePath = other.m_strModulePath;
+			m_baModuleHash = other.m_baModuleHash;
+			m_eDevice = other.m_eDevice;
+			m_sDevice = other.m_sDevice;
+			m_nPrecision = other.m_nPrecision;
+			m_eRequestedPrecision = other.m_eRequestedPrecision;
+			m_ePrecision = other.m_ePrecision;
+			m_strPrecisionNote = other.m_strPrecisionNote;
+			m_bQuantized = other.m_bQuantized;
+			m_sQuantReport = other.m_sQuantReport;
+			m_eMatteResolution = other.m_eMatteResolution;
+			m_sizeInput = other.m_sizeInput;
+			m_nWorkingSide = other.m_nWorkingSide;
+			m_bAutoInputSize = other.m_bAutoInputSize;
+			m_vBuckets = other.m_vBuckets;
+			m_bModuleLoaded = other.m_bModuleLoaded;
+			ResetTargetBgr();
+		}
+
+		//! The module as loaded, m_sModel is a frozen copy of it when the module is prepared
+		torch::jit::Module m_sModelSource;
+		torch::jit::Module m_sModel;
+		QString m_strModulePath;
+		QByteArray m_baModuleHash;
+		bool m_bPrepareModule = false;
+		//! Guards the target background, setters and the composite run on different threads
+		mutable QMutex m_mutexTargetBgr;
+		QVector<std::shared_ptr<const TargetBgr>> m_vTargetBgr;
+		QImage m_imgTargetBgr;
+		torch::Tensor m_tensorSrcHost;
+		QVector<QImage> m_vResCache = QVector<QImage>(RESULT_CACHE_SIZE);
+		QImage::Format m_eOutputFormat = QImage::Format_Invalid;
+		MatteOutput m_eOutputMode = MatteOutput::MO_COMPOSITE;
+
+		//! Created by the first Submit, stopped by ~CMatte while the derived private class is alive
+		std::unique_ptr<CMattePipeline> m_pPipeline;
+		int m_nInFlightDepth = 3;
+		MatteCallback m_fnCompletion;
+		bool m_bModuleLoaded = false;
+
+		bgmatt::MatteResolution m_eMatteResolution = bgmatt::MatteResolution::MR_HD;
+		QSize m_sizeInput = QSize(1920, 1080);
+		int m_nWorkingSide = 0;
+		bool m_bAutoInputSize = false;
+		QVector<QSize> m_vBuckets;
+		bgmatt::MatteDevice m_eRequestedDevice = bgmatt::MatteDevice::MD_AUTO;
+		bgmatt::MatteDevice m_eDevice = bgmatt::MatteDevice::MD_CPU;
+		torch::Device m_sDevice = torch::Device(torch::kCPU);
+		c10::ScalarType m_nPrecision = torch::kFloat32;
+		//! m_sStageTimes is written by the thread that runs the stage, m_sLastStageTimes is read by the caller
+		bool m_bStageTiming = false;
+		MatteStageTimes m_sStageTimes;
+		//! Frame ids of the trace, in submission order
+		std::atomic<qint64> m_nNextFrame{ 0 };
+		MatteStageTimes m_sLastStageTimes;
+		mutable QMutex m_mutexStageTimes;
+#if BGMATT_ENABLE_STATS
+		CMatteStats m_stats;
+#endif
+		MattePrecision m_eRequestedPrecision = MattePrecision::MP_AUTO;
+		MattePrecision m_ePrecision = MattePrecision::MP_AUTO;
+		QString m_strPrecisionNote;
+		//! Why bf16 did not run on this CPU, kept over later loads
+		QString m_strBf16Failure;
+
+		//! m_sModel is the int8 module built from m_sModelSource by QuantizeInt8
+		bool m_bQuantized = false;
+		bool m_bCalibrating = false;
+		QVector<QImage> m_vCalibration;
+		QuantizationReport m_sQuantReport;
+	};
+
+	class CBgMattePrivate :public CMattePrivate
+	{
+	public:
+		CBgMattePrivate() = default;
+		~CBgMattePrivate() = default;
+
+		bool Infer(const torch::Tensor &tensorSrc, torch::Tensor &tensorPha, torch::Tensor &tensorFgr) override
+		{
+			if (!m_tensorSrcBgr.defined())
+			{
+				return false;
+			}
+
+			const auto &tensorBgr = PaddedSrcBgr(m_tensorShotBgr.defined() ? m_tensorShotBgr : m_tensorSrcBgr, tensorSrc.size(2), tensorSrc.size(3));
+
+			if (m_nTileSize > 0 && !m_bCalibrating && (tensorSrc.size(2) > m_nTileSize || tensorSrc.size(3) > m_nTileSize))
+			{
+				ForwardTiled(tensorSrc, tensorBgr, m_nTileSize, tensorPha, tensorFgr);
+			}
+			else
+			{
+				Forward(tensorSrc, tensorBgr, tensorPha, tensorFgr);
+			}
+
+			return true;
+		}
+
+		//! The clean plate fitted to the nHeight x nWidth a frame or bucket has, kept for the last size.
+		//! Dimensions the plate is larger in are cropped, the shorter ones replicated.
+		const torch::Tensor &PaddedSrcBgr(const torch::Tensor &tensorPlate, int64_t nHeight, int64_t nWidth)
+		{
+			const auto nBgrHeight = tensorPlate.size(2);
+			const auto nBgrWidth = tensorPlate.size(3);
+			if (nHeight == nBgrHeight && nWidth == nBgrWidth)
+			{
+				return tensorPlate;
+			}
+
+			if (!m_tensorSrcBgrPadded.defined() || m_tensorSrcBgrPadded.size(2) != nHeight || m_tensorSrcBgrPadded.size(3) != nWidth)
+			{
+				auto tensorFit = tensorPlate.narrow(2, 0, qMin(nHeight, nBgrHeight)).narrow(3, 0, qMin(nWidth, nBgrWidth));
+				if (nHeight > nBgrHeight || nWidth > nBgrWidth)
+				{
+					tensorFit = torch::replication_pad2d(tensorFit, { 0, qMax<int64_t>(0, nWidth - nBgrWidth), 0, qMax<int64_t>(0, nHeight - nBgrHeight) });
+				}
+
+				m_tensorSrcBgrPadded = tensorFit;
+			}
+
+			return m_tensorSrcBgrPadded;
+		}
+
+		void WarmUp(const QSize &sizeBucket, int nRuns) override
+		{
+			auto tensorZeros = torch::zeros({ 1, 3, sizeBucket.height(), sizeBucket.width() }, torch::TensorOptions(m_nPrecision).device(m_sDevice));
+			for (int i = 0; i < nRuns; ++i)
+			{
+				torch::Tensor tensorPha;
+				torch::Tensor tensorFgr;
+				Forward(tensorZeros, tensorZeros, tensorPha, tensorFgr);
+			}
+		}
+
+		//! Tile of frame rows [nTop, nTop + nHeight) and columns [nLeft, nLeft + nWidth), NCHW on m_sDevice in m_nPrecision
+		typedef std::function<torch::Tensor(int nTop, int nLeft, int nHeight, int nWidth)> TileReader;
+		//! Blended fp32 pha and fgr of the block at nTop, nLeft, false stops
+		typedef std::function<bool(int nTop, int nLeft, const torch::Tensor &tensorPha, const torch::Tensor &tensorFgr)> BlockWriter;
+
+		//! Overlapping nTileSize tiles of a nHeight x nWidth frame in rows, blended with feathered weights. A block goes
+		//! to fnWrite as soon as no later tile covers it, only the sums of the overlap still to come are kept.
+		//! Memory follows the tile size plus the overlap rows of the frame width. CPU tiles of a row run in parallel,
+		//! one tile per worker thread bounds the activations.
+		bool ForwardTiles(int nHeight, int nWidth, int nTileSize, const TileReader &fnRead, const torch::Tensor &tensorBgr, const BlockWriter &fnWrite)
+		{
+			const auto nTileHeight = qMin(nTileSize, nHeight);
+			const auto nTileWidth = qMin(nTileSize, nWidth);
+			const auto vTops = TileOrigins(nHeight, nTileSize);
+			const auto vLefts = TileOrigins(nWidth, nTileSize);
+			const auto options = torch::TensorOptions(torch::kFloat32).device(m_sDevice);
+			const int nGroup = m_sDevice.is_cpu() ? qMax(1, at::get_num_threads()) : 1;
+
+			//! Weighted pha and fgr with the weight as channel 4. Each sum is in one place, the rows shared
+			//! with the next row of tiles or the columns shared with the next tile of the row.
+			torch::Tensor tensorRowCarry;
+
+			for (int r = 0; r < vTops.size(); ++r)
+			{
+				const auto nTop = vTops[r];
+				const auto nFinalRows = (r + 1 < vTops.size() ? vTops[r + 1] : nHeight) - nTop;
+				const auto tensorRowWeight = FeatherWeight(nTop, nTileHeight, nHeight).view({ -1, 1 });
+				torch::Tensor tensorNextRowCarry;
+				torch::Tensor tensorColCarry;
+
+				for (int c0 = 0; c0 < vLefts.size(); c0 += nGroup)
+				{
+					const auto nCount = qMin(nGroup, vLefts.size() - c0);
+					std::vector<torch::Tensor> vTiles(nCount);
+
+					auto fnTile = [&](int i) {
+						const auto nLeft = vLefts[c0 + i];
+
+						torch::Tensor tensorTilePha;
+						torch::Tensor tensorTileFgr;
+						Forward(fnRead(nTop, nLeft, nTileHeight, nTileWidth),
+							tensorBgr.narrow(2, nTop, nTileHeight).narrow(3, nLeft, nTileWidth),
+							tensorTilePha, tensorTileFgr);
+
+						auto tensorTileWeight = (tensorRowWeight * FeatherWeight(nLeft, nTileWidth, nWidth).view({ 1, -1 })).to(options)
+							.view({ 1, 1, nTileHeight, nTileWidth }).expand({ tensorTilePha.size(0), 1, nTileHeight, nTileWidth });
+						vTiles[i] = torch::cat({ torch::cat({ tensorTilePha, tensorTileFgr }, 1).to(torch::kFloat32).mul_(tensorTileWeight), tensorTileWeight }, 1);
+					};
+
+					if (nCount > 1)
+					{
+						at::parallel_for(0, nCount, 1, [&](int64_t nBegin, int64_t nEnd) {
+							//! Grad mode is thread local
+							torch::NoGradGuard no_grad;
+							for (auto i = nBegin; i < nEnd; ++i)
+							{
+								fnTile(static_cast<int>(i));
+							}
+						});
+					}
+					else
+					{
+						fnTile(0);
+					}
+
+					for (int i = 0; i < nCount; ++i)
+					{
+						const auto c = c0 + i;
+						const auto nLeft = vLefts[c];
+						const auto nFinalCols = (c + 1 < vLefts.size() ? vLefts[c + 1] : nWidth) - nLeft;
+						auto tensorTile = vTiles[i];
+						vTiles[i] = torch::Tensor();
+
+						//! Take over the sums of the tiles above and to the left
+						if (tensorRowCarry.defined())
+						{
+							auto tensorAbove = tensorRowCarry.narrow(3, nLeft, nTileWidth);
+							tensorTile.narrow(2, 0, tensorRowCarry.size(2)).add_(tensorAbove);
+							tensorAbove.zero_();
+						}
+
+						if (tensorColCarry.defined())
+						{
+							tensorTile.narrow(3, 0, tensorColCarry.size(3)).add_(tensorColCarry);
+						}
+
+						auto tensorBlock = tensorTile.narrow(2, 0, nFinalRows).narrow(3, 0, nFinalCols);
+						tensorBlock = tensorBlock.narrow(1, 0, 4) / tensorBlock.narrow(1, 4, 1);
+						if (!fnWrite(nTop, nLeft, tensorBlock.narrow(1, 0, 1), tensorBlock.narrow(1, 1, 3)))
+						{
+							return false;
+						}
+
+						//! Pass on the sums of the rows below the block and of the columns to its right
+						if (nFinalRows < nTileHeight)
+						{
+							if (!tensorNextRowCarry.defined())
+							{
+								tensorNextRowCarry = torch::zeros({ tensorTile.size(0), 5, nTileHeight - nFinalRows, nWidth }, options);
+							}
+
+							tensorNextRowCarry.narrow(3, nLeft, nFinalCols).copy_(tensorTile.narrow(2, nFinalRows, nTileHeight - nFinalRows).narrow(3, 0, nFinalCols));
+						}
+
+						tensorColCarry = nFinalCols < nTileWidth ? tensorTile.narrow(3, nFinalCols, nTileWidth - nFinalCols) : torch::Tensor();
+					}
+				}
+
+				tensorRowCarry = tensorNextRowCarry;
+			}
+
+			return true;
+		}
+
+		//! Tiles of tensorSrc blended into fp32 pha and fgr of its size
+		void ForwardTiled(const torch::Tensor &tensorSrc, const torch::Tensor &tensorBgr, int nTileSize, torch::Tensor &tensorPha, torch::Tensor &tensorFgr)
+		{
+			const auto nHeight = static_cast<int>(tensorSrc.size(2));
+			const auto nWidth = static_cast<int>(tensorSrc.size(3));
+			auto tensorRes = torch::empty({ tensorSrc.size(0), 4, nHeight, nWidth }, tensorSrc.options().dtype(torch::kFloat32));
+
+			ForwardTiles(nHeight, nWidth, nTileSize,
+				[&](int nTop, int nLeft, int nTileHeight, int nTileWidth) {
+					return tensorSrc.narrow(2, nTop, nTileHeight).narrow(3, nLeft, nTileWidth);
+				},
+				tensorBgr,
+				[&](int nTop, int nLeft, const torch::Tensor &tensorBlockPha, const torch::Tensor &tensorBlockFgr) {
+					auto tensorDst = tensorRes.narrow(2, nTop, tensorBlockPha.size(2)).narrow(3, nLeft, tensorBlockPha.size(3));
+					tensorDst.narrow(1, 0, 1).copy_(tensorBlockPha);
+					tensorDst.narrow(1, 1, 3).copy_(tensorBlockFgr);
+					return true;
+				});
+
+			tensorPha = tensorRes.narrow(1, 0, 1);
+			tensorFgr = tensorRes.narrow(1, 1, 3);
+		}
+
+		bool TilesFrame(const QSize &size) const override
+		{
+			return m_nTileSize > 0 && !m_bCalibrating && m_tensorSrcBgr.defined() && (size.width() > m_nTileSize || size.height() > m_nTileSize);
+		}
+
+		//! Tiles are read from the scanlines of imgSrc and the blocks composited into imgDst, no tensor of the frame
+		//! size is made for the source or the result
+		bool MatteTiled(const QImage &imgSrc, QImage::Format eFormat, QImage &imgDst) override
+		{
+			FollowInputSize(imgSrc.size());
+
+			const auto img = kernel::IsIngestFormat(imgSrc.format()) ? imgSrc : imgSrc.convertToFormat(QImage::Format_RGB32);
+			const auto nHeight = img.height();
+			const auto nWidth = img.width();
+			const auto nSrcPixelBytes = img.depth() / 8;
+			const auto &tensorBgr = PaddedSrcBgr(m_tensorSrcBgr, nHeight, nWidth);
+
+			const auto eDstFormat = MatteOutput::MO_COMPOSITE == m_eOutputMode ? eFormat : WriteFormat(eFormat);
+			if (!TakeResultBuffer(nWidth, nHeight, eDstFormat, imgDst))
+			{
+				imgDst = QImage(nWidth, nHeight, eDstFormat);
+			}
+
+			QImage imgBlock;
+			const auto bOk = ForwardTiles(nHeight, nWidth, m_nTileSize,
+				[&](int nTop, int nLeft, int nTileHeight, int nTileWidth) {
+					//! The tile wraps the scanlines of img, read only
+					const QImage imgTile(img.constScanLine(nTop) + nLeft * nSrcPixelBytes, nTileWidth, nTileHeight, img.bytesPerLine(), img.format());
+					torch::Tensor tensorHost;
+					return ImageToTensor(imgTile, tensorHost);
+				},
+				tensorBgr,
+				[&](int nTop, int nLeft, const torch::Tensor &tensorBlockPha, const torch::Tensor &tensorBlockFgr) {
+					if (!Compose(tensorBlockPha, tensorBlockFgr, eFormat, imgBlock, QSize(nWidth, nHeight), QPoint(nLeft, nTop)) ||
+						imgBlock.format() != imgDst.format())
+					{
+						return false;
+					}
+
+					CopyBlock(imgBlock, imgDst, QPoint(nLeft, nTop));
+					return true;
+				});
+
+			KeepResultBuffer(imgDst);
+			return bOk;
+		}
+		//! Tile starts covering nTotal, the last tile is moved back to end at nTotal
+		QVector<int> TileOrigins(int nTotal, int nTileSize) const
+		{
+			const auto nTile = qMin(nTileSize, nTotal);
+			const auto nStep = qMax(1, nTile - m_nTileOverlap);
+
+			QVector<int> vOrigins;
+			for (int nPos = 0;; nPos += nStep)
+			{
+				if (nPos + nTile >= nTotal)
+				{
+					vOrigins.append(nTotal - nTile);
+					break;
+				}
+
+				vOrigins.append(nPos);
+			}
+
+			return vOrigins;
+		}
+
+		//! 1D weights of a tile, ramping over the overlap on the sides that have a neighbour
+		torch::Tensor FeatherWeight(int nStart, int nLength, int nTotal) const
+		{
+			auto tensorWeight = torch::ones({ nLength });
+			auto pWeight = tensorWeight.data_ptr<float>();
+			const auto nRamp = qMin(m_nTileOverlap, nLength / 2);
+
+			for (int i = 0; i < nRamp; ++i)
+			{
+				const float fWeight = (i + 1.f) / (nRamp + 1);
+				if (nStart > 0)
+				{
+					pWeight[i] = fWeight;
+				}
+
+				if (nStart + nLength < nTotal)
+				{
+					pWeight[nLength - 1 - i] = qMin(pWeight[nLength - 1 - i], fWeight);
+				}
+			}
+
+			return tensorWeight;
+		}
+
+		//! Move the rows from nFrom to the top of img
+		static void MoveRows(QImage &img, int nFrom)
+		{
+			for (int y = 0; y + nFrom < img.height(); ++y)
+			{
+				memcpy(img.scanLine(y), img.constScanLine(y + nFrom), img.bytesPerLine());
+			}
+		}
+
+		//! Copy all rows of imgBand into img from row nTo, imgBand is converted to the format of img
+		static void CopyRows(const QImage &imgBand, QImage &img, int nTo)
+		{
+			const auto imgRows = imgBand.format() == img.format() ? imgBand : imgBand.convertToFormat(img.format());
+			const auto nBytes = qMin(imgRows.bytesPerLine(), img.bytesPerLine());
+
+			for (int y = 0; y < imgRows.height(); ++y)
+			{
+				memcpy(img.scanLine(nTo + y), imgRows.constScanLine(y), nBytes);
+			}
+		}
+
+		//! Copy imgBlock into img with its top left at ptTo, both in the same format
+		static void CopyBlock(const QImage &imgBlock, QImage &img, const QPoint &ptTo)
+		{
+			const auto nPixelBytes = img.depth() / 8;
+			const auto nBytes = imgBlock.width() * nPixelBytes;
+
+			for (int y = 0; y < imgBlock.height(); ++y)
+			{
+				memcpy(img.scanLine(ptTo.y() + y) + ptTo.x() * nPixelBytes, imgBlock.constScanLine(y), nBytes);
+			}
+		}
+
+		//! The attributes follow the size of the forward() inputs, a tile for frames that are tiled
+		void ApplyInputSize(const QSize &size, int nWorkingSide) override
+		{
+			CMattePrivate::ApplyInputSize(size, nWorkingSide);
+			ApplyForwardSize(ForwardSize(size));
+		}
+
+		QSize ForwardSize(const QSize &size) const
+		{
+			if (m_nTileSize > 0 && (size.width() > m_nTileSize || size.height() > m_nTileSize))
+			{
+				return QSize(qMin(m_nTileSize, size.width()), qMin(m_nTileSize, size.height()));
+			}
+
+			return size;
+		}
+
+		//! backbone_scale brings the short side to nWorkingSide, refine_sample_pixels keeps 80000 per 1920x1080 pixels.
+		//! The refiner takes the top refine_sample_pixels / 16 of the quarter resolution error map, at most all of it.
+		void ApplyForwardSize(const QSize &size)
+		{
+			if (!m_sModelSource.hasattr("refine_mode") || size.isEmpty())
+			{
+				return;
+			}
+
+			m_sizeForward = size;
+			const auto nSide = m_nWorkingSide > 0 ? m_nWorkingSide : WORKING_SIDE_PORTRAIT;
+			const auto fScale = qMin(1.0, static_cast<double>(nSide) / qMin(size.width(), size.height()));
+			const auto nPixels = static_cast<qint64>(size.width()) * size.height();
+			const auto nMaxSamples = static_cast<qint64>(size.width() / 4) * (size.height() / 4) * 16;
+
+			m_sModelSource.setattr("backbone_scale", fScale);
+			m_sModelSource.setattr("refine_sample_pixels", static_cast<int64_t>(qMin(nPixels * REFINE_SAMPLE_PIXELS_HD / (1920 * 1080), nMaxSamples)));
+
+			//! The attributes are constants of a prepared module
+			if (m_bModuleLoaded)
+			{
+				PrepareModule();
+			}
+		}
+
+		std::string PreparedAttributes() const override
+		{
+			if (!m_sModelSource.hasattr("refine_mode"))
+			{
+				return std::string();
+			}
+
+			return m_sModelSource.attr("refine_mode").toStringRef() + "|" +
+				std::to_string(m_sModelSource.attr("backbone_scale").toDouble()) + "|" +
+				std::to_string(m_sModelSource.attr("refine_sample_pixels").toInt());
+		}
+
+		std::vector<std::string> MutableAttributes() const override
+		{
+			if (!m_sModelSource.hasattr("refine_mode"))
+			{
+				return std::vector<std::string>();
+			}
+
+			return { "refine_mode", "backbone_scale", "refine_sample_pixels" };
+		}
+
+		//! tensorBgr is a single image, broadcast over the batch of tensorSrc
+		void Forward(const torch::Tensor &tensorSrc, const torch::Tensor &tensorBgr, torch::Tensor &tensorPha, torch::Tensor &tensorFgr)
+		{
+			trace::CScope scope("model.forward");
+			auto outputs = m_sModel.forward({ tensorSrc, tensorBgr.expand({ tensorSrc.size(0), -1, -1, -1 }) }).toTuple()->elements();
+			tensorPha = outputs[0].toTensor();
+			tensorFgr = outputs[1].toTensor();
+		}
+
+		//! The clean plate tensor is read-only as well
+		void ShareModule(const CMattePrivate &other) override
+		{
+			CMattePrivate::ShareModule(other);
+
+			const auto &bgmatte = dynamic_cast<const CBgMattePrivate &>(other);
+			m_tensorSrcBgr = bgmatte.m_tensorSrcBgr;
+			m_imgSrcBgr = bgmatte.m_imgSrcBgr;
+			m_nTileSize = bgmatte.m_nTileSize;
+			m_nTileOverlap = bgmatte.m_nTileOverlap;
+			m_sizeForward = bgmatte.m_sizeForward;
+		}
+
+		//! Shots per forward() for the size, at least one
+		int BatchSize(const QSize &size) const
+		{
+			const auto nElementBytes = torch::kFloat32 == m_nPrecision ? 4 : 2;
+			const auto nShotBytes = static_cast<qint64>(size.width()) * size.height() * BATCH_CHANNELS_PER_PIXEL * nElementBytes;
+
+			return static_cast<int>(qBound<qint64>(1, m_nBatchMemoryBudget / nShotBytes, MAX_BATCH_SIZE));
+		}
+
+		static constexpr qint64 REFINE_SAMPLE_PIXELS_HD = 80000;
+
+		//! Rough peak of full resolution channels per shot: src, bgr, the outputs and the refiner working set
+		static constexpr int BATCH_CHANNELS_PER_PIXEL = 48;
+		static constexpr int MAX_BATCH_SIZE = 64;
+
+		torch::Tensor m_tensorSrcBgr;
+		//! The clean plate scaled to the shots SetImages runs, used instead of m_tensorSrcBgr while set
+		torch::Tensor m_tensorShotBgr;
+		torch::Tensor m_tensorSrcBgrPadded;
+		QImage m_imgSrcBgr;
+		torch::Tensor m_tensorBatchHost;
+		qint64 m_nBatchMemoryBudget = 1024ll * 1024 * 1024;
+		int m_nTileSize = 0;
+		int m_nTileOverlap = 64;
+		//! Size the attributes were derived for
+		QSize m_sizeForward;
+	};
+
+	class CRVMMattePrivate :public CMattePrivate
+	{
+	public:
+		CRVMMattePrivate() = default;
+		~CRVMMattePrivate() = default;
+
+		bool Infer(const torch::Tensor &tensorSrc, torch::Tensor &tensorPha, torch::Tensor &tensorFgr) override
+		{
+			CheckStateSize(QSize(static_cast<int>(tensorSrc.size(3)), static_cast<int>(tensorSrc.size(2))));
+
+			trace::CScope scope("model.forward");
+			auto outputs = m_sModel.forward({
+				tensorSrc,
+				m_tensorRec0,
+				m_tensorRec1,
+				m_tensorRec2,
+				m_tensorRec3,
+				m_fDownsampleRatio }).toList();
+
+			tensorFgr = outputs.get(0).toTensor();
+			tensorPha = outputs.get(1).toTensor();
+			m_tensorRec0 = outputs.get(2).toTensor();
+			m_tensorRec1 = outputs.get(3).toTensor();
+			m_tensorRec2 = outputs.get(4).toTensor();
+			m_tensorRec3 = outputs.get(5).toTensor();
+
+			return true;
+		}
+
+		void ApplyInputSize(const QSize &size, int nWorkingSide) override
+		{
+			CMattePrivate::ApplyInputSize(size, nWorkingSide);
+			m_fDownsampleRatio = DownsampleRatio(size, nWorkingSide);
+		}
+
+		//! downsample_ratio brings the short side to nWorkingSide, frames up to 512x512 run at full resolution
+		static float DownsampleRatio(const QSize &size, int nWorkingSide)
+		{
+			if (size.isEmpty() || (size.width() <= 512 && size.height() <= 512))
+			{
+				return 1;
+			}
+
+			const auto nSide = nWorkingSide > 0 ? nWorkingSide : WORKING_SIDE_FULL_BODY;
+			return static_cast<float>(qMin(1.0, static_cast<double>(nSide) / qMin(size.width(), size.height())));
+		}
+
+		//! The ratio a frame of size runs with, after the auto input size followed it
+		float DownsampleRatioFor(const QSize &size) const
+		{
+			return m_bAutoInputSize && size != m_sizeInput ? DownsampleRatio(size, m_nWorkingSide) : m_fDownsampleRatio;
+		}
+
+		//! The first run has no state, the following ones feed the state back like a stream does
+		void WarmUp(const QSize &sizeBucket, int nRuns) override
+		{
+			auto tensorZeros = torch::zeros({ 1, 3, sizeBucket.height(), sizeBucket.width() }, torch::TensorOptions(m_nPrecision).device(m_sDevice));
+			for (int i = 0; i < nRuns; ++i)
+			{
+				torch::Tensor tensorPha;
+				torch::Tensor tensorFgr;
+				Infer(tensorZeros, tensorPha, tensorFgr);
+			}
+
+			ResetState();
+		}
+
+		//! The recurrent state only fits frames of the size it was built from
+		void CheckStateSize(const QSize &size)
+		{
+			if (size != m_sizeState)
+			{
+				ResetState();
+				m_sizeState = size;
+			}
+		}
+
+		void ResetState() override
+		{
+			m_tensorRec0.reset();
+			m_tensorRec1.reset();
+			m_tensorRec2.reset();
+			m_tensorRec3.reset();
+		}
+
+		//! A session starts from the downsample ratio of other and with an empty state
+		void ShareModule(const CMattePrivate &other) override
+		{
+			CMattePrivate::ShareModule(other);
+			m_fDownsampleRatio = dynamic_cast<const CRVMMattePrivate &>(other).m_fDownsampleRatio;
+			ResetState();
+		}
+
+		c10::optional<torch::Tensor> m_tensorRec0;
+		c10::optional<torch::Tensor> m_tensorRec1;
+		c10::optional<torch::Tensor> m_tensorRec2;
+		c10::optional<torch::Tensor> m_tensorRec3;
+		float m_fDownsampleRatio = 0.4;
+		QSize m_sizeState;
+	};
+
+	//////////////////////////////////////////////////////////////////////////
+
+	CMattePipeline::CMattePipeline(CMattePrivate *d, int nDepth) :d(d), m_nDepth(nDepth), m_semInFlight(nDepth),
+		m_queuePre(STAGE_QUEUE_CAPACITY), m_queueInfer(STAGE_QUEUE_CAPACITY), m_queuePost(STAGE_QUEUE_CAPACITY)
+	{
+		m_threadPre = std::thread(&CMattePipeline::RunPre, this);
+		m_threadInfer = std::thread(&CMattePipeline::RunInfer, this);
+		m_threadPost = std::thread(&CMattePipeline::RunPost, this);
+	}
+
+	CMattePipeline::~CMattePipeline()
+	{
+		//! Frames already submitted are finished first
+		m_queuePre.Close();
+		m_threadPre.join();
+		m_queueInfer.Close();
+		m_threadInfer.join();
+		m_queuePost.Close();
+		m_threadPost.join();
+	}
+
+	QFuture<QImage> CMattePipeline::Submit(const QImage &imgSrc, quint64 nTag, const QImage &imgTargetBgr)
+	{
+		const auto nFrame = d->m_nNextFrame++;
+		{
+			//! Back pressure shows up as a long wait
+			trace::CScope scope("submit.wait", nFrame);
+			m_semInFlight.acquire();
+		}
+
+		auto pJob = std::make_shared<MatteJob>();
+		pJob->imgSrc = imgSrc;
+		pJob->nTag = nTag;
+		pJob->nFrame = nFrame;
+		pJob->sizeBucket = d->BucketFor(imgSrc.size());
+		pJob->imgTargetBgr = imgTargetBgr;
+		pJob->eFormat = QImage::Format_Invalid == d->m_eOutputFormat ? imgSrc.format() : d->m_eOutputFormat;
+		pJob->future.reportStarted();
+
+		auto future = pJob->future.future();
+		m_queuePre.Push(pJob);
+		return future;
+	}
+
+	void CMattePipeline::SetDepth(int nDepth)
+	{
+		if (nDepth > m_nDepth)
+		{
+			m_semInFlight.release(nDepth - m_nDepth);
+		}
+		else if (nDepth < m_nDepth)
+		{
+			m_semInFlight.acquire(m_nDepth - nDepth);
+		}
+
+		m_nDepth = nDepth;
+	}
+
+	void CMattePipeline::WaitForDone()
+	{
+		m_semInFlight.acquire(m_nDepth);
+		m_semInFlight.release(m_nDepth);
+	}
+
+	int CMattePipeline::InFlight() const
+	{
+		return qMax(0, m_nDepth - m_semInFlight.available());
+	}
+
+	void CMattePipeline::RunPre()
+	{
+		trace::SetThreadName("matte.pre");
+
+		std::shared_ptr<MatteJob> pJob;
+		while (m_queuePre.Pop(pJob))
+		{
+			trace::CScope scope("pre", pJob->nFrame);
+			alloc::CWorkspaceScope workspace(pJob->sizeBucket.width(), pJob->sizeBucket.height());
+			try
+			{
+				//! Each frame owns its host tensor, it is read while the previous frame is still in forward()
+				pJob->tensorSrc = d->ImageToTensor(pJob->imgSrc, pJob->tensorHost, &pJob->sTimes);
+
+				if (!pJob->imgTargetBgr.isNull() && MatteOutput::MO_COMPOSITE == d->m_eOutputMode)
+				{
+					pJob->pTargetBgr = std::make_shared<const TargetBgr>(d->PrepareCovering(pJob->imgTargetBgr, pJob->imgSrc.width(), pJob->imgSrc.height()));
+				}
+			}
+			catch (const std::exception &)
+			{
+				//! Passed on as failed, the frame still completes in order
+				pJob->bOk = false;
+			}
+
+			//! The pixels are in the host tensor, the caller may reuse the source now
+			pJob->imgSrc = QImage();
+			pJob->imgTargetBgr = QImage();
+			m_queueInfer.Push(std::move(pJob));
+		}
+	}
+
+	void CMattePipeline::RunInfer()
+	{
+		torch::NoGradGuard no_grad;
+		trace::SetThreadName("matte.infer");
+
+		std::shared_ptr<MatteJob> pJob;
+		while (m_queueInfer.Pop(pJob))
+		{
+			trace::CScope scope("infer", pJob->nFrame);
+			alloc::CWorkspaceScope workspace(pJob->sizeBucket.width(), pJob->sizeBucket.height());
+			const auto start = std::chrono::steady_clock::now();
+			try
+			{
+				pJob->bOk = pJob->bOk && d->InferFrame(pJob->tensorSrc, pJob->tensorPha, pJob->tensorFgr);
+			}
+			catch (const std::exception &)
+			{
+				//! A frame whose forward() throws fails alone, the thread goes on with the next one
+				pJob->bOk = false;
+			}
+
+			pJob->sTimes.fModelMs = d->ElapsedMs(start);
+			pJob->tensorSrc = torch::Tensor();
+			m_queuePost.Push(std::move(pJob));
+		}
+	}
+
+	void CMattePipeline::RunPost()
+	{
+		torch::NoGradGuard no_grad;
+		trace::SetThreadName("matte.post");
+
+		std::shared_ptr<MatteJob> pJob;
+		while (m_queuePost.Pop(pJob))
+		{
+			trace::CScope scope("post", pJob->nFrame);
+			alloc::CWorkspaceScope workspace(pJob->sizeBucket.width(), pJob->sizeBucket.height());
+			QImage imgRes;
+			try
+			{
+				if (pJob->bOk && !d->Compose(pJob->tensorPha, pJob->tensorFgr, pJob->eFormat, imgRes, QSize(), QPoint(), pJob->pTargetBgr))
+				{
+					pJob->bOk = false;
+				}
+			}
+			catch (const std::exception &)
+			{
+				pJob->bOk = false;
+			}
+
+			//! A failed frame still completes, its future and its in-flight slot are released with a null image
+			if (!pJob->bOk)
+			{
+				imgRes = QImage();
+			}
+
+			d->FinishFrame(pJob->sTimes, pJob->bOk);
+			Finish(pJob, imgRes);
+		}
+	}
+
+	void CMattePipeline::Finish(const std::shared_ptr<MatteJob> &pJob, const QImage &imgRes)
+	{
+		pJob->future.reportResult(imgRes);
+		pJob->future.reportFinished();
+
+		if (d->m_fnCompletion)
+		{
+			d->m_fnCompletion(imgRes, pJob->nTag);
+		}
+
+		m_semInFlight.release();
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+
+	CMatte::CMatte(MatteDevice eDevice)
+	{
+		d_ptr = std::make_shared<CMattePrivate>();
+		d_ptr->m_eRequestedDevice = eDevice;
+		d_ptr->m_eDevice = eDevice;
+	}
+
+	CMatte::~CMatte()
+	{
+		d_ptr->m_pPipeline.reset();
+	}
+
+	void CMatte::SetMatteResolution(MatteResolution eR)
+	{
+		switch (eR)
+		{
+		case MatteResolution::MR_SD:
+			SetInputSize(QSize(1280, 720));
+			break;
+
+		case MatteResolution::MR_HD:
+			SetInputSize(QSize(1920, 1080));
+			break;
+
+		case MatteResolution::MR_4K:
+			SetInputSize(QSize(3840, 2160));
+			break;
+
+		default:
+			Q_ASSERT_X(0, __FUNCTION__, "Type error!");
+			break;
+		}
+
+		d_ptr->m_eMatteResolution = eR;
+	}
+
+	void CMatte::SetInputSize(const QSize &size, int nWorkingSide)
+	{
+		d_ptr->ApplyInputSize(size, nWorkingSide);
+	}
+
+	QSize CMatte::GetInputSize() const
+	{
+		return d_ptr->m_sizeInput;
+	}
+
+	int CMatte::GetWorkingSide() const
+	{
+		return d_ptr->m_nWorkingSide;
+	}
+
+	void CMatte::SetShapeBuckets(const QVector<QSize> &vBuckets)
+	{
+		d_ptr->m_vBuckets = vBuckets;
+		if (d_ptr->m_bModuleLoaded)
+		{
+			d_ptr->WarmUpBuckets();
+		}
+	}
+
+	QVector<QSize> CMatte::GetShapeBuckets() const
+	{
+		return d_ptr->m_vBuckets;
+	}
+
+	void CMatte::SetAutoInputSize(bool bAuto)
+	{
+		d_ptr->m_bAutoInputSize = bAuto;
+	}
+
+	bool CMatte::GetAutoInputSize() const
+	{
+		return d_ptr->m_bAutoInputSize;
+	}
+
+	MatteResolution CMatte::GetMatteResolution() const
+	{
+		return d_ptr->m_eMatteResolution;
+	}
+
+	MatteDevice CMatte::GetDevice() const
+	{
+		return d_ptr->m_eDevice;
+	}
+
+	bool CMatte::SetPrecision(MattePrecision ePrecision)
+	{
+		d_ptr->m_eRequestedPrecision = ePrecision;
+		if (!d_ptr->m_bModuleLoaded)
+		{
+			d_ptr->m_ePrecision = ePrecision;
+			return true;
+		}
+
+		//! Loaded again, the precision is resolved and int8 calibrated for the new request
+		if (!LoadModuleFile(d_ptr->m_strModulePath))
+		{
+			return false;
+		}
+
+		return MattePrecision::MP_AUTO == ePrecision || ePrecision == d_ptr->m_ePrecision;
+	}
+
+	MattePrecision CMatte::GetPrecision() const
+	{
+		return d_ptr->m_ePrecision;
+	}
+
+	QString CMatte::GetPrecisionNote() const
+	{
+		return d_ptr->m_strPrecisionNote;
+	}
+
+	void CMatte::SetCalibrationImages(const QVector<QImage> &vImages)
+	{
+		d_ptr->m_vCalibration = vImages;
+	}
+
+	QuantizationReport CMatte::GetQuantizationReport() const
+	{
+		return d_ptr->m_sQuantReport;
+	}
+
+	void CMatte::SetModulePreparation(bool bPrepare)
+	{
+		d_ptr->m_bPrepareModule = bPrepare;
+	}
+
+	bool CMatte::GetModulePreparation() const
+	{
+		return d_ptr->m_bPrepareModule;
+	}
+
+	void CMatte::SetTargetBgrImage(const QImage & imgTargetBgr)
+	{
+		d_ptr->SetTargetBgr(imgTargetBgr);
+	}
+
+	void CMatte::SetOutputFormat(QImage::Format eFormat)
+	{
+		d_ptr->m_eOutputFormat = eFormat;
+	}
+
+	QImage::Format CMatte::GetOutputFormat() const
+	{
+		return d_ptr->m_eOutputFormat;
+	}
+
+	void CMatte::SetOutputMode(MatteOutput eMode)
+	{
+		d_ptr->m_eOutputMode = eMode;
+	}
+
+	MatteOutput CMatte::GetOutputMode() const
+	{
+		return d_ptr->m_eOutputMode;
+	}
+
+	QFuture<QImage> CMatte::Submit(const QImage &imgSrc, quint64 nTag, const QImage &imgTargetBgr)
+	{
+		if (!d_ptr->m_bModuleLoaded || imgSrc.isNull())
+		{
+			d_ptr->SkipFrame();
+
+			const QImage imgNull;
+			QFutureInterface<QImage> future(QFutureInterfaceBase::Started);
+			future.reportFinished(&imgNull);
+			return future.future();
+		}
+
+		if (!d_ptr->m_pPipeline)
+		{
+			d_ptr->m_pPipeline.reset(new CMattePipeline(d_ptr.get(), d_ptr->m_nInFlightDepth));
+		}
+
+		return d_ptr->m_pPipeline->Submit(imgSrc, nTag, imgTargetBgr);
+	}
+
+	void CMatte::SetCompletionCallback(const MatteCallback &fnCompletion)
+	{
+		d_ptr->m_fnCompletion = fnCompletion;
+	}
+
+	void CMatte::SetInFlightDepth(int nDepth)
+	{
+		nDepth = qMax(1, nDepth);
+		if (d_ptr->m_pPipeline)
+		{
+			d_ptr->m_pPipeline->SetDepth(nDepth);
+		}
+
+		d_ptr->m_nInFlightDepth = nDepth;
+	}
+
+	int CMatte::GetInFlightDepth() const
+	{
+		return d_ptr->m_nInFlightDepth;
+	}
+
+	void CMatte::WaitForDone()
+	{
+		if (d_ptr->m_pPipeline)
+		{
+			d_ptr->m_pPipeline->WaitForDone();
+		}
+	}
+
+	void CMatte::SetStageTiming(bool bEnable)
+	{
+		d_ptr->m_bStageTiming = bEnable;
+
+		QMutexLocker locker(&d_ptr->m_mutexStageTimes);
+		d_ptr->m_sLastStageTimes = MatteStageTimes();
+	}
+
+	bool CMatte::GetStageTiming() const
+	{
+		return d_ptr->m_bStageTiming;
+	}
+
+	MatteStageTimes CMatte::GetLastStageTimes() const
+	{
+		QMutexLocker locker(&d_ptr->m_mutexStageTimes);
+		return d_ptr->m_sLastStageTimes;
+	}
+
+	MatteStats CMatte::GetStats() const
+	{
+		MatteStats sStats;
+#if BGMATT_ENABLE_STATS
+		sStats = d_ptr->m_stats.Snapshot();
+#endif
+		if (d_ptr->m_pPipeline)
+		{
+			sStats.nQueueDepth = d_ptr->m_pPipeline->InFlight();
+		}
+
+		return sStats;
+	}
+
+	void CMatte::ResetStats()
+	{
+#if BGMATT_ENABLE_STATS
+		d_ptr->m_stats.Reset();
+#endif
+	}
+
+	OperatorProfileReport CMatte::ProfileOperators(const QImage &imgSrc, int nFrames, const QString &strTracePath)
+	{
+		return d_ptr->ProfileOperators(imgSrc, nFrames, strTracePath);
+	}
+
+	QImage CMatte::SetImage(const QImage & imgSrc)
+	{
+		QImage imgRes;
+		SetImage(imgSrc, imgRes);
+		return imgRes;
+	}
+
+	bool CMatte::SetImage(const QImage & imgSrc, QImage & imgDst)
+	{
+		if (!d_ptr->m_bModuleLoaded || imgSrc.isNull())
+		{
+			d_ptr->SkipFrame();
+			return false;
+		}
+
+		trace::CScope scope("frame", d_ptr->m_nNextFrame++);
+		const auto sizeBucket = d_ptr->BucketFor(imgSrc.size());
+		alloc::CWorkspaceScope workspace(sizeBucket.width(), sizeBucket.height());
+		auto eFormat = QImage::Format_Invalid == d_ptr->m_eOutputFormat ? imgSrc.format() : d_ptr->m_eOutputFormat;
+		MatteStageTimes sTimes;
+
+		//! Like a failed frame of Submit, counted as failed in the stats
+		try
+		{
+			torch::NoGradGuard no_grad;
+			if (d_ptr->TilesFrame(imgSrc.size()))
+			{
+				const auto start = std::chrono::steady_clock::now();
+				const auto bOk = d_ptr->MatteTiled(imgSrc, eFormat, imgDst);
+				sTimes.fModelMs = d_ptr->ElapsedMs(start);
+				d_ptr->FinishFrame(sTimes, bOk);
+				return bOk;
+			}
+
+			auto tensorSrc = d_ptr->ImageToTensor(imgSrc, d_ptr->m_tensorSrcHost, &sTimes);
+
+			//! Inference
+			torch::Tensor tensorPha;
+			torch::Tensor tensorFgr;
+			const auto start = std::chrono::steady_clock::now();
+			if (!d_ptr->InferFrame(tensorSrc, tensorPha, tensorFgr))
+			{
+				d_ptr->FinishFrame(sTimes, false);
+				return false;
+			}
+
+			sTimes.fModelMs = d_ptr->ElapsedMs(start);
+
+			const auto bOk = d_ptr->Compose(tensorPha, tensorFgr, eFormat, imgDst);
+			d_ptr->FinishFrame(sTimes, bOk);
+			return bOk;
+		}
+		catch (const std::exception &)
+		{
+			d_ptr->FinishFrame(sTimes, false);
+			return false;
+		}
+	}
+
+	QImage CMatte::SetImage(const QString &strSrcAbsolutePath, const QString &strBgrAbsolutePath)
+	{
+		if (!d_ptr->m_bModuleLoaded)
+		{
+			return QImage();
+		}
+
+		//! Load image
+		QImage imgSrc(strSrcAbsolutePath);
+		QImage imgBg(strBgrAbsolutePath);
+
+		if (imgSrc.isNull() || imgBg.isNull())
+		{
+			return QImage();
+		}
+
+		//! The background is the clean plate of BackgroundMattingV2, RobustVideoMatting only takes its format
+		SetSrcBgrImage(imgBg);
+
+		QImage imgRes;
+		if (!SetImage(imgSrc, imgRes))
+		{
+			return QImage();
+		}
+
+		if (QImage::Format_Invalid == d_ptr->m_eOutputFormat && MatteOutput::MO_COMPOSITE == d_ptr->m_eOutputMode && imgRes.format() != imgBg.format())
+		{
+			imgRes = imgRes.convertToFormat(imgBg.format());
+		}
+
+		return imgRes;
+	}
+
+	CMatte::CMatte(std::shared_ptr<CMattePrivate> d, MatteDevice eDevice) :d_ptr(d)
+	{
+		d_ptr->m_eRequestedDevice = eDevice;
+		d_ptr->m_eDevice = eDevice;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+
+	CBgMatte::CBgMatte(MatteDevice eDevice):CMatte(std::make_shared<CBgMattePrivate>(), eDevice)
+	{
+
+	}
+
+	bool CBgMatte::LoadModuleFile(const QString &strModuleAbsolutePath)
+	{
+		if (!QFile::exists(strModuleAbsolutePath) || !d_ptr->ResolveDevice())
+		{
+			return false;
+		}
+
+		d_ptr->LoadModule(strModuleAbsolutePath);
+		d_ptr->m_sModelSource.setattr("refine_mode", "sampling");
+		d_ptr->m_bModuleLoaded = true;
+
+		//! Also prepares the module with the attributes of the input size
+		d_ptr->ApplyInputSize(d_ptr->m_sizeInput, d_ptr->m_nWorkingSide);
+
+		//! Images set before loading are uploaded again for the resolved device
+		d_ptr->ResetTargetBgr();
+		SetSrcBgrImage(std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr)->m_imgSrcBgr);
+
+		//! Loaded again in fp32, with the clean plate uploaded again
+		if (!d_ptr->ProbeBf16())
+		{
+			return LoadModuleFile(strModuleAbsolutePath);
+		}
+
+		if (MattePrecision::MP_INT8 == d_ptr->m_eRequestedPrecision)
+		{
+			d_ptr->QuantizeInt8();
+		}
+
+		d_ptr->WarmUpBuckets();
+
+		return true;
+	}
+
+	bool CBgMatte::SetSrcBgrImage(const QImage & imgBgr)
+	{
+		if (imgBgr.isNull())
+		{
+			return false;
+		}
+
+		auto pBgmatte = std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr);
+		pBgmatte->m_imgSrcBgr = imgBgr;
+
+		torch::Tensor tensorHost;
+		pBgmatte->m_tensorSrcBgr = d_ptr->ImageToTensor(imgBgr, tensorHost);
+		pBgmatte->m_tensorSrcBgrPadded = torch::Tensor();
+
+		return true;
+	}
+
+	QVector<QImage> CBgMatte::SetImages(const QVector<QImage> &vSrc)
+	{
+		auto pBgmatte = std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr);
+		QVector<QImage> vRes(vSrc.size());
+
+		if (!d_ptr->m_bModuleLoaded || !pBgmatte->m_tensorSrcBgr.defined())
+		{
+			return vRes;
+		}
+
+		//! Group the shots by size, in order of first appearance
+		QVector<QPair<QSize, QVector<int>>> vGroups;
+		for (int i = 0; i < vSrc.size(); ++i)
+		{
+			if (vSrc[i].isNull())
+			{
+				continue;
+			}
+
+			auto it = std::find_if(vGroups.begin(), vGroups.end(), [&](const QPair<QSize, QVector<int>> &group) {
+				return group.first == vSrc[i].size();
+			});
+
+			if (vGroups.end() == it)
+			{
+				vGroups.append(qMakePair(vSrc[i].size(), QVector<int>()));
+				it = vGroups.end() - 1;
+			}
+
+			it->second.append(i);
+		}
+
+		torch::NoGradGuard no_grad;
+		const auto sBgrSize = pBgmatte->m_imgSrcBgr.size();
+
+		for (const auto &group : vGroups)
+		{
+			const auto nBatch = pBgmatte->BatchSize(group.first);
+			const auto &vIndex = group.second;
+			alloc::CWorkspaceScope workspace(group.first.width(), group.first.height());
+
+			//! The clean plate is scaled for shots of another size, the padded plate of the last size is stale then
+			bool bPlate = true;
+			pBgmatte->m_tensorSrcBgrPadded = torch::Tensor();
+			if (group.first != sBgrSize)
+			{
+				try
+				{
+					torch::Tensor tensorHost;
+					pBgmatte->m_tensorShotBgr = d_ptr->ImageToTensor(pBgmatte->m_imgSrcBgr.scaled(group.first, Qt::IgnoreAspectRatio, Qt::SmoothTransformation), tensorHost);
+				}
+				catch (const std::exception &)
+				{
+					bPlate = false;
+				}
+			}
+
+			for (int nBegin = 0; nBegin < vIndex.size(); nBegin += nBatch)
+			{
+				const auto nCount = qMin(nBatch, vIndex.size() - nBegin);
+
+				QVector<QImage> vBatch(nCount);
+				for (int i = 0; i < nCount; ++i)
+				{
+					vBatch[i] = vSrc[vIndex[nBegin + i]];
+				}
+
+				//! Buckets, the input size and tiling apply to a batch as to a frame, a throwing batch leaves its results null
+				MatteStageTimes sTimes;
+				torch::Tensor tensorPha;
+				torch::Tensor tensorFgr;
+				bool bOk = false;
+				try
+				{
+					if (bPlate)
+					{
+						auto tensorSrc = d_ptr->ImagesToTensor(vBatch.constData(), nCount, pBgmatte->m_tensorBatchHost, &sTimes);
+
+						const auto start = std::chrono::steady_clock::now();
+						bOk = d_ptr->InferFrame(tensorSrc, tensorPha, tensorFgr);
+						sTimes.fModelMs = d_ptr->ElapsedMs(start);
+					}
+				}
+				catch (const std::exception &)
+				{
+					bOk = false;
+				}
+
+				//! The shots of a batch share its ingest and forward() time
+				sTimes.fIngestMs /= nCount;
+				sTimes.fUploadMs /= nCount;
+				sTimes.fModelMs /= nCount;
+
+				for (int i = 0; i < nCount; ++i)
+				{
+					const auto nIndex = vIndex[nBegin + i];
+					auto eFormat = QImage::Format_Invalid == d_ptr->m_eOutputFormat ? vSrc[nIndex].format() : d_ptr->m_eOutputFormat;
+
+					bool bShotOk = false;
+					try
+					{
+						bShotOk = bOk && d_ptr->Compose(tensorPha.narrow(0, i, 1), tensorFgr.narrow(0, i, 1), eFormat, vRes[nIndex]);
+					}
+					catch (const std::exception &)
+					{
+						bShotOk = false;
+					}
+
+					if (!bShotOk)
+					{
+						vRes[nIndex] = QImage();
+					}
+
+					d_ptr->FinishFrame(sTimes, bShotOk);
+				}
+			}
+
+			pBgmatte->m_tensorShotBgr = torch::Tensor();
+		}
+
+		pBgmatte->m_tensorSrcBgrPadded = torch::Tensor();
+		return vRes;
+	}
+
+	void CBgMatte::SetTiling(int nTileSize, int nOverlap)
+	{
+		auto pBgmatte = std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr);
+		pBgmatte->m_nTileSize = qMax(0, nTileSize);
+		pBgmatte->m_nTileOverlap = qBound(0, nOverlap, nTileSize / 2);
+
+		//! Tiled frames run forward() on tiles, the attributes follow
+		if (d_ptr->m_bModuleLoaded)
+		{
+			d_ptr->ApplyInputSize(d_ptr->m_sizeInput, d_ptr->m_nWorkingSide);
+		}
+	}
+
+	int CBgMatte::GetTileSize() const
+	{
+		return std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr)->m_nTileSize;
+	}
+
+	int CBgMatte::GetTileOverlap() const
+	{
+		return std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr)->m_nTileOverlap;
+	}
+
+	bool CBgMatte::SetImageStreamed(const QSize &size, const BandReader &fnReadSrc, const BandReader &fnReadBgr, const BandWriter &fnWrite)
+	{
+		auto pBgmatte = std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr);
+		if (!d_ptr->m_bModuleLoaded || size.isEmpty())
+		{
+			return false;
+		}
+
+		const auto nWidth = size.width();
+		const auto nHeight = size.height();
+		const auto nTileSize = pBgmatte->m_nTileSize > 0 ? pBgmatte->m_nTileSize : DEFAULT_STREAM_TILE_SIZE;
+		const auto nWindow = qMin(nTileSize, nHeight);
+		const auto vTops = pBgmatte->TileOrigins(nHeight, nTileSize);
+
+		//! A window of nWindow rows slides down the frame, the overlap with the previous window is kept
+		QImage imgSrc(nWidth, nWindow, QImage::Format_RGB32);
+		QImage imgBgr(nWidth, nWindow, QImage::Format_RGB32);
+		torch::Tensor tensorSrcHost;
+		torch::Tensor tensorBgrHost;
+		//! Two accumulators for the whole frame, the overlap moves from one to the other between windows
+		torch::Tensor tensorAcc = torch::zeros({ 1, 4, nWindow, nWidth });
+		torch::Tensor tensorWeight = torch::zeros({ 1, 1, nWindow, 1 });
+		torch::Tensor tensorAccNext = torch::zeros_like(tensorAcc);
+		torch::Tensor tensorWeightNext = torch::zeros_like(tensorWeight);
+		torch::Tensor tensorBandBuffer = torch::empty_like(tensorAcc);
+		auto eFormat = d_ptr->m_eOutputFormat;
+		int nRead = 0;
+		bool bOk = true;
+
+		//! forward() runs on tiles of the window, the attributes follow until the frame is done
+		const auto sizeForward = pBgmatte->m_sizeForward;
+		pBgmatte->ApplyForwardSize(QSize(qMin(nTileSize, nWidth), nWindow));
+
+		torch::NoGradGuard no_grad;
+
+		for (int k = 0; k < vTops.size(); ++k)
+		{
+			const auto nTop = vTops[k];
+			if (k > 0)
+			{
+				CBgMattePrivate::MoveRows(imgSrc, nTop - vTops[k - 1]);
+				CBgMattePrivate::MoveRows(imgBgr, nTop - vTops[k - 1]);
+			}
+
+			const auto nRows = nTop + nWindow - nRead;
+			const auto imgSrcBand = fnReadSrc(nRead, nRows);
+			const auto imgBgrBand = fnReadBgr(nRead, nRows);
+			if (imgSrcBand.size() != QSize(nWidth, nRows) || imgBgrBand.size() != QSize(nWidth, nRows))
+			{
+				bOk = false;
+				break;
+			}
+
+			if (QImage::Format_Invalid == eFormat)
+			{
+				eFormat = imgSrcBand.format();
+			}
+
+			CBgMattePrivate::CopyRows(imgSrcBand, imgSrc, nRead - nTop);
+			CBgMattePrivate::CopyRows(imgBgrBand, imgBgr, nRead - nTop);
+			nRead += nRows;
+
+			torch::Tensor tensorPha;
+			torch::Tensor tensorFgr;
+			pBgmatte->ForwardTiled(d_ptr->ImageToTensor(imgSrc, tensorSrcHost), d_ptr->ImageToTensor(imgBgr, tensorBgrHost), nTileSize, tensorPha, tensorFgr);
+
+			//! Feather the window against its neighbours above and below
+			auto tensorWindowWeight = pBgmatte->FeatherWeight(nTop, nWindow, nHeight).view({ 1, 1, -1, 1 });
+			tensorAcc.add_(torch::cat({ tensorPha, tensorFgr }, 1).to(torch::kCPU, torch::kFloat32).mul_(tensorWindowWeight));
+			tensorWeight.add_(tensorWindowWeight);
+
+			//! Rows above the next window are final
+			const auto nDone = k + 1 < vTops.size() ? vTops[k + 1] - nTop : nWindow;
+			auto tensorBand = tensorBandBuffer.narrow(2, 0, nDone);
+			torch::div_out(tensorBand, tensorAcc.narrow(2, 0, nDone), tensorWeight.narrow(2, 0, nDone));
+
+			QImage imgRes;
+			if (!d_ptr->Compose(tensorBand.narrow(1, 0, 1).to(d_ptr->m_sDevice), tensorBand.narrow(1, 1, 3).to(d_ptr->m_sDevice), eFormat, imgRes, size, QPoint(0, nTop)) ||
+				!fnWrite(nTop, imgRes))
+			{
+				bOk = false;
+				break;
+			}
+
+			//! Carry the overlap into the next window
+			const auto nCarry = nWindow - nDone;
+			tensorAccNext.zero_();
+			tensorWeightNext.zero_();
+			tensorAccNext.narrow(2, 0, nCarry).copy_(tensorAcc.narrow(2, nDone, nCarry));
+			tensorWeightNext.narrow(2, 0, nCarry).copy_(tensorWeight.narrow(2, nDone, nCarry));
+			std::swap(tensorAcc, tensorAccNext);
+			std::swap(tensorWeight, tensorWeightNext);
+		}
+
+		if (sizeForward.isValid() && sizeForward != pBgmatte->m_sizeForward)
+		{
+			pBgmatte->ApplyForwardSize(sizeForward);
+		}
+
+		return bOk;
+	}
+
+	void CBgMatte::SetBatchMemoryBudget(qint64 nBytes)
+	{
+		std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr)->m_nBatchMemoryBudget = nBytes;
+	}
+
+	qint64 CBgMatte::GetBatchMemoryBudget() const
+	{
+		return std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr)->m_nBatchMemoryBudget;
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+
+	CRVMMatte::CRVMMatte(MatteDevice eDevice) :CMatte(std::make_shared<CRVMMattePrivate>(), eDevice)
+	{
+
+	}
+
+	bool CRVMMatte::LoadModuleFile(const QString & strModuleAbsolutePath)
+	{
+		if (!QFile::exists(strModuleAbsolutePath) || !d_ptr->ResolveDevice())
+		{
+			return false;
+		}
+
+		d_ptr->LoadModule(strModuleAbsolutePath);
+
+		//! Optionally, freeze the model. This will trigger graph optimization, such as BatchNorm fusion etc. Frozen models are faster.
+		d_ptr->PrepareModule();
+		d_ptr->m_bModuleLoaded = true;
+		d_ptr->ApplyInputSize(d_ptr->m_sizeInput, d_ptr->m_nWorkingSide);
+
+		//! The target background is uploaded for the resolved device on the next composite
+		d_ptr->ResetTargetBgr();
+
+		//! Loaded again in fp32
+		if (!d_ptr->ProbeBf16())
+		{
+			return LoadModuleFile(strModuleAbsolutePath);
+		}
+
+		if (MattePrecision::MP_INT8 == d_ptr->m_eRequestedPrecision)
+		{
+			d_ptr->QuantizeInt8();
+		}
+
+		d_ptr->WarmUpBuckets();
+
+		return true;
+	}
+
+	std::unique_ptr<CRVMMatte> CRVMMatte::CreateSession() const
+	{
+		std::unique_ptr<CRVMMatte> pSession(new CRVMMatte(d_ptr->m_eRequestedDevice));
+		pSession->d_ptr->ShareModule(*d_ptr);
+		pSession->d_ptr->SetTargetBgr(d_ptr->GetTargetBgr());
+		pSession->d_ptr->m_eOutputFormat = d_ptr->m_eOutputFormat;
+		pSession->d_ptr->m_eOutputMode = d_ptr->m_eOutputMode;
+
+		return pSession;
+	}
+
+	void CRVMMatte::ResetState()
+	{
+		std::dynamic_pointer_cast<CRVMMattePrivate>(d_ptr)->ResetState();
+	}
+
+	//////////////////////////////////////////////////////////////////////////
+
+	class CMattePoolPrivate
+	{
+	public:
+		//! One frame of the pool, seq is the submission order
+		struct PoolJob
+		{
+			quint64 nSeq = 0;
+			quint64 nTag = 0;
+			QImage imgSrc;
+			QImage imgRes;
+			QFutureInterface<QImage> future;
+		};
+
+		//! One queued frame per context, the rest wait in Submit
+		CMattePoolPrivate(int nContexts, MatteDevice eDevice) :m_queue(static_cast<size_t>(qMax(1, nContexts)))
+		{
+			for (int i = 0; i < qMax(1, nContexts); ++i)
+			{
+				m_vContexts.emplace_back(new CBgMatte(eDevice));
+			}
+
+			m_nIntraOpThreads = qMax(1, QThread::idealThreadCount() / static_cast<int>(m_vContexts.size()));
+			m_nDepth = 2 * static_cast<int>(m_vContexts.size());
+			m_semInFlight.release(m_nDepth);
+		}
+
+		~CMattePoolPrivate()
+		{
+			m_queue.Close();
+			for (auto &thread : m_vWorkers)
+			{
+				thread.join();
+			}
+		}
+
+		//! Holds every in-flight slot while it lives: the submitted frames are done and Submit waits.
+		//! Not from the completion callback, its frame still holds a slot.
+		class CDrained
+		{
+		public:
+			explicit CDrained(CMattePoolPrivate *d) :d(d)
+			{
+				d->m_semInFlight.acquire(d->m_nDepth);
+			}
+
+			~CDrained()
+			{
+				d->m_semInFlight.release(d->m_nDepth);
+			}
+
+		private:
+			CMattePoolPrivate *d;
+		};
+
+		bool IsLoaded() const
+		{
+			return m_vContexts[0]->d_ptr->m_bModuleLoaded;
+		}
+
+		//! Context 0 owns the module and clean plate, the others share the weights and copy the rest
+		void SyncContexts()
+		{
+			const auto &d0 = *m_vContexts[0]->d_ptr;
+			for (size_t i = 1; i < m_vContexts.size(); ++i)
+			{
+				m_vContexts[i]->d_ptr->ShareModule(d0);
+			}
+		}
+
+		void Start()
 		{
-			auto bCuda = torch::cuda::is_available();
-			auto bCudnn = torch::cuda::cudnn_is_available();
-			if (!bCuda || !bCudnn)
+			if (!m_vWorkers.empty())
 			{
-				return false;
+				return;
 			}
 
-			return true;
+			for (size_t i = 0; i < m_vContexts.size(); ++i)
+			{
+				m_vWorkers.emplace_back(&CMattePoolPrivate::Run, this, m_vContexts[i].get());
+			}
 		}
 
-		torch::jit::Module m_sModel;
-		torch::Tensor m_tensorTargetBgr;
-		QByteArray m_arrayResCache;
+		void Run(CBgMatte *pContext)
+		{
+			//! Under OpenMP, the backend of the libtorch builds, the thread count is per calling thread and each
+			//! context gets its budget. The native backend has one process-wide pool sized by the first call.
+			at::set_num_threads(m_nIntraOpThreads);
 
-		bgmatt::MatteResolution m_eMatteResolution = bgmatt::MatteResolution::MR_HD;
-		torch::Device m_sDevice = torch::Device("cuda");
-		c10::ScalarType m_nPrecision = torch::kFloat16;
-	};
+			std::shared_ptr<PoolJob> pJob;
+			while (m_queue.Pop(pJob))
+			{
+				bool bOk = false;
+				try
+				{
+					bOk = pContext->SetImage(pJob->imgSrc, pJob->imgRes);
+				}
+				catch (const std::exception &)
+				{
+					//! Counted like a frame forward() refused, the worker goes on with the next job
+					pContext->d_ptr->FinishFrame(MatteStageTimes(), false);
+				}
+
+				//! A failed frame is delivered in order as a null image
+				if (!bOk)
+				{
+					pJob->imgRes = QImage();
+				}
+
+				pJob->imgSrc = QImage();
+				Deliver(pJob);
+			}
+		}
 
-	class CBgMattePrivate :public CMattePrivate
-	{
-	public:
-		CBgMattePrivate() = default;
-		~CBgMattePrivate() = default;
+		//! Complete the finished frames that are next in submission order
+		void Deliver(const std::shared_ptr<PoolJob> &pJob)
+		{
+			QMutexLocker locker(&m_mutexOrder);
+			m_mapDone[pJob->nSeq] = pJob;
 
-		torch::Tensor m_tensorSrcBgr;
-	};
+			for (auto it = m_mapDone.begin(); it != m_mapDone.end() && it->first == m_nNextDeliver; it = m_mapDone.erase(it))
+			{
+				auto &job = *it->second;
+				job.future.reportResult(job.imgRes);
+				job.future.reportFinished();
 
-	class CRVMMattePrivate :public CMattePrivate
-	{
-	public:
-		CRVMMattePrivate() = default;
-		~CRVMMattePrivate() = default;
+				if (m_fnCompletion)
+				{
+					m_fnCompletion(job.imgRes, job.nTag);
+				}
 
-		c10::optional<torch::Tensor> m_tensorRec0;
-		c10::optional<torch::Tensor> m_tensorRec1;
-		c10::optional<torch::Tensor> m_tensorRec2;
-		c10::optional<torch::Tensor> m_tensorRec3;
-		float m_fDownsampleRatio = 0.4;
-	};
+				++m_nNextDeliver;
+				m_semInFlight.release();
+			}
+		}
 
-	//////////////////////////////////////////////////////////////////////////
+		std::vector<std::unique_ptr<CBgMatte>> m_vContexts;
+		std::vector<std::thread> m_vWorkers;
+		CBlockingQueue<std::shared_ptr<PoolJob>> m_queue;
+		QMutex m_mutexOrder;
+		std::map<quint64, std::shared_ptr<PoolJob>> m_mapDone;
+		quint64 m_nNextSeq = 0;
+		quint64 m_nNextDeliver = 0;
+		QSemaphore m_semInFlight;
+		int m_nDepth = 0;
+		int m_nIntraOpThreads = 1;
+		MatteCallback m_fnCompletion;
+	};
 
-	CMatte::CMatte()
+	CMattePool::CMattePool(int nContexts, MatteDevice eDevice) :d_ptr(std::make_shared<CMattePoolPrivate>(nContexts, eDevice))
 	{
-		d_ptr = std::make_shared<CMattePrivate>();
-		d_ptr->m_tensorTargetBgr = torch::tensor({ 120.f / 255, 255.f / 255, 155.f / 255 }).toType(d_ptr->m_nPrecision).to(d_ptr->m_sDevice).view({ 1, 3, 1, 1 });
+
 	}
 
-	MatteResolution CMatte::GetMatteResolution() const
+	CMattePool::~CMattePool()
 	{
-		return d_ptr->m_eMatteResolution;
+
 	}
 
-	void CMatte::SetTargetBgrImage(const QImage & imgTargetBgr)
+	bool CMattePool::LoadModuleFile(const QString &strModuleAbsolutePath)
 	{
-		if (imgTargetBgr.isNull())
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		if (!d_ptr->m_vContexts[0]->LoadModuleFile(strModuleAbsolutePath))
 		{
-			d_ptr->m_tensorTargetBgr = torch::tensor({ 120.f / 255, 255.f / 255, 155.f / 255 }).toType(d_ptr->m_nPrecision).to(d_ptr->m_sDevice).view({ 1, 3, 1, 1 });
-			return;
+			return false;
 		}
 
-		//! Load image
-		QImage imgBg(imgTargetBgr);
+		d_ptr->SyncContexts();
+		return true;
+	}
 
-		//! Convert to RGB
-		imgBg = imgBg.convertToFormat(QImage::Format_RGB888);
+	int CMattePool::GetContextCount() const
+	{
+		return static_cast<int>(d_ptr->m_vContexts.size());
+	}
 
-		auto tensorBg = torch::from_blob(imgBg.bits(), { imgBg.height(),imgBg.width(),3 }, torch::kByte);
-		tensorBg = tensorBg.to(d_ptr->m_sDevice);
-		tensorBg = tensorBg.permute({ 2,0,1 }).contiguous();
-		d_ptr->m_tensorTargetBgr = tensorBg.to(d_ptr->m_nPrecision).div(255);
-		d_ptr->m_tensorTargetBgr.unsqueeze_(0);
+	MatteDevice CMattePool::GetDevice() const
+	{
+		return d_ptr->m_vContexts[0]->GetDevice();
+	}
 
-		return;
+	void CMattePool::SetModulePreparation(bool bPrepare)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		d_ptr->m_vContexts[0]->SetModulePreparation(bPrepare);
 	}
 
-	QImage CMatte::SetImage(const QString &strSrcAbsolutePath, const QString &strBgrAbsolutePath)
+	bool CMattePool::SetPrecision(MattePrecision ePrecision)
 	{
-		if (!d_ptr->IsCudaAvailable())
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		const auto bOk = d_ptr->m_vContexts[0]->SetPrecision(ePrecision);
+		if (d_ptr->IsLoaded())
 		{
-			return QImage();
+			d_ptr->SyncContexts();
 		}
 
-		//! Load image
-		QImage imgSrc(strSrcAbsolutePath);
-		QImage imgBg(strBgrAbsolutePath);
+		return bOk;
+	}
 
-		if (imgSrc.isNull() || imgBg.isNull())
-		{
-			return QImage();
-		}
+	void CMattePool::SetCalibrationImages(const QVector<QImage> &vImages)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		d_ptr->m_vContexts[0]->SetCalibrationImages(vImages);
+	}
 
-		auto formatBg = imgBg.format();
+	QuantizationReport CMattePool::GetQuantizationReport() const
+	{
+		return d_ptr->m_vContexts[0]->GetQuantizationReport();
+	}
 
-		//! Convert formatBg to RGB
-		imgSrc = imgSrc.convertToFormat(QImage::Format_RGB888);
-		imgBg = imgBg.convertToFormat(QImage::Format_RGB888);
+	void CMattePool::SetMatteResolution(MatteResolution eR)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		d_ptr->m_vContexts[0]->SetMatteResolution(eR);
+		d_ptr->SyncContexts();
+	}
 
-		auto tensorSrc = torch::from_blob(imgSrc.bits(), { imgSrc.height(),imgSrc.width(),3 }, torch::kByte);
-		tensorSrc = tensorSrc.to(d_ptr->m_sDevice);
-		tensorSrc = tensorSrc.permute({ 2,0,1 }).contiguous();
-		auto tmpSrc = tensorSrc.to(d_ptr->m_nPrecision).div(255);
-		tmpSrc.unsqueeze_(0);
-		tmpSrc = tmpSrc.to(d_ptr->m_nPrecision);
+	void CMattePool::SetInputSize(const QSize &size, int nWorkingSide)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		d_ptr->m_vContexts[0]->SetInputSize(size, nWorkingSide);
+		d_ptr->SyncContexts();
+	}
 
-		auto tensorBg = torch::from_blob(imgBg.bits(), { imgBg.height(),imgBg.width(),3 }, torch::kByte);
-		tensorBg = tensorBg.to(d_ptr->m_sDevice);
-		tensorBg = tensorBg.permute({ 2,0,1 }).contiguous();
-		auto tmpBg = tensorBg.to(d_ptr->m_nPrecision).div(255);
-		tmpBg.unsqueeze_(0);
-		tmpBg = tmpBg.to(d_ptr->m_nPrecision);
+	void CMattePool::SetShapeBuckets(const QVector<QSize> &vBuckets)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		//! The contexts share the module and with it the graphs warmed up by context 0
+		d_ptr->m_vContexts[0]->SetShapeBuckets(vBuckets);
+		d_ptr->SyncContexts();
+	}
 
-		//! Inference
-		//torch::NoGradGuard no_grad;
-		auto outputs = d_ptr->m_sModel.forward({ tmpSrc, tmpBg }).toTuple()->elements();
+	bool CMattePool::SetSrcBgrImage(const QImage &imgBgr)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		if (!d_ptr->m_vContexts[0]->SetSrcBgrImage(imgBgr))
+		{
+			return false;
+		}
 
-		auto pha = outputs[0].toTensor();
-		auto fgr = outputs[1].toTensor();
-		auto tgt_bgr = torch::tensor({ 120.f / 255, 255.f / 255, 155.f / 255 }).toType(d_ptr->m_nPrecision).to(d_ptr->m_sDevice).view({ 1, 3, 1, 1 });
+		d_ptr->SyncContexts();
+		return true;
+	}
 
-		auto res_tensor = pha * fgr + (1 - pha) * tgt_bgr;
-		res_tensor = res_tensor.mul(255).to(torch::kUInt8).cpu().permute({ 0,2,3,1 });
-		res_tensor.squeeze_(0);
-		res_tensor = res_tensor.contiguous();
+	void CMattePool::SetTiling(int nTileSize, int nOverlap)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		d_ptr->m_vContexts[0]->SetTiling(nTileSize, nOverlap);
+		d_ptr->SyncContexts();
+	}
 
-		d_ptr->m_arrayResCache = QByteArray(static_cast<char *>(res_tensor.data_ptr()), res_tensor.size(1)*res_tensor.size(0)*res_tensor.size(2));
-		QImage imgRes(reinterpret_cast<uchar *>(d_ptr->m_arrayResCache.data()), res_tensor.size(1), res_tensor.size(0), QImage::Format_RGB888);
-		return imgRes.convertToFormat(formatBg);
+	void CMattePool::SetTargetBgrImage(const QImage &imgTargetBgr)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		for (auto &pContext : d_ptr->m_vContexts)
+		{
+			pContext->SetTargetBgrImage(imgTargetBgr);
+		}
 	}
 
-	CMatte::CMatte(std::shared_ptr<CMattePrivate> d) :d_ptr(d)
+	void CMattePool::SetOutputFormat(QImage::Format eFormat)
 	{
-		d_ptr->m_tensorTargetBgr = torch::tensor({ 120.f / 255, 255.f / 255, 155.f / 255 }).toType(d_ptr->m_nPrecision).to(d_ptr->m_sDevice).view({ 1, 3, 1, 1 });
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		for (auto &pContext : d_ptr->m_vContexts)
+		{
+			pContext->SetOutputFormat(eFormat);
+		}
 	}
 
-	//////////////////////////////////////////////////////////////////////////
+	void CMattePool::SetOutputMode(MatteOutput eMode)
+	{
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		for (auto &pContext : d_ptr->m_vContexts)
+		{
+			pContext->SetOutputMode(eMode);
+		}
+	}
 
-	CBgMatte::CBgMatte():CMatte(std::make_shared<CBgMattePrivate>())
+	bool CMattePool::SetIntraOpThreads(int nThreads)
 	{
+		//! Each worker sets its budget once when it starts
+		if (!d_ptr->m_vWorkers.empty())
+		{
+			return false;
+		}
+
+		d_ptr->m_nIntraOpThreads = qMax(1, nThreads);
+		return true;
+	}
 
+	int CMattePool::GetIntraOpThreads() const
+	{
+		return d_ptr->m_nIntraOpThreads;
 	}
 
-	bool CBgMatte::LoadModuleFile(const QString &strModuleAbsolutePath)
+	void CMattePool::SetCompletionCallback(const MatteCallback &fnCompletion)
 	{
-		if (!d_ptr->IsCudaAvailable() || !QFile::exists(strModuleAbsolutePath))
+		CMattePoolPrivate::CDrained drained(d_ptr.get());
+		d_ptr->m_fnCompletion = fnCompletion;
+	}
+
+	void CMattePool::SetInFlightDepth(int nDepth)
+	{
+		nDepth = qMax(1, nDepth);
+		if (nDepth > d_ptr->m_nDepth)
 		{
-			return false;
+			d_ptr->m_semInFlight.release(nDepth - d_ptr->m_nDepth);
 		}
+		else if (nDepth < d_ptr->m_nDepth)
+		{
+			d_ptr->m_semInFlight.acquire(d_ptr->m_nDepth - nDepth);
+		}
+
+		d_ptr->m_nDepth = nDepth;
+	}
 
-		d_ptr->m_sModel = torch::jit::load(strModuleAbsolutePath.toStdString());
-		d_ptr->m_sModel.setattr("refine_mode", "sampling");
-		d_ptr->m_sModel.to(d_ptr->m_sDevice);
+	int CMattePool::GetInFlightDepth() const
+	{
+		return d_ptr->m_nDepth;
+	}
 
-		SetMatteResolution(d_ptr->m_eMatteResolution);
+	QFuture<QImage> CMattePool::Submit(const QImage &imgSrc, quint64 nTag)
+	{
+		d_ptr->m_semInFlight.acquire();
+		d_ptr->Start();
+
+		auto pJob = std::make_shared<CMattePoolPrivate::PoolJob>();
+		pJob->nSeq = d_ptr->m_nNextSeq++;
+		pJob->nTag = nTag;
+		pJob->imgSrc = imgSrc;
+		pJob->future.reportStarted();
+
+		auto future = pJob->future.future();
+		d_ptr->m_queue.Push(pJob);
+		return future;
+	}
 
-		return true;
+	void CMattePool::WaitForDone()
+	{
+		d_ptr->m_semInFlight.acquire(d_ptr->m_nDepth);
+		d_ptr->m_semInFlight.release(d_ptr->m_nDepth);
 	}
 
-	void CBgMatte::SetMatteResolution(MatteResolution eR)
+	//////////////////////////////////////////////////////////////////////////
+
+	class CRVMBatcherPrivate
 	{
-		switch (eR)
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		struct StreamFrame
+		{
+			QImage imgSrc;
+			quint64 nTag = 0;
+			QImage::Format eFormat = QImage::Format_Invalid;
+			Clock::time_point tArrival;
+			QFutureInterface<QImage> future;
+		};
+
+		//! Only the head frame of a stream can join a batch, the next one needs the state it produces
+		struct Stream
 		{
+			std::unique_ptr<CRVMMatte> pSession;
+			std::deque<std::shared_ptr<StreamFrame>> queueFrames;
+			bool bBusy = false;
+		};
 
-		case MatteResolution::MR_HD:
+		//! Frames of one batch share the size, the bucket and the downsample ratio
+		struct BatchEntry
 		{
-			if (d_ptr->m_sModel.hasattr("refine_mode"))
-			{
-				d_ptr->m_sModel.setattr("backbone_scale", 0.25);
-				d_ptr->m_sModel.setattr("refine_sample_pixels", 80000);
-			}
+			int nStream = 0;
+			CRVMMattePrivate *d = nullptr;
+			std::shared_ptr<StreamFrame> pFrame;
+		};
+
+		CRVMBatcherPrivate()
+		{
+			m_thread = std::thread(&CRVMBatcherPrivate::Run, this);
 		}
-			break;
 
-		case MatteResolution::MR_4K:
+		~CRVMBatcherPrivate()
 		{
-			if (d_ptr->m_sModel.hasattr("refine_mode"))
 			{
-				d_ptr->m_sModel.setattr("backbone_scale", 0.125);
-				d_ptr->m_sModel.setattr("refine_sample_pixels", 320000);
+				QMutexLocker locker(&m_mutex);
+				m_bExit = true;
+				m_condition.wakeAll();
 			}
-		}
-			break;
 
-		case MatteResolution::MR_SD:
-		default:
-			Q_ASSERT_X(0, __FUNCTION__, "Type error!");
-			break;
+			m_thread.join();
 		}
 
-		d_ptr->m_eMatteResolution = eR;
-	}
-		
-	bool CBgMatte::SetSrcBgrImage(const QImage & imgBgr)
-	{
-		if (!d_ptr->IsCudaAvailable())
+		static CRVMMattePrivate *SessionPrivate(const Stream &stream)
 		{
-			return false;
+			return static_cast<CRVMMattePrivate *>(stream.pSession->d_ptr.get());
 		}
 
-		if (imgBgr.isNull())
+		static bool SameBatch(const BatchEntry &a, const Stream &stream)
 		{
-			return false;
+			const auto size = a.pFrame->imgSrc.size();
+			const auto d = SessionPrivate(stream);
+			return size == stream.queueFrames.front()->imgSrc.size() &&
+				a.d->BucketFor(size) == d->BucketFor(size) &&
+				a.d->DownsampleRatioFor(size) == d->DownsampleRatioFor(size);
 		}
 
-		//! Load image
-		QImage imgBg(imgBgr);
-
-		//! Convert to RGB
-		imgBg = imgBg.convertToFormat(QImage::Format_RGB888);
+		//! Heads of idle streams that batch with the oldest head, oldest first. m_mutex is held.
+		std::vector<BatchEntry> CollectBatch() const
+		{
+			std::vector<BatchEntry> vBatch;
+			const Stream *pOldest = nullptr;
+			int nOldest = 0;
 
-		auto tensorBg = torch::from_blob(imgBg.bits(), { imgBg.height(),imgBg.width(),3 }, torch::kByte);
-		tensorBg = tensorBg.to(d_ptr->m_sDevice);
-		tensorBg = tensorBg.permute({ 2,0,1 }).contiguous();
+			for (const auto &stream : m_mapStreams)
+			{
+				if (!stream.second.bBusy && !stream.second.queueFrames.empty() &&
+					(!pOldest || stream.second.queueFrames.front()->tArrival < pOldest->queueFrames.front()->tArrival))
+				{
+					pOldest = &stream.second;
+					nOldest = stream.first;
+				}
+			}
 
-		auto pBgmatte = std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr);
-		pBgmatte->m_tensorSrcBgr = tensorBg.to(d_ptr->m_nPrecision).div(255);
-		pBgmatte->m_tensorSrcBgr.unsqueeze_(0);
+			if (!pOldest)
+			{
+				return vBatch;
+			}
 
-		return true;
-	}
+			vBatch.push_back({ nOldest, SessionPrivate(*pOldest), pOldest->queueFrames.front() });
+			for (const auto &stream : m_mapStreams)
+			{
+				if (static_cast<int>(vBatch.size()) >= m_nMaxBatch)
+				{
+					break;
+				}
+
+				if (&stream.second != pOldest && !stream.second.bBusy && !stream.second.queueFrames.empty() && SameBatch(vBatch[0], stream.second))
+				{
+					vBatch.push_back({ stream.first, SessionPrivate(stream.second), stream.second.queueFrames.front() });
+				}
+			}
 
-	QImage CBgMatte::SetImage(const QImage & imgSrc)
-	{
-		if (!d_ptr->IsCudaAvailable())
-		{
-			return QImage();
+			return vBatch;
 		}
 
-		if (imgSrc.isNull())
+		void Run()
 		{
-			return QImage();
-		}
-
-		//! Load image
-		QImage imgSrcCopy(imgSrc);
+			QMutexLocker locker(&m_mutex);
 
-		auto formatSrc = imgSrcCopy.format();
+			while (true)
+			{
+				auto vBatch = CollectBatch();
+				if (vBatch.empty())
+				{
+					if (m_bExit)
+					{
+						break;
+					}
+
+					m_condition.wait(&m_mutex);
+					continue;
+				}
+
+				//! Wait for more streams within the window, but leave the forward() time inside the latency budget
+				const auto nWaitUs = qMax<qint64>(0, qMin<qint64>(m_nWindowUs, m_nLatencyUs - static_cast<qint64>(m_fForwardUs)));
+				const auto tDeadline = vBatch[0].pFrame->tArrival + std::chrono::microseconds(nWaitUs);
+				for (auto tNow = Clock::now(); !m_bExit && static_cast<int>(vBatch.size()) < m_nMaxBatch && tNow < tDeadline; tNow = Clock::now())
+				{
+					const auto nWaitUsLeft = std::chrono::duration_cast<std::chrono::microseconds>(tDeadline - tNow).count();
+					m_condition.wait(&m_mutex, static_cast<unsigned long>((nWaitUsLeft + 999) / 1000));
+					vBatch = CollectBatch();
+				}
+
+				for (const auto &entry : vBatch)
+				{
+					auto &stream = m_mapStreams[entry.nStream];
+					stream.queueFrames.pop_front();
+					stream.bBusy = true;
+				}
+
+				locker.unlock();
+				RunBatch(vBatch);
+				locker.relock();
+
+				for (const auto &entry : vBatch)
+				{
+					m_mapStreams[entry.nStream].bBusy = false;
+				}
+
+				m_condition.wakeAll();
+			}
+		}
 
-		//! Convert formatBg to RGB
-		imgSrcCopy = imgSrcCopy.convertToFormat(QImage::Format_RGB888);
+		//! Stack the frames and their recurrent states, one forward(), then split the outputs back to the streams
+		void RunBatch(const std::vector<BatchEntry> &vBatch)
+		{
+			torch::NoGradGuard no_grad;
 
-		auto tensorSrc = torch::from_blob(imgSrcCopy.bits(), { imgSrcCopy.height(),imgSrcCopy.width(),3 }, torch::kByte);
-		tensorSrc = tensorSrc.to(d_ptr->m_sDevice);
-		tensorSrc = tensorSrc.permute({ 2,0,1 }).contiguous();
-		tensorSrc = tensorSrc.to(d_ptr->m_nPrecision).div(255);
-		tensorSrc.unsqueeze_(0);
+			const auto nCount = static_cast<int>(vBatch.size());
+			const auto d0 = vBatch[0].d;
+			const auto size = vBatch[0].pFrame->imgSrc.size();
 
-		//auto start = std::chrono::high_resolution_clock::now();
+			//! Run at the bucket like SetImage, so the batch only meets the shapes that were warmed up.
+			//! The recurrent state is kept at the bucket size.
+			const auto sizeBucket = d0->BucketFor(size);
+			alloc::CWorkspaceScope workspace(sizeBucket.width(), sizeBucket.height());
 
-		//! Inference
-		torch::NoGradGuard no_grad;
-		auto pBgmatte = std::dynamic_pointer_cast<CBgMattePrivate>(d_ptr);
-		auto outputs = d_ptr->m_sModel.forward({ tensorSrc, pBgmatte->m_tensorSrcBgr }).toTuple()->elements();
+			QVector<QImage> vImages(nCount);
+			for (int i = 0; i < nCount; ++i)
+			{
+				vImages[i] = vBatch[i].pFrame->imgSrc;
+				vBatch[i].d->FollowInputSize(size);
+				vBatch[i].d->CheckStateSize(sizeBucket);
+			}
 
-		//auto time = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count());
+			//! A stream without a state yet starts from zeros, as the model does for None
+			auto fnStack = [&](c10::optional<torch::Tensor> CRVMMattePrivate::*pRec) -> c10::optional<torch::Tensor> {
+				torch::Tensor tensorRef;
+				for (const auto &entry : vBatch)
+				{
+					if ((entry.d->*pRec).has_value())
+					{
+						tensorRef = *(entry.d->*pRec);
+						break;
+					}
+				}
+
+				if (!tensorRef.defined())
+				{
+					return c10::nullopt;
+				}
+
+				std::vector<torch::Tensor> vRec;
+				for (const auto &entry : vBatch)
+				{
+					vRec.push_back((entry.d->*pRec).has_value() ? *(entry.d->*pRec) : torch::zeros_like(tensorRef));
+				}
+
+				return torch::cat(vRec, 0);
+			};
+
+			//! The batch stages are shared evenly by its frames in the stats of their sessions
+			MatteStageTimes sTimes;
+			auto fnComplete = [&](int i, const QImage &imgRes) {
+				vBatch[i].d->FinishFrame(sTimes, !imgRes.isNull());
+
+				auto &frame = *vBatch[i].pFrame;
+				frame.future.reportResult(imgRes);
+				frame.future.reportFinished();
+
+				if (m_fnCompletion)
+				{
+					m_fnCompletion(vBatch[i].nStream, imgRes, frame.nTag);
+				}
+			};
+
+			c10::impl::GenericList outputs(c10::AnyType::get());
+			try
+			{
+				auto tensorSrc = d0->ImagesToTensor(vImages.constData(), nCount, m_tensorHost, &sTimes);
+				if (sizeBucket != size)
+				{
+					tensorSrc = torch::replication_pad2d(tensorSrc, { 0, sizeBucket.width() - size.width(), 0, sizeBucket.height() - size.height() });
+				}
+
+				trace::CScope scope("model.forward");
+				const auto tStart = Clock::now();
+				outputs = d0->m_sModel.forward({
+					tensorSrc,
+					fnStack(&CRVMMattePrivate::m_tensorRec0),
+					fnStack(&CRVMMattePrivate::m_tensorRec1),
+					fnStack(&CRVMMattePrivate::m_tensorRec2),
+					fnStack(&CRVMMattePrivate::m_tensorRec3),
+					d0->m_fDownsampleRatio }).toList();
+
+				sTimes.fModelMs = d0->ElapsedMs(tStart);
+				const auto fForwardUs = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - tStart).count());
+				m_fForwardUs = m_fForwardUs > 0 ? 0.9 * m_fForwardUs + 0.1 * fForwardUs : fForwardUs;
+			}
+			catch (const std::exception &)
+			{
+				//! Every frame of the batch fails, the streams keep the state of their previous frame
+				for (int i = 0; i < nCount; ++i)
+				{
+					fnComplete(i, QImage());
+				}
 
-		auto pha = outputs[0].toTensor();
-		auto fgr = outputs[1].toTensor();
+				return;
+			}
 
-		auto res_tensor = pha * fgr + (1 - pha) * d_ptr->m_tensorTargetBgr;
-		res_tensor = res_tensor.mul(255).to(torch::kUInt8).cpu().permute({ 0,2,3,1 });
-		res_tensor.squeeze_(0);
-		res_tensor = res_tensor.contiguous();
+			sTimes.fUploadMs /= nCount;
+			sTimes.fIngestMs /= nCount;
+			sTimes.fModelMs /= nCount;
 
-		d_ptr->m_arrayResCache = QByteArray(static_cast<char *>(res_tensor.data_ptr()), res_tensor.size(1)*res_tensor.size(0)*res_tensor.size(2));
-		QImage imgRes(reinterpret_cast<uchar *>(d_ptr->m_arrayResCache.data()), res_tensor.size(1), res_tensor.size(0), QImage::Format_RGB888);
+			auto tensorFgr = outputs.get(0).toTensor().narrow(2, 0, size.height()).narrow(3, 0, size.width());
+			auto tensorPha = outputs.get(1).toTensor().narrow(2, 0, size.height()).narrow(3, 0, size.width());
+			auto tensorRec0 = outputs.get(2).toTensor();
+			auto tensorRec1 = outputs.get(3).toTensor();
+			auto tensorRec2 = outputs.get(4).toTensor();
+			auto tensorRec3 = outputs.get(5).toTensor();
 
-		return imgRes.convertToFormat(formatSrc);
-	}
+			for (int i = 0; i < nCount; ++i)
+			{
+				auto d = vBatch[i].d;
+				d->m_tensorRec0 = tensorRec0.narrow(0, i, 1).clone();
+				d->m_tensorRec1 = tensorRec1.narrow(0, i, 1).clone();
+				d->m_tensorRec2 = tensorRec2.narrow(0, i, 1).clone();
+				d->m_tensorRec3 = tensorRec3.narrow(0, i, 1).clone();
+
+				QImage imgRes;
+				try
+				{
+					if (!d->Compose(tensorPha.narrow(0, i, 1), tensorFgr.narrow(0, i, 1), vBatch[i].pFrame->eFormat, imgRes))
+					{
+						imgRes = QImage();
+					}
+				}
+				catch (const std::exception &)
+				{
+					imgRes = QImage();
+				}
+
+				fnComplete(i, imgRes);
+			}
+		}
 
-	//////////////////////////////////////////////////////////////////////////
+		QMutex m_mutex;
+		QWaitCondition m_condition;
+		std::map<int, Stream> m_mapStreams;
+		int m_nNextStream = 0;
+		bool m_bExit = false;
+
+		int m_nWindowUs = 5000;
+		int m_nLatencyUs = 33000;
+		int m_nMaxBatch = 8;
+		double m_fForwardUs = 0;  //!< Moving average of the batched forward()
+		torch::Tensor m_tensorHost;
+		CRVMBatcher::StreamCallback m_fnCompletion;
+		std::shared_ptr<CRVMMatte> m_pModel;
+
+		//! Declared last, so it stops before the members it uses are destroyed
+		std::thread m_thread;
+	};
 
-	CRVMMatte::CRVMMatte() :CMatte(std::make_shared<CRVMMattePrivate>())
+	CRVMBatcher::CRVMBatcher(const CRVMMatte &model) :d_ptr(std::make_shared<CRVMBatcherPrivate>())
 	{
-
+		d_ptr->m_pModel = model.CreateSession();
 	}
 
-	bool CRVMMatte::LoadModuleFile(const QString & strModuleAbsolutePath)
+	CRVMBatcher::~CRVMBatcher()
 	{
-		if (!d_ptr->IsCudaAvailable() || !QFile::exists(strModuleAbsolutePath))
-		{
-			return false;
-		}
-
-		d_ptr->m_sModel = torch::jit::load(strModuleAbsolutePath.toStdString());
-
-		//! Optionally, freeze the model. This will trigger graph optimization, such as BatchNorm fusion etc. Frozen models are faster.
-		//torch::jit::freeze(d_ptr->m_sModel);
-		d_ptr->m_sModel.to(d_ptr->m_sDevice);
-		SetMatteResolution(d_ptr->m_eMatteResolution);
 
-		return true;
 	}
 
-	void CRVMMatte::SetMatteResolution(MatteResolution eR)
+	int CRVMBatcher::AddStream()
 	{
-		auto pBgmatte = std::dynamic_pointer_cast<CRVMMattePrivate>(d_ptr);
-
-		switch (eR)
-		{
-		case MatteResolution::MR_SD:
-			pBgmatte->m_fDownsampleRatio = 0.6;
-			break;
-
-		case MatteResolution::MR_HD:
-			pBgmatte->m_fDownsampleRatio = 0.4;
-		break;
-
-		case MatteResolution::MR_4K:
-			pBgmatte->m_fDownsampleRatio = 0.2;
-		break;
-
-		default:
-			Q_ASSERT_X(0, __FUNCTION__, "Type error!");
-			break;
-		}
+		auto pSession = d_ptr->m_pModel->CreateSession();
 
-		d_ptr->m_eMatteResolution = eR;
+		QMutexLocker locker(&d_ptr->m_mutex);
+		const auto nStream = d_ptr->m_nNextStream++;
+		d_ptr->m_mapStreams[nStream].pSession = std::move(pSession);
+		return nStream;
 	}
 
-	QImage CRVMMatte::SetImage(const QImage & imgSrc)
+	void CRVMBatcher::RemoveStream(int nStream)
 	{
-		if (!d_ptr->IsCudaAvailable())
+		QMutexLocker locker(&d_ptr->m_mutex);
+		auto it = d_ptr->m_mapStreams.find(nStream);
+		while (it != d_ptr->m_mapStreams.end() && (it->second.bBusy || !it->second.queueFrames.empty()))
 		{
-			return QImage();
+			d_ptr->m_condition.wait(&d_ptr->m_mutex);
+			it = d_ptr->m_mapStreams.find(nStream);
 		}
 
-		if (imgSrc.isNull())
+		if (it != d_ptr->m_mapStreams.end())
 		{
-			return QImage();
+			d_ptr->m_mapStreams.erase(it);
 		}
+	}
 
-		//! Load image
-		QImage imgSrcCopy(imgSrc);
-		auto formatSrc = imgSrcCopy.format();
+	CRVMMatte *CRVMBatcher::GetStream(int nStream) const
+	{
+		QMutexLocker locker(&d_ptr->m_mutex);
+		auto it = d_ptr->m_mapStreams.find(nStream);
+		return it == d_ptr->m_mapStreams.end() ? nullptr : it->second.pSession.get();
+	}
 
-		//! Convert formatBg to RGB
-		imgSrcCopy = imgSrcCopy.convertToFormat(QImage::Format_RGB888);
+	void CRVMBatcher::SetCompletionCallback(const StreamCallback &fnCompletion)
+	{
+		QMutexLocker locker(&d_ptr->m_mutex);
+		d_ptr->m_fnCompletion = fnCompletion;
+	}
 
-		auto tensorSrc = torch::from_blob(imgSrcCopy.bits(), { imgSrcCopy.height(),imgSrcCopy.width(),3 }, torch::kByte);
+	void CRVMBatcher::SetBatchWindow(int nMicroseconds)
+	{
+		QMutexLocker locker(&d_ptr->m_mutex);
+		d_ptr->m_nWindowUs = qMax(0, nMicroseconds);
+	}
 
-		tensorSrc = tensorSrc.to(d_ptr->m_sDevice);
-		tensorSrc = tensorSrc.permute({ 2,0,1 }).contiguous();
-		tensorSrc = tensorSrc.to(d_ptr->m_nPrecision).div(255);
-		tensorSrc.unsqueeze_(0);
+	int CRVMBatcher::GetBatchWindow() const
+	{
+		return d_ptr->m_nWindowUs;
+	}
 
-		//! Inference
-		torch::NoGradGuard no_grad;
+	void CRVMBatcher::SetLatencyBudget(int nMicroseconds)
+	{
+		QMutexLocker locker(&d_ptr->m_mutex);
+		d_ptr->m_nLatencyUs = qMax(0, nMicroseconds);
+	}
 
-		auto pBgmatte = std::dynamic_pointer_cast<CRVMMattePrivate>(d_ptr);
-		auto outputs = d_ptr->m_sModel.forward({
-			tensorSrc,
-			pBgmatte->m_tensorRec0,
-			pBgmatte->m_tensorRec1,
-			pBgmatte->m_tensorRec2,
-			pBgmatte->m_tensorRec3,
-			pBgmatte->m_fDownsampleRatio }).toList();
+	int CRVMBatcher::GetLatencyBudget() const
+	{
+		return d_ptr->m_nLatencyUs;
+	}
 
-		const auto &fgr = outputs.get(0).toTensor();
-		const auto &pha = outputs.get(1).toTensor();
-		pBgmatte->m_tensorRec0 = outputs.get(2).toTensor();
-		pBgmatte->m_tensorRec1 = outputs.get(3).toTensor();
-		pBgmatte->m_tensorRec2 = outputs.get(4).toTensor();
-		pBgmatte->m_tensorRec3 = outputs.get(5).toTensor();
+	void CRVMBatcher::SetMaxBatchSize(int nSize)
+	{
+		QMutexLocker locker(&d_ptr->m_mutex);
+		d_ptr->m_nMaxBatch = qMax(1, nSize);
+	}
 
-		auto res_tensor = pha * fgr + (1 - pha) * d_ptr->m_tensorTargetBgr;
+	int CRVMBatcher::GetMaxBatchSize() const
+	{
+		return d_ptr->m_nMaxBatch;
+	}
 
-		res_tensor = res_tensor.mul(255).permute({ 0,2,3,1 })[0].to(torch::kU8).contiguous().cpu();
+	QFuture<QImage> CRVMBatcher::Submit(int nStream, const QImage &imgSrc, quint64 nTag)
+	{
+		auto pFrame = std::make_shared<CRVMBatcherPrivate::StreamFrame>();
+		pFrame->imgSrc = imgSrc;
+		pFrame->nTag = nTag;
+		pFrame->tArrival = CRVMBatcherPrivate::Clock::now();
+		pFrame->future.reportStarted();
+		auto future = pFrame->future.future();
+
+		QMutexLocker locker(&d_ptr->m_mutex);
+		auto it = d_ptr->m_mapStreams.find(nStream);
+		if (imgSrc.isNull() || it == d_ptr->m_mapStreams.end() || !CRVMBatcherPrivate::SessionPrivate(it->second)->m_bModuleLoaded)
+		{
+			const QImage imgNull;
+			pFrame->future.reportFinished(&imgNull);
+			return future;
+		}
 
-		d_ptr->m_arrayResCache = QByteArray(static_cast<char *>(res_tensor.data_ptr()), res_tensor.size(1)*res_tensor.size(0)*res_tensor.size(2));
-		QImage imgRes(reinterpret_cast<uchar *>(d_ptr->m_arrayResCache.data()), res_tensor.size(1), res_tensor.size(0), QImage::Format_RGB888);
+		auto d = CRVMBatcherPrivate::SessionPrivate(it->second);
+		pFrame->eFormat = QImage::Format_Invalid == d->m_eOutputFormat ? imgSrc.format() : d->m_eOutputFormat;
+		it->second.queueFrames.push_back(pFrame);
+		d_ptr->m_condition.wakeAll();
 
-		return imgRes.convertToFormat(formatSrc);
+		return future;
 	}
 
 	//////////////////////////////////////////////////////////////////////////
 
-	std::unique_ptr<CMatte> CreateMatteObj(ModuleType eType)
+	std::unique_ptr<CMatte> CreateMatteObj(ModuleType eType, MatteDevice eDevice)
 	{
 		std::unique_ptr<CMatte> p;
 		switch (eType)
 		{
 		case bgmatt::ModuleType::MT_BGM:
-			p = std::make_unique<CBgMatte>();
+			p = std::make_unique<CBgMatte>(eDevice);
 			break;
 
 		case bgmatt::ModuleType::MT_VIDEOM:
-			p = std::make_unique<CRVMMatte>();
+			p = std::make_unique<CRVMMatte>(eDevice);
 			break;
 
 		default:
@@ -410,4 +3700,138 @@ namespace bgmatt
 
 		return p;
 	}
+
+	QString FormatOperatorProfile(const OperatorProfileReport &sReport, int nRows)
+	{
+		if (!sReport.bOk)
+		{
+			return QString();
+		}
+
+		double fSelfMs = 0;
+		for (const auto &sOperator : sReport.vOperators)
+		{
+			fSelfMs += sOperator.fSelfMs;
+		}
+
+		const auto nFrames = qMax(1, sReport.nFrames);
+		auto fnTable = [&](const QVector<OperatorProfile> &vProfiles) {
+			QString strTable = QString::asprintf("%10s %7s %10s %10s %8s  %s\n", "self ms", "self %", "total ms", "cuda ms", "calls", "op");
+			for (int i = 0; i < qMin(nRows, vProfiles.size()); ++i)
+			{
+				const auto &sProfile = vProfiles[i];
+				auto strOp = sProfile.strName;
+				if (!sProfile.strShapes.isEmpty())
+				{
+					strOp += " " + sProfile.strShapes;
+				}
+
+				strTable += QString::asprintf("%10.3f %6.1f%% %10.3f %10.3f %8.1f  %s\n", sProfile.fSelfMs / nFrames,
+					100 * sProfile.fSelfMs / qMax(fSelfMs, 1e-9), sProfile.fTotalMs / nFrames, sProfile.fCudaMs / nFrames,
+					static_cast<double>(sProfile.nCalls) / nFrames, qPrintable(strOp));
+			}
+
+			return strTable;
+		};
+
+		return QString::asprintf("%d frames, %.2f ms per frame, per frame times below\n", sReport.nFrames, sReport.fFrameMs) +
+			"\nBy operator\n" + fnTable(sReport.vOperators) +
+			"\nBy operator and input shapes\n" + fnTable(sReport.vShapes);
+	}
+
+	//! Shared by both stubs: the convolutions at the working size
+	static const char *const STUB_FEATURES_SOURCE = R"JIT(
+def features(self, x: Tensor) -> Tensor:
+    x = torch.relu(torch.conv2d(x, self.weight_in, self.bias_in, 1, 1))
+    for i in range(self.weight_hidden.size(0)):
+        x = torch.relu(torch.conv2d(x, self.weight_hidden[i], self.bias_hidden[i], 1, 1))
+    return x
+
+)JIT";
+
+	//! The frame is pooled to the working size, runs through the features and comes back bilinear
+	static const char *const STUB_BGM_SOURCE = R"JIT(
+def forward(self, src: Tensor, bgr: Tensor) -> Tuple[Tensor, Tensor, Tensor, Tensor, Tensor, Tensor]:
+    h = src.size(2)
+    w = src.size(3)
+    hc = max(1, int(h * self.backbone_scale))
+    wc = max(1, int(w * self.backbone_scale))
+    src_sm = torch.adaptive_avg_pool2d(src, [hc, wc])
+    x = self.features(torch.cat([src_sm, torch.adaptive_avg_pool2d(bgr, [hc, wc])], 1))
+    y = torch.conv2d(x, self.weight_out, self.bias_out, 1, 1)
+    pha_sm = torch.sigmoid(y[:, 0:1])
+    fgr_sm = torch.clamp(y[:, 1:4] + src_sm, 0., 1.)
+    err_sm = torch.sigmoid(y[:, 4:5])
+    ref_sm = torch.zeros_like(err_sm)
+    if self.refine_mode == 'full':
+        ref_sm = torch.ones_like(err_sm)
+    pha = torch.upsample_bilinear2d(pha_sm, [h, w], False, None, None)
+    fgr = torch.upsample_bilinear2d(fgr_sm, [h, w], False, None, None)
+    return pha, fgr, pha_sm, fgr_sm, err_sm, ref_sm
+)JIT";
+
+	//! The same with recurrent states pooled from the features
+	static const char *const STUB_RVM_SOURCE = R"JIT(
+def forward(self, src: Tensor, r1: Optional[Tensor] = None, r2: Optional[Tensor] = None, r3: Optional[Tensor] = None,
+            r4: Optional[Tensor] = None, downsample_ratio: float = 0.25) -> List[Tensor]:
+    h = src.size(2)
+    w = src.size(3)
+    hc = max(1, int(h * downsample_ratio))
+    wc = max(1, int(w * downsample_ratio))
+    x = self.features(torch.adaptive_avg_pool2d(src, [hc, wc]))
+    if r1 is not None:
+        x = 0.5 * (x + r1)
+    r2_out = torch.adaptive_avg_pool2d(x, [max(1, hc // 2), max(1, wc // 2)])
+    r3_out = torch.adaptive_avg_pool2d(x, [max(1, hc // 4), max(1, wc // 4)])
+    r4_out = torch.adaptive_avg_pool2d(x, [max(1, hc // 8), max(1, wc // 8)])
+    y = torch.upsample_bilinear2d(torch.conv2d(x, self.weight_out, self.bias_out, 1, 1), [h, w], False, None, None)
+    fgr = torch.clamp(y[:, 1:4] + src, 0., 1.)
+    pha = torch.clamp(y[:, 0:1], 0., 1.)
+    return [fgr, pha, x, r2_out, r3_out, r4_out]
+)JIT";
+
+	bool CreateStubModule(ModuleType eType, const QString &strPath, const StubModuleOptions &sOptions)
+	{
+		const bool bBgm = ModuleType::MT_BGM == eType;
+		const int64_t nIn = bBgm ? 6 : 3;
+		const int64_t nOut = bBgm ? 5 : 4;
+		const int64_t nChannels = qMax(1, sOptions.nChannels);
+		const int64_t nLayers = qMax(0, sOptions.nLayers);
+
+		try
+		{
+			auto generator = at::detail::createCPUGenerator(sOptions.nSeed);
+			auto fnWeight = [&](at::IntArrayRef size) {
+				//! He initialization keeps the activations in range through the layers
+				const auto nFanIn = size[size.size() - 3] * size[size.size() - 2] * size[size.size() - 1];
+				return torch::randn(size, generator).mul_(std::sqrt(2.0 / nFanIn));
+			};
+
+			torch::jit::Module module(c10::QualifiedName(bBgm ? "__torch__.bgmatt.StubBackgroundMatting" : "__torch__.bgmatt.StubRobustVideoMatting"));
+			module.register_parameter("weight_in", fnWeight({ nChannels, nIn, 3, 3 }), false);
+			module.register_parameter("bias_in", torch::zeros({ nChannels }), false);
+			module.register_parameter("weight_hidden", fnWeight({ nLayers, nChannels, nChannels, 3, 3 }), false);
+			module.register_parameter("bias_hidden", torch::zeros({ nLayers, nChannels }), false);
+			module.register_parameter("weight_out", fnWeight({ nOut, nChannels, 3, 3 }), false);
+			module.register_parameter("bias_out", torch::zeros({ nOut }), false);
+
+			if (bBgm)
+			{
+				module.register_attribute("backbone_scale", c10::FloatType::get(), 0.25);
+				module.register_attribute("refine_mode", c10::StringType::get(), std::string("sampling"));
+				module.register_attribute("refine_sample_pixels", c10::IntType::get(), static_cast<int64_t>(80000));
+				module.register_attribute("refine_threshold", c10::FloatType::get(), 0.1);
+			}
+
+			module.define(std::string(STUB_FEATURES_SOURCE) + (bBgm ? STUB_BGM_SOURCE : STUB_RVM_SOURCE));
+			module.eval();
+			module.save(strPath.toStdString());
+		}
+		catch (const c10::Error &)
+		{
+			return false;
+		}
+
+		return true;
+	}
 }
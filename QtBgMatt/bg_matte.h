@@ -7,6 +7,7 @@ BackgroundMattingV2:
 the backbone will operate on 480x270 resolution for a 1920x1080 input with backbone_scale=0.25.
 2. refine_sample_pixels (int, default: 80,000). The fixed amount of pixels to refine. Used in sampling mode.
 3. We recommend backbone_scale=0.25, refine_sample_pixels=80000 for HD and backbone_scale=0.125, refine_sample_pixels=320000 for 4K.
+SetInputSize generalizes this to backbone_scale = 270 / short side and refine_sample_pixels = 80000 * pixels / (1920 * 1080).
 4. https://github.com/PeterL1n/BackgroundMattingV2/blob/master/doc/model_usage.md
 
  RobustVideoMatting:
@@ -16,11 +17,20 @@ the backbone will operate on 480x270 resolution for a 1920x1080 input with backb
 	1280x720 	0.375 			0.6
 	1920x1080 	0.25 			0.4
 	3840x2160 	0.125 			0.2
+SetInputSize generalizes this to downsample_ratio = 270 (portrait) or 432 (full-body) / short side, 1 up to 512x512.
 2. https://github.com/PeterL1n/RobustVideoMatting/blob/master/documentation/inference.md
 ************************************************************************/
 
 #pragma once
 #include <QImage>
+#include <QVector>
+#include <QFuture>
+#include <functional>
+
+//! Per-stage statistics of CMatte::GetStats, 0 compiles the recording out
+#ifndef BGMATT_ENABLE_STATS
+#define BGMATT_ENABLE_STATS 1
+#endif
 
 namespace bgmatt
 {
@@ -33,66 +43,422 @@ namespace bgmatt
 		MR_4K  //!< 3840x2160
 	};
 
+	//! Short side of the coarse pass for portraits, the BackgroundMattingV2 backbone at 1920x1080 with backbone_scale 0.25
+	static constexpr int WORKING_SIDE_PORTRAIT = 270;
+	//! Short side of the coarse pass for full-body shots, RobustVideoMatting at 1920x1080 with downsample_ratio 0.4
+	static constexpr int WORKING_SIDE_FULL_BODY = 432;
+
 	enum class ModuleType
 	{
 		MT_BGM,  //!< BackgroundMattingV2
 		MT_VIDEOM  //!< RobustVideoMatting
 	};
 
+	enum class MatteDevice
+	{
+		MD_AUTO,  //!< CUDA if available, otherwise CPU
+		MD_CPU,  //!< CPU, fp32 by default
+		MD_CUDA  //!< CUDA, fp16 by default
+	};
+
+	enum class MattePrecision
+	{
+		MP_AUTO,  //!< fp16 on CUDA, fp32 on CPU
+		MP_FP32,
+		MP_FP16,  //!< CUDA only, fp32 on CPU
+		MP_BF16,  //!< CPU with AVX512_BF16, fp32 when a bf16 forward() fails at load, on other CPUs and fp16 on CUDA
+		MP_INT8  //!< CPU, conv layers quantized after a calibration pass, fp32 when that fails and fp16 on CUDA
+	};
+
+	//! Int8 against fp32 over the calibration images
+	struct QuantizationReport
+	{
+		bool bOk = false;  //!< The int8 module is in use
+		int nSamples = 0;
+		double fMeanAbsError = 0;  //!< pha in [0, 1]
+		double fMaxAbsError = 0;
+		double fFp32Ms = 0;  //!< Per frame
+		double fInt8Ms = 0;
+	};
+
+	enum class MatteOutput
+	{
+		MO_COMPOSITE,  //!< fgr over the target background, in the output format
+		MO_ALPHA,  //!< pha only, Format_Grayscale8, or Format_Alpha8 when that is the output format
+		MO_PREMULTIPLIED  //!< fgr * pha with pha as alpha, Format_ARGB32_Premultiplied
+	};
+
+	//! Wall time of one frame by stage, in milliseconds
+	struct MatteStageTimes
+	{
+		double fIngestMs = 0;  //!< Scanlines to the input tensor in host memory
+		double fUploadMs = 0;  //!< Host to device, 0 on the CPU
+		double fModelMs = 0;  //!< forward() with padding and cropping
+		double fCompositeMs = 0;  //!< pha and fgr into the result pixels
+		double fDownloadMs = 0;  //!< Device to host, 0 on the CPU
+		double fConvertMs = 0;  //!< convertToFormat when the output format is not written directly
+	};
+
+	//! Stages of MatteStats, in frame order
+	enum class MatteStage
+	{
+		MS_INGEST,
+		MS_UPLOAD,
+		MS_FORWARD,
+		MS_COMPOSITE,
+		MS_DOWNLOAD,
+		MS_CONVERT
+	};
+
+	static constexpr int MATTE_STAGE_COUNT = 6;
+	static constexpr int STATS_HISTOGRAM_BUCKETS = 16;
+
+	//! Latency of one stage over the recent frames, in milliseconds
+	struct MatteStageStats
+	{
+		int nSamples = 0;
+		double fMeanMs = 0;
+		double fP50Ms = 0;
+		double fP95Ms = 0;
+		double fP99Ms = 0;
+		double fMaxMs = 0;
+
+		//! Bucket 0 counts below 1/8 ms, bucket i counts [2^(i-4), 2^(i-3)) ms, the last one everything above
+		int anHistogram[STATS_HISTOGRAM_BUCKETS] = {};
+	};
+
+	struct MatteStats
+	{
+		MatteStageStats asStages[MATTE_STAGE_COUNT];  //!< Indexed by MatteStage
+		quint64 nProcessed = 0;  //!< Frames matted
+		quint64 nFailed = 0;  //!< Frames whose inference or composite failed
+		quint64 nSkipped = 0;  //!< Frames refused before inference, a null image or no module loaded
+		int nQueueDepth = 0;  //!< Submitted frames not completed
+		double fFps = 0;  //!< Completed frames per second over the last two seconds
+	};
+
+	//! One operator, or one operator with one set of input shapes, summed over the profiled frames
+	struct OperatorProfile
+	{
+		QString strName;  //!< e.g. aten::conv2d
+		QString strShapes;  //!< Input shapes, empty in the table by operator
+		int nCalls = 0;
+		double fSelfMs = 0;  //!< CPU time without the ops it called
+		double fTotalMs = 0;  //!< CPU time with the ops it called
+		double fCudaMs = 0;  //!< Device time with the ops it called, 0 on the CPU
+	};
+
+	struct OperatorProfileReport
+	{
+		bool bOk = false;
+		int nFrames = 0;
+		double fFrameMs = 0;  //!< Wall time of forward() per frame, profiler overhead included
+		QVector<OperatorProfile> vOperators;  //!< By operator, most self time first
+		QVector<OperatorProfile> vShapes;  //!< By operator and input shapes, most self time first
+	};
+
+	//! Result of Submit with the tag it was submitted with
+	typedef std::function<void(const QImage &imgRes, quint64 nTag)> MatteCallback;
+
 	class CMatte
 	{
 	public:
-		CMatte();
-		virtual ~CMatte() = default;
+		CMatte(MatteDevice eDevice = MatteDevice::MD_AUTO);
+		virtual ~CMatte();
 
+		//! The device is resolved here, MD_AUTO falls back to CPU when CUDA is not available
 		virtual bool LoadModuleFile(const QString &strModuleAbsolutePath) = 0;
 
-		virtual void SetMatteResolution(MatteResolution eR) = 0;
+		//! Resolved device after LoadModuleFile, the requested one before
+		MatteDevice GetDevice() const;
+
+		//! MP_AUTO by default. Before LoadModuleFile the request is kept and resolved by it, GetPrecision then returns
+		//! the resolved precision. With the module loaded it is loaded again for the request, not while frames are
+		//! in flight, and false means the precision could not be applied, e.g. int8 without calibration images or
+		//! with failing quantization passes. The module then runs in fp32 and GetPrecisionNote tells why.
+		bool SetPrecision(MattePrecision ePrecision);
+		MattePrecision GetPrecision() const;
+
+		//! Why GetPrecision is not the requested precision, e.g. a bf16 forward() that failed at load. Empty when it is.
+		QString GetPrecisionNote() const;
+
+		//! Frames like the ones to be matted, set before LoadModuleFile with MP_INT8. The activation ranges are
+		//! observed over them and the int8 result is compared with fp32 on them. BackgroundMattingV2 needs its
+		//! clean plate set before LoadModuleFile as well.
+		void SetCalibrationImages(const QVector<QImage> &vImages);
+
+		//! Filled by LoadModuleFile with MP_INT8 on the CPU
+		QuantizationReport GetQuantizationReport() const;
+
+		//! Set before LoadModuleFile. The module is frozen for the device and precision, with the BackgroundMattingV2
+		//! attributes of the resolution baked in, and cached as <model>.<key>.prepared.pt next to the model file.
+		//! Later starts load the cached module directly. Off by default.
+		void SetModulePreparation(bool bPrepare);
+		bool GetModulePreparation() const;
+
+		//! Same as SetInputSize with 1280x720, 1920x1080 or 3840x2160
+		virtual void SetMatteResolution(MatteResolution eR);
 		MatteResolution GetMatteResolution() const;
 
+		//! Derive the model parameters from the frame size, 1920x1080 by default. nWorkingSide is the short side
+		//! of the coarse pass, 0 takes WORKING_SIDE_PORTRAIT for BackgroundMattingV2 and WORKING_SIDE_FULL_BODY for RobustVideoMatting.
+		void SetInputSize(const QSize &size, int nWorkingSide = 0);
+		QSize GetInputSize() const;
+		int GetWorkingSide() const;
+
+		//! Frames are padded up to the smallest bucket that holds them by replicating the right and bottom edges,
+		//! the results are cropped back. Larger frames are padded to a multiple of 32. Every bucket is warmed up
+		//! at LoadModuleFile, or here when the module is loaded, so TorchScript only specializes for the buckets.
+		//! Empty (default) runs every frame at its own size.
+		void SetShapeBuckets(const QVector<QSize> &vBuckets);
+		QVector<QSize> GetShapeBuckets() const;
+
+		//! Follow the size of every frame matted by SetImage or Submit, off by default.
+		//! A prepared BackgroundMattingV2 module is prepared again for every new size.
+		void SetAutoInputSize(bool bAuto);
+		bool GetAutoInputSize() const;
+
+		//! Scaled to cover each frame size and center cropped, prepared once per size for the last few sizes.
+		//! Safe while frames are in flight, a frame already compositing keeps the background it started with.
 		void SetTargetBgrImage(const QImage &imgTargetBgr);
 
 		//! only BackgroundMattingV2
 		virtual bool SetSrcBgrImage(const QImage &imgBgr) { return false; }
 
-		//! Get matted image
-		virtual QImage SetImage(const QImage &imgSrc) = 0;
+		//! Pixel format of the result, QImage::Format_Invalid (default) keeps the format of the source
+		void SetOutputFormat(QImage::Format eFormat);
+		QImage::Format GetOutputFormat() const;
+
+		//! MO_COMPOSITE by default, the other modes skip the target background
+		void SetOutputMode(MatteOutput eMode);
+		MatteOutput GetOutputMode() const;
 
+		//! Get matted image. The result buffer is recycled once the caller releases the returned image.
+		virtual QImage SetImage(const QImage &imgSrc);
+
+		//! Write the matted image into imgDst, its pixels are reused when size and format match and it is not shared.
+		//! false when the model or the composite fails, errors of libtorch included.
+		bool SetImage(const QImage &imgSrc, QImage &imgDst);
+
+		//! Load both files, take the background as the clean plate and matte like SetImage, in the format of the background
 		[[deprecated]] QImage SetImage(const QString &strSrcAbsolutePath, const QString &strBgrAbsolutePath);
 
+		//! Queue a frame and return at once, the future holds the matted image or a null image on failure.
+		//! Preprocessing, inference and postprocessing of consecutive frames overlap on internal threads,
+		//! results complete in submission order. Blocks while GetInFlightDepth() frames are in flight.
+		//! Do not call SetImage while submitted frames are in flight.
+		//! A non-null imgTargetBgr is the background of this frame only, e.g. a frame of a background video. It is
+		//! scaled and cropped like SetTargetBgrImage but not cached, the background set there is left alone.
+		QFuture<QImage> Submit(const QImage &imgSrc, quint64 nTag = 0, const QImage &imgTargetBgr = QImage());
+
+		//! Called on the postprocessing thread for every submitted frame, before the next one completes
+		void SetCompletionCallback(const MatteCallback &fnCompletion);
+
+		//! Frames submitted and not completed, 3 by default
+		void SetInFlightDepth(int nDepth);
+		int GetInFlightDepth() const;
+
+		//! Block until every submitted frame is completed
+		void WaitForDone();
+
+		//! Time the stages of every frame, off by default. On CUDA each stage waits for the device,
+		//! which takes away the overlap of the stages. Without it GetStats only times the CUDA launches.
+		void SetStageTiming(bool bEnable);
+		bool GetStageTiming() const;
+
+		//! Stages of the last completed frame, zeros while stage timing is off
+		MatteStageTimes GetLastStageTimes() const;
+
+		//! Snapshot of the stage latencies over the recent frames, the frame counters since the last ResetStats,
+		//! the queue depth and the frame rate. Zeros when built with BGMATT_ENABLE_STATS 0.
+		MatteStats GetStats() const;
+		void ResetStats();
+
+		//! Run forward() nFrames times on imgSrc under the libtorch profiler and sum the time by operator and by
+		//! operator and input shapes. strTracePath, if given, gets every op as a Chrome trace.
+		//! Call while no frames are in flight, the recurrent state of RobustVideoMatting starts over afterwards.
+		OperatorProfileReport ProfileOperators(const QImage &imgSrc, int nFrames = 20, const QString &strTracePath = QString());
+
 	protected:
-		CMatte(std::shared_ptr<CMattePrivate> d);
+		CMatte(std::shared_ptr<CMattePrivate> d, MatteDevice eDevice);
 
 	protected:
 		std::shared_ptr<CMattePrivate> d_ptr;
+
+		friend class CMattePoolPrivate;
+		friend class CRVMBatcherPrivate;
 	};
 
 	class CBgMatte :public CMatte
 	{
 	public:
-		CBgMatte();
+		CBgMatte(MatteDevice eDevice = MatteDevice::MD_AUTO);
 		~CBgMatte() = default;
 
 		bool LoadModuleFile(const QString &strModuleAbsolutePath) override;
 
-		void SetMatteResolution(MatteResolution eR) override;
-
 		bool SetSrcBgrImage(const QImage &imgBgr) override;
-		QImage SetImage(const QImage &imgSrc) override;
+
+		//! Matte many shots against the clean plate of SetSrcBgrImage, the results keep the order of vSrc.
+		//! Shots of the same size share one forward() per batch, the clean plate is scaled for other sizes.
+		//! A batch runs like a frame of SetImage, with the buckets, the input size and tiling, and counts in the stats.
+		//! A null result marks a null source or a failed batch.
+		QVector<QImage> SetImages(const QVector<QImage> &vSrc);
+
+		//! Bytes of activations a batch may use, 1 GiB by default. The batch size is derived per shot size.
+		void SetBatchMemoryBudget(qint64 nBytes);
+		qint64 GetBatchMemoryBudget() const;
+
+		//! SetImage splits sources larger than nTileSize in either dimension into tiles overlapping by nOverlap pixels,
+		//! the seams are feathered. backbone_scale and refine_sample_pixels are derived for the tile size. SetImage reads
+		//! the tiles from the source and writes the result as they finish, so peak memory follows the tile size plus the
+		//! overlap rows. Submit still holds the input and output of the whole frame. CPU tiles run in parallel.
+		//! 0 (default) disables tiling.
+		void SetTiling(int nTileSize, int nOverlap = 64);
+		int GetTileSize() const;
+		int GetTileOverlap() const;
+
+		//! Rows [nTop, nTop + nRows) of the full width image
+		typedef std::function<QImage(int nTop, int nRows)> BandReader;
+		//! Matted rows from nTop, false aborts
+		typedef std::function<bool(int nTop, const QImage &imgBand)> BandWriter;
+
+		//! Matte an image of size that is never held in memory as a whole. Bands of source and clean plate are read
+		//! top to bottom without overlap, the result is written top to bottom in the current output mode.
+		//! The tiles of SetTiling are used, 1024 when tiling is disabled.
+		bool SetImageStreamed(const QSize &size, const BandReader &fnReadSrc, const BandReader &fnReadBgr, const BandWriter &fnWrite);
 	};
 
 	class CRVMMatte :public CMatte
 	{
 	public:
-		CRVMMatte();
+		CRVMMatte(MatteDevice eDevice = MatteDevice::MD_AUTO);
 		~CRVMMatte() = default;
 
 		bool LoadModuleFile(const QString &strModuleAbsolutePath) override;
 
-		void SetMatteResolution(MatteResolution eR) override;
+		//! A new stream on the loaded module. The session shares the weights and owns its recurrent state,
+		//! downsample ratio, target background and result buffers, it starts with the settings of this object.
+		//! Sessions may run on different threads and keep the module alive on their own.
+		std::unique_ptr<CRVMMatte> CreateSession() const;
+
+		//! Forget the recurrent state, e.g. on a scene cut. A change of the frame size resets it as well.
+		void ResetState();
+	};
+
+	class CMattePoolPrivate;
+
+	//! Stateless BackgroundMattingV2 on several execution contexts that share one copy of the weights.
+	//! Every context has its own scratch buffers, result cache, module attributes and intra-op thread budget
+	//! and runs on its own thread. Frames go to the next free context and complete in submission order.
+	//! The setters wait for the frames in flight and hold Submit off while they change the contexts,
+	//! so they must not be called from the completion callback.
+	class CMattePool
+	{
+	public:
+		CMattePool(int nContexts, MatteDevice eDevice = MatteDevice::MD_AUTO);
+		~CMattePool();
+
+		bool LoadModuleFile(const QString &strModuleAbsolutePath);
+		int GetContextCount() const;
+		MatteDevice GetDevice() const;
+
+		void SetModulePreparation(bool bPrepare);
+		bool SetPrecision(MattePrecision ePrecision);
+		void SetCalibrationImages(const QVector<QImage> &vImages);
+		QuantizationReport GetQuantizationReport() const;
+		void SetMatteResolution(MatteResolution eR);
+		void SetInputSize(const QSize &size, int nWorkingSide = 0);
+		void SetShapeBuckets(const QVector<QSize> &vBuckets);
+		bool SetSrcBgrImage(const QImage &imgBgr);
+		void SetTiling(int nTileSize, int nOverlap = 64);
+		void SetTargetBgrImage(const QImage &imgTargetBgr);
+		void SetOutputFormat(QImage::Format eFormat);
+		void SetOutputMode(MatteOutput eMode);
+
+		//! Intra-op threads of each context, the ideal thread count divided by the contexts by default.
+		//! Each worker applies it once as it starts, false after the first Submit. The budget is per context
+		//! under OpenMP, the backend of the libtorch builds; the native backend has one pool for the process.
+		bool SetIntraOpThreads(int nThreads);
+		int GetIntraOpThreads() const;
 
-		QImage SetImage(const QImage &imgSrc) override;
+		//! Called in submission order
+		void SetCompletionCallback(const MatteCallback &fnCompletion);
+
+		//! Twice the contexts by default
+		void SetInFlightDepth(int nDepth);
+		int GetInFlightDepth() const;
+
+		QFuture<QImage> Submit(const QImage &imgSrc, quint64 nTag = 0);
+		void WaitForDone();
+
+	private:
+		std::shared_ptr<CMattePoolPrivate> d_ptr;
+	};
+
+	class CRVMBatcherPrivate;
+
+	//! Batches RobustVideoMatting frames of many streams into one forward(). Each stream is a session of the
+	//! model, the head frames of streams with the same frame size and downsample ratio are stacked with their
+	//! recurrent states, and the outputs and new states are split back. Frames of a stream keep their order.
+	//! A batch waits up to the batch window for more streams, shortened so that waiting plus the recent forward()
+	//! time stays inside the latency budget. Frames run at the shape bucket and follow the auto input size of their
+	//! session like SetImage, and count in the stats of their session with the batch stages shared evenly.
+	class CRVMBatcher
+	{
+	public:
+		//! model must be loaded, the streams share its weights
+		explicit CRVMBatcher(const CRVMMatte &model);
+		~CRVMBatcher();
+
+		int AddStream();
+
+		//! Blocks until the frames of the stream are completed
+		void RemoveStream(int nStream);
+
+		//! Session of the stream, configure it while none of its frames are in flight
+		CRVMMatte *GetStream(int nStream) const;
+
+		typedef std::function<void(int nStream, const QImage &imgRes, quint64 nTag)> StreamCallback;
+
+		//! Called on the scheduler thread
+		void SetCompletionCallback(const StreamCallback &fnCompletion);
+
+		//! 5000 us by default
+		void SetBatchWindow(int nMicroseconds);
+		int GetBatchWindow() const;
+
+		//! 33000 us by default
+		void SetLatencyBudget(int nMicroseconds);
+		int GetLatencyBudget() const;
+
+		//! 8 by default
+		void SetMaxBatchSize(int nSize);
+		int GetMaxBatchSize() const;
+
+		QFuture<QImage> Submit(int nStream, const QImage &imgSrc, quint64 nTag = 0);
+
+	private:
+		std::shared_ptr<CRVMBatcherPrivate> d_ptr;
+	};
+
+	std::unique_ptr<CMatte> CreateMatteObj(ModuleType eType, MatteDevice eDevice = MatteDevice::MD_AUTO);
+
+	//! The nRows slowest rows of both tables, times per frame
+	QString FormatOperatorProfile(const OperatorProfileReport &sReport, int nRows = 25);
+
+	//! Size of a stub module
+	struct StubModuleOptions
+	{
+		int nLayers = 4;  //!< Hidden 3x3 convolutions at the working resolution, 18 * nChannels^2 FLOPs per working pixel each
+		int nChannels = 32;
+		quint64 nSeed = 0;  //!< The random weights depend on the seed only
 	};
 
-	std::unique_ptr<CMatte> CreateMatteObj(ModuleType eType);
+	//! Save a stand-in with random weights for the shipped module of eType, so LoadModuleFile and everything after it
+	//! runs without the real model files. It has the forward() signature and attributes of the shipped module:
+	//! BackgroundMattingV2 forward(src, bgr) returns (pha, fgr, pha_sm, fgr_sm, err_sm, ref_sm) and honors backbone_scale,
+	//! RobustVideoMatting forward(src, r1, r2, r3, r4, downsample_ratio) returns [fgr, pha, r1, r2, r3, r4].
+	//! The mattes are meaningless, only the shapes and the compute are realistic.
+	bool CreateStubModule(ModuleType eType, const QString &strPath, const StubModuleOptions &sOptions = StubModuleOptions());
 }
\ No newline at end of file
@@ -0,0 +1,184 @@
+/************************************************************************
+Issue&P.S.:
+Ring of preallocated frame slots between one producer and one consumer thread, without locks
+1. A slot goes FREE -> WRITING -> READY -> READING -> FREE, every move is a compare-exchange on its state.
+2. The producer never waits: with no free slot it overwrites the oldest ready frame, which counts as dropped.
+3. The consumer takes the newest ready frame and frees the older ones, also counted as dropped,
+so each written frame is either read exactly once or dropped exactly once.
+4. T is the payload of a slot, assigned in place and reset when the slot is freed, e.g. an implicitly shared
+frame handle that the camera wants back.
+************************************************************************/
+
+#pragma once
+#include <QtGlobal>
+#include <atomic>
+#include <memory>
+
+template <typename T>
+class CFrameRing
+{
+public:
+	struct Slot
+	{
+		T value;
+		qint64 nFrame = -1;  //!< Set by the producer, e.g. for the trace
+
+	private:
+		friend class CFrameRing;
+		std::atomic<int> nState{ 0 };
+		std::atomic<quint64> nSequence{ 0 };
+	};
+
+	//! At least 2 slots, the consumer holds one while the producer writes another
+	explicit CFrameRing(int nSlots = 3) :m_pSlots(new Slot[qMax(2, nSlots)]), m_nSlots(qMax(2, nSlots))
+	{
+	}
+
+	~CFrameRing() = default;
+
+	CFrameRing(const CFrameRing &) = delete;
+	CFrameRing &operator=(const CFrameRing &) = delete;
+
+	//! Producer: a slot to fill, never null
+	Slot *BeginWrite()
+	{
+		Slot *pSlot = nullptr;
+		while (!pSlot)
+		{
+			for (int i = 0; i < m_nSlots && !pSlot; ++i)
+			{
+				auto &slot = m_pSlots[(m_nNextWrite + i) % m_nSlots];
+				if (Move(slot, SS_FREE, SS_WRITING))
+				{
+					pSlot = &slot;
+				}
+			}
+
+			if (pSlot)
+			{
+				break;
+			}
+
+			//! Full, overwrite the oldest frame the consumer has not taken
+			Slot *pOldest = nullptr;
+			for (int i = 0; i < m_nSlots; ++i)
+			{
+				auto &slot = m_pSlots[i];
+				if (SS_READY == slot.nState.load(std::memory_order_acquire) &&
+					(!pOldest || slot.nSequence.load(std::memory_order_relaxed) < pOldest->nSequence.load(std::memory_order_relaxed)))
+				{
+					pOldest = &slot;
+				}
+			}
+
+			//! Lost to the consumer when it took or freed the slot meanwhile, then a slot is free on the next pass
+			if (pOldest && Move(*pOldest, SS_READY, SS_WRITING))
+			{
+				m_nDropped.fetch_add(1, std::memory_order_relaxed);
+				pSlot = pOldest;
+			}
+		}
+
+		m_nNextWrite = static_cast<int>(pSlot - m_pSlots.get() + 1) % m_nSlots;
+		return pSlot;
+	}
+
+	void EndWrite(Slot *pSlot)
+	{
+		pSlot->nSequence.store(m_nNextSequence++, std::memory_order_relaxed);
+		m_nWritten.fetch_add(1, std::memory_order_relaxed);
+		pSlot->nState.store(SS_READY, std::memory_order_release);
+	}
+
+	//! Consumer: the newest ready frame, nullptr when there is none
+	Slot *BeginRead()
+	{
+		for (;;)
+		{
+			Slot *pNewest = nullptr;
+			for (int i = 0; i < m_nSlots; ++i)
+			{
+				auto &slot = m_pSlots[i];
+				if (SS_READY == slot.nState.load(std::memory_order_acquire) &&
+					(!pNewest || slot.nSequence.load(std::memory_order_relaxed) > pNewest->nSequence.load(std::memory_order_relaxed)))
+				{
+					pNewest = &slot;
+				}
+			}
+
+			if (!pNewest)
+			{
+				return nullptr;
+			}
+
+			//! The producer may have taken it for overwriting, look again
+			if (!Move(*pNewest, SS_READY, SS_READING))
+			{
+				continue;
+			}
+
+			//! Older frames are stale now, taken like a read so their payload is released before the slot is free
+			const auto nSequence = pNewest->nSequence.load(std::memory_order_relaxed);
+			for (int i = 0; i < m_nSlots; ++i)
+			{
+				auto &slot = m_pSlots[i];
+				if (&slot != pNewest &&
+					SS_READY == slot.nState.load(std::memory_order_acquire) &&
+					slot.nSequence.load(std::memory_order_relaxed) < nSequence &&
+					Move(slot, SS_READY, SS_READING))
+				{
+					m_nDropped.fetch_add(1, std::memory_order_relaxed);
+					EndRead(&slot);
+				}
+			}
+
+			m_nRead.fetch_add(1, std::memory_order_relaxed);
+			return pNewest;
+		}
+	}
+
+	//! Resets the payload, a shared frame handle goes back to its owner here
+	void EndRead(Slot *pSlot)
+	{
+		pSlot->value = T();
+		pSlot->nState.store(SS_FREE, std::memory_order_release);
+	}
+
+	quint64 GetWritten() const
+	{
+		return m_nWritten.load(std::memory_order_relaxed);
+	}
+
+	quint64 GetRead() const
+	{
+		return m_nRead.load(std::memory_order_relaxed);
+	}
+
+	quint64 GetDropped() const
+	{
+		return m_nDropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	enum SlotState
+	{
+		SS_FREE,
+		SS_WRITING,
+		SS_READY,
+		SS_READING
+	};
+
+	static bool Move(Slot &slot, SlotState eFrom, SlotState eTo)
+	{
+		int nExpected = eFrom;
+		return slot.nState.compare_exchange_strong(nExpected, eTo, std::memory_order_acq_rel);
+	}
+
+	std::unique_ptr<Slot[]> m_pSlots;
+	int m_nSlots;
+	int m_nNextWrite = 0;  //!< Producer only
+	quint64 m_nNextSequence = 1;  //!< Producer only
+	std::atomic<quint64> m_nWritten{ 0 };
+	std::atomic<quint64> m_nRead{ 0 };
+	std::atomic<quint64> m_nDropped{ 0 };
+};
@@ -0,0 +1,469 @@
+#include "matte_alloc.h"
+#include <c10/core/CPUAllocator.h>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+namespace bgmatt
+{
+	namespace alloc
+	{
+		namespace
+		{
+			//! In front of every block, keeps the data at the 64-byte alignment of alloc_cpu
+			static constexpr size_t HEADER_BYTES = 64;
+
+			//! Above the default CPU allocator
+			static constexpr uint8_t ALLOCATOR_PRIORITY = 1;
+
+			//! Distinct block sizes one workspace keeps, a frame of the models asks for a few dozen
+			static constexpr int SIZE_CLASSES = 128;
+
+			//! Workspace 0 takes the tensors made outside any scope and is never given to a resolution
+			static constexpr int WORKSPACE_COUNT = MAX_RESOLUTIONS + 1;
+
+			struct BlockHeader
+			{
+				size_t nBytes;
+				BlockHeader *pNext;
+				int nWorkspace;  //!< Where the block goes back to
+				quint64 nKey;  //!< Resolution of that workspace when the block was handed out
+			};
+
+			static_assert(sizeof(BlockHeader) <= HEADER_BYTES, "The header must fit in front of the data");
+
+			std::atomic<bool> g_bCounting{ false };
+			std::atomic<bool> g_bWorkspace{ false };
+			std::atomic<qint64> g_nMaxCachedBytes{ 0 };
+			std::atomic<qint64> g_nCachedBytes{ 0 };
+
+			std::atomic<quint64> g_nTensorAllocs{ 0 };
+			std::atomic<quint64> g_nTensorBytes{ 0 };
+			std::atomic<quint64> g_nTensorMisses{ 0 };
+			std::atomic<quint64> g_nNewCalls{ 0 };
+			std::atomic<quint64> g_nNewBytes{ 0 };
+			std::atomic<quint64> g_nLargeNewCalls{ 0 };
+
+			//! Workspace of the scope on this thread
+			thread_local int t_nWorkspace = 0;
+
+			void *DataOf(BlockHeader *pHeader)
+			{
+				return reinterpret_cast<char *>(pHeader) + HEADER_BYTES;
+			}
+
+			BlockHeader *HeaderOf(void *pData)
+			{
+				return reinterpret_cast<BlockHeader *>(static_cast<char *>(pData) - HEADER_BYTES);
+			}
+
+			quint64 ResolutionKey(int nWidth, int nHeight)
+			{
+				return (static_cast<quint64>(nWidth) << 32) | static_cast<quint32>(nHeight);
+			}
+
+			//! Free blocks by exact size, a frame of the same size asks for the same sizes in the same order.
+			//! The lists run through the block headers and the size table is fixed, nothing here allocates.
+			class CWorkspace
+			{
+			public:
+				BlockHeader *Take(size_t nBytes)
+				{
+					std::lock_guard<std::mutex> locker(m_mutex);
+					auto pClass = Find(nBytes);
+					if (!pClass || !pClass->pHead)
+					{
+						return nullptr;
+					}
+
+					auto pHeader = pClass->pHead;
+					pClass->pHead = pHeader->pNext;
+					g_nCachedBytes.fetch_sub(static_cast<qint64>(nBytes), std::memory_order_relaxed);
+					return pHeader;
+				}
+
+				//! false when the block belongs to an earlier resolution, the size table is full or the budget is used up
+				bool Give(BlockHeader *pHeader)
+				{
+					std::lock_guard<std::mutex> locker(m_mutex);
+					if (pHeader->nKey != m_nKey.load(std::memory_order_relaxed))
+					{
+						return false;
+					}
+
+					auto pClass = Find(pHeader->nBytes);
+					if (!pClass)
+					{
+						if (SIZE_CLASSES == m_nClasses)
+						{
+							return false;
+						}
+
+						pClass = &m_aClasses[m_nClasses++];
+						pClass->nBytes = pHeader->nBytes;
+						pClass->pHead = nullptr;
+					}
+
+					const auto nBytes = static_cast<qint64>(pHeader->nBytes);
+					if (g_nCachedBytes.fetch_add(nBytes, std::memory_order_relaxed) + nBytes > g_nMaxCachedBytes.load(std::memory_order_relaxed))
+					{
+						g_nCachedBytes.fetch_sub(nBytes, std::memory_order_relaxed);
+						return false;
+					}
+
+					pHeader->pNext = pClass->pHead;
+					pClass->pHead = pHeader;
+					return true;
+				}
+
+				//! Free every block and serve the resolution of nKey from now on
+				void Reset(quint64 nKey)
+				{
+					std::lock_guard<std::mutex> locker(m_mutex);
+					for (int i = 0; i < m_nClasses; ++i)
+					{
+						while (auto pHeader = m_aClasses[i].pHead)
+						{
+							m_aClasses[i].pHead = pHeader->pNext;
+							g_nCachedBytes.fetch_sub(static_cast<qint64>(pHeader->nBytes), std::memory_order_relaxed);
+							c10::free_cpu(pHeader);
+						}
+					}
+
+					m_nClasses = 0;
+					m_nKey.store(nKey, std::memory_order_relaxed);
+				}
+
+				quint64 Key() const
+				{
+					return m_nKey.load(std::memory_order_relaxed);
+				}
+
+			private:
+				struct SizeClass
+				{
+					size_t nBytes;
+					BlockHeader *pHead;
+				};
+
+				SizeClass *Find(size_t nBytes)
+				{
+					for (int i = 0; i < m_nClasses; ++i)
+					{
+						if (m_aClasses[i].nBytes == nBytes)
+						{
+							return &m_aClasses[i];
+						}
+					}
+
+					return nullptr;
+				}
+
+				std::mutex m_mutex;
+				SizeClass m_aClasses[SIZE_CLASSES];
+				int m_nClasses = 0;
+				std::atomic<quint64> m_nKey{ 0 };
+			};
+
+			//! Never destroyed, tensors of static objects are freed after main returns
+			CWorkspace *GetWorkspaces()
+			{
+				static auto pWorkspaces = new CWorkspace[WORKSPACE_COUNT];
+				return pWorkspaces;
+			}
+
+			//! Which resolution each workspace serves and how many scopes use it
+			struct WorkspaceSlots
+			{
+				std::mutex mutex;
+				int anScopes[WORKSPACE_COUNT] = {};
+				quint64 anLastUse[WORKSPACE_COUNT] = {};
+				quint64 nClock = 0;
+			};
+
+			WorkspaceSlots &GetSlots()
+			{
+				static auto pSlots = new WorkspaceSlots;
+				return *pSlots;
+			}
+
+			//! The workspace of the resolution, or one of an unused resolution given to it. 0 when all are in use.
+			int AcquireWorkspace(quint64 nKey)
+			{
+				auto &slots = GetSlots();
+				auto pWorkspaces = GetWorkspaces();
+				std::lock_guard<std::mutex> locker(slots.mutex);
+
+				int nPick = -1;
+				for (int i = 1; i < WORKSPACE_COUNT && nPick < 0; ++i)
+				{
+					if (pWorkspaces[i].Key() == nKey)
+					{
+						nPick = i;
+					}
+				}
+
+				for (int i = 1; i < WORKSPACE_COUNT && nPick < 0; ++i)
+				{
+					if (0 == pWorkspaces[i].Key())
+					{
+						nPick = i;
+					}
+				}
+
+				//! Otherwise the least recently used one no scope is in
+				for (int i = 1; i < WORKSPACE_COUNT; ++i)
+				{
+					if (0 == slots.anScopes[i] && (nPick < 0 || (pWorkspaces[nPick].Key() != nKey && slots.anLastUse[i] < slots.anLastUse[nPick])))
+					{
+						nPick = i;
+					}
+				}
+
+				if (nPick < 0)
+				{
+					return 0;
+				}
+
+				if (pWorkspaces[nPick].Key() != nKey)
+				{
+					pWorkspaces[nPick].Reset(nKey);
+				}
+
+				++slots.anScopes[nPick];
+				slots.anLastUse[nPick] = ++slots.nClock;
+				return nPick;
+			}
+
+			void ReleaseWorkspaceScope(int nWorkspace)
+			{
+				if (nWorkspace > 0)
+				{
+					auto &slots = GetSlots();
+					std::lock_guard<std::mutex> locker(slots.mutex);
+					--slots.anScopes[nWorkspace];
+				}
+			}
+
+			void FreeData(void *pData)
+			{
+				if (!pData)
+				{
+					return;
+				}
+
+				auto pHeader = HeaderOf(pData);
+				if (g_bWorkspace.load(std::memory_order_relaxed) && GetWorkspaces()[pHeader->nWorkspace].Give(pHeader))
+				{
+					return;
+				}
+
+				c10::free_cpu(pHeader);
+			}
+
+			class CMatteAllocator :public c10::Allocator
+			{
+			public:
+				c10::DataPtr allocate(size_t nBytes) const override
+				{
+					const bool bCounting = g_bCounting.load(std::memory_order_relaxed);
+					if (bCounting)
+					{
+						g_nTensorAllocs.fetch_add(1, std::memory_order_relaxed);
+						g_nTensorBytes.fetch_add(nBytes, std::memory_order_relaxed);
+					}
+
+					auto &workspace = GetWorkspaces()[t_nWorkspace];
+					BlockHeader *pHeader = g_bWorkspace.load(std::memory_order_relaxed) ? workspace.Take(nBytes) : nullptr;
+					if (!pHeader)
+					{
+						if (bCounting)
+						{
+							g_nTensorMisses.fetch_add(1, std::memory_order_relaxed);
+						}
+
+						pHeader = static_cast<BlockHeader *>(c10::alloc_cpu(nBytes + HEADER_BYTES));
+						pHeader->nBytes = nBytes;
+						pHeader->pNext = nullptr;
+					}
+
+					pHeader->nWorkspace = t_nWorkspace;
+					pHeader->nKey = workspace.Key();
+
+					auto pData = DataOf(pHeader);
+					return { pData, pData, &FreeData, c10::Device(c10::DeviceType::CPU) };
+				}
+
+				c10::DeleterFnPtr raw_deleter() const override
+				{
+					return &FreeData;
+				}
+			};
+
+			void CountNew(size_t nBytes)
+			{
+				if (g_bCounting.load(std::memory_order_relaxed))
+				{
+					g_nNewCalls.fetch_add(1, std::memory_order_relaxed);
+					g_nNewBytes.fetch_add(nBytes, std::memory_order_relaxed);
+					if (nBytes >= LARGE_NEW_BYTES)
+					{
+						g_nLargeNewCalls.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+			}
+
+			void Install()
+			{
+				static std::once_flag flag;
+				std::call_once(flag, [] {
+					c10::SetCPUAllocator(new CMatteAllocator, ALLOCATOR_PRIORITY);
+				});
+			}
+		}
+
+		void SetCounting(bool bEnable)
+		{
+			Install();
+			g_bCounting.store(bEnable, std::memory_order_relaxed);
+		}
+
+		bool IsCounting()
+		{
+			return g_bCounting.load(std::memory_order_relaxed);
+		}
+
+		AllocationCounts GetCounts()
+		{
+			AllocationCounts sCounts;
+			sCounts.nTensorAllocs = g_nTensorAllocs.load(std::memory_order_relaxed);
+			sCounts.nTensorBytes = g_nTensorBytes.load(std::memory_order_relaxed);
+			sCounts.nTensorMisses = g_nTensorMisses.load(std::memory_order_relaxed);
+			sCounts.nNewCalls = g_nNewCalls.load(std::memory_order_relaxed);
+			sCounts.nNewBytes = g_nNewBytes.load(std::memory_order_relaxed);
+			sCounts.nLargeNewCalls = g_nLargeNewCalls.load(std::memory_order_relaxed);
+			return sCounts;
+		}
+
+		void ResetCounts()
+		{
+			g_nTensorAllocs.store(0, std::memory_order_relaxed);
+			g_nTensorBytes.store(0, std::memory_order_relaxed);
+			g_nTensorMisses.store(0, std::memory_order_relaxed);
+			g_nNewCalls.store(0, std::memory_order_relaxed);
+			g_nNewBytes.store(0, std::memory_order_relaxed);
+			g_nLargeNewCalls.store(0, std::memory_order_relaxed);
+		}
+
+		void SetWorkspace(bool bEnable, qint64 nMaxCachedBytes)
+		{
+			Install();
+			g_nMaxCachedBytes.store(nMaxCachedBytes, std::memory_order_relaxed);
+			g_bWorkspace.store(bEnable, std::memory_order_relaxed);
+			if (!bEnable)
+			{
+				ReleaseWorkspace();
+			}
+		}
+
+		bool IsWorkspaceEnabled()
+		{
+			return g_bWorkspace.load(std::memory_order_relaxed);
+		}
+
+		qint64 GetWorkspaceBytes()
+		{
+			return g_nCachedBytes.load(std::memory_order_relaxed);
+		}
+
+		void ReleaseWorkspace()
+		{
+			//! The workspaces keep their resolutions, the blocks still out come back to them
+			auto pWorkspaces = GetWorkspaces();
+			for (int i = 0; i < WORKSPACE_COUNT; ++i)
+			{
+				pWorkspaces[i].Reset(pWorkspaces[i].Key());
+			}
+		}
+
+		CWorkspaceScope::CWorkspaceScope(int nWidth, int nHeight) :m_nPrevious(t_nWorkspace), m_nWorkspace(0)
+		{
+			if (IsWorkspaceEnabled() && nWidth > 0 && nHeight > 0)
+			{
+				m_nWorkspace = AcquireWorkspace(ResolutionKey(nWidth, nHeight));
+			}
+
+			t_nWorkspace = m_nWorkspace;
+		}
+
+		CWorkspaceScope::~CWorkspaceScope()
+		{
+			t_nWorkspace = m_nPrevious;
+			ReleaseWorkspaceScope(m_nWorkspace);
+		}
+	}
+}
+
+#if BGMATT_COUNT_NEW
+
+//! The runtime versions on malloc and free, with a count in front
+
+void *operator new(std::size_t nBytes)
+{
+	bgmatt::alloc::CountNew(nBytes);
+	if (auto p = std::malloc(nBytes ? nBytes : 1))
+	{
+		return p;
+	}
+
+	throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t nBytes)
+{
+	return operator new(nBytes);
+}
+
+void *operator new(std::size_t nBytes, const std::nothrow_t &) noexcept
+{
+	bgmatt::alloc::CountNew(nBytes);
+	return std::malloc(nBytes ? nBytes : 1);
+}
+
+void *operator new[](std::size_t nBytes, const std::nothrow_t &tag) noexcept
+{
+	return operator new(nBytes, tag);
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+	std::free(p);
+}
+
+#endif
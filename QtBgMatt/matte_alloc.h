@@ -0,0 +1,76 @@
+/************************************************************************
+Issue&P.S.:
+Heap accounting and the tensor workspace
+1. Counting and the workspace go through one c10 CPU allocator, installed on the first SetCounting or SetWorkspace
+and kept for the life of the process. Device memory is not affected.
+2. The workspace keeps the storage of freed CPU tensors by size and serves the next tensor of the same size from it.
+There is one workspace per frame resolution, chosen by the CWorkspaceScope of the allocating thread, and one for
+tensors made outside any scope. After the warm-up of a bucket every frame of that size reuses the same blocks,
+misses stay at zero. The free lists are intrusive and their size tables fixed, freeing never allocates.
+3. Built with BGMATT_COUNT_NEW=1 the global operator new of the whole process is replaced and counted too, which is
+for the bench only. Calls of LARGE_NEW_BYTES and more are counted apart: pixel buffers and tensor storage, which reach
+zero in a steady frame. TorchScript still creates TensorImpl and interpreter frames per op, so the small ones do not.
+4. The counts are process-wide, every thread included.
+************************************************************************/
+
+#pragma once
+#include <QtGlobal>
+
+//! 1 replaces the global operator new to count it in GetCounts, 0 leaves operator new to the runtime
+#ifndef BGMATT_COUNT_NEW
+#define BGMATT_COUNT_NEW 0
+#endif
+
+namespace bgmatt
+{
+	namespace alloc
+	{
+		struct AllocationCounts
+		{
+			quint64 nTensorAllocs = 0;  //!< Storage of CPU tensors
+			quint64 nTensorBytes = 0;
+			quint64 nTensorMisses = 0;  //!< Storage the workspace could not serve, each one a malloc
+			quint64 nNewCalls = 0;  //!< Global operator new, 0 without BGMATT_COUNT_NEW
+			quint64 nNewBytes = 0;
+			quint64 nLargeNewCalls = 0;  //!< The calls of at least LARGE_NEW_BYTES among nNewCalls
+		};
+
+		//! Operator new of buffers rather than bookkeeping objects
+		static constexpr size_t LARGE_NEW_BYTES = 4096;
+
+		//! Resolutions with a workspace of their own, the least recently used one is released for a new resolution
+		static constexpr int MAX_RESOLUTIONS = 4;
+
+		//! Off by default
+		void SetCounting(bool bEnable);
+		bool IsCounting();
+		AllocationCounts GetCounts();
+		void ResetCounts();
+
+		//! Off by default. nMaxCachedBytes bounds the free blocks kept by all workspaces, frees beyond it go back to the heap.
+		void SetWorkspace(bool bEnable, qint64 nMaxCachedBytes = 1024ll * 1024 * 1024);
+		bool IsWorkspaceEnabled();
+
+		//! Free blocks held by the workspaces
+		qint64 GetWorkspaceBytes();
+
+		//! Return the free blocks to the heap, e.g. after the input size changed for good
+		void ReleaseWorkspace();
+
+		//! CPU tensors made on this thread while the scope lives come from the workspace of nWidth x nHeight frames
+		//! and go back to it when freed on any thread. Scopes nest, the inner one wins.
+		class CWorkspaceScope
+		{
+		public:
+			CWorkspaceScope(int nWidth, int nHeight);
+			~CWorkspaceScope();
+
+			CWorkspaceScope(const CWorkspaceScope &) = delete;
+			CWorkspaceScope &operator=(const CWorkspaceScope &) = delete;
+
+		private:
+			int m_nPrevious;
+			int m_nWorkspace;
+		};
+	}
+}
@@ -0,0 +1,599 @@
+#include "matte_kernel.h"
+#include <ATen/Parallel.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define BGMATT_SSE2
+#endif
+
+//! AVX2/AVX-512 paths are compiled without /arch or -m flags and picked at runtime
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define BGMATT_AVX
+#define BGMATT_TARGET_AVX2
+#define BGMATT_TARGET_AVX512
+#elif defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define BGMATT_AVX
+#define BGMATT_TARGET_AVX2 __attribute__((target("avx2")))
+#define BGMATT_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+namespace bgmatt
+{
+	namespace kernel
+	{
+		namespace
+		{
+			constexpr float NORMALIZE_SCALE = 1.f / 255;
+
+			//! Rows per parallel_for task
+			constexpr int64_t ROW_GRAIN = 16;
+
+			//! Bit offsets of R, G, B inside a 32-bit pixel read as uint32_t
+			struct ChannelShift
+			{
+				int nR;
+				int nG;
+				int nB;
+			};
+
+			ChannelShift ShiftOf(QImage::Format eFormat)
+			{
+				if (QImage::Format_RGBX8888 == eFormat || QImage::Format_RGBA8888 == eFormat)
+				{
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+					return { 24, 16, 8 };
+#else
+					return { 0, 8, 16 };
+#endif
+				}
+
+				//! QRgb, 0xAARRGGBB
+				return { 16, 8, 0 };
+			}
+
+			//! Opaque alpha bits for a 32-bit pixel of the format
+			uint32_t OpaqueOf(QImage::Format eFormat)
+			{
+				auto sShift = ShiftOf(eFormat);
+				return 0xffffffffu & ~((0xffu << sShift.nR) | (0xffu << sShift.nG) | (0xffu << sShift.nB));
+			}
+
+			inline uint32_t ToByte(float fValue)
+			{
+				return static_cast<uint32_t>(qBound(0.f, fValue * 255 + 0.5f, 255.f));
+			}
+
+			inline float Store(int nValue, float *) { return nValue * NORMALIZE_SCALE; }
+			inline uint8_t Store(int nValue, uint8_t *) { return static_cast<uint8_t>(nValue); }
+
+			template<typename T>
+			void Row32(const uint32_t *pSrc, int nWidth, const ChannelShift &sShift, bool bPremultiplied, T *pR, T *pG, T *pB, int nBegin)
+			{
+				for (int x = nBegin; x < nWidth; ++x)
+				{
+					auto nPixel = pSrc[x];
+					int nR = (nPixel >> sShift.nR) & 0xff;
+					int nG = (nPixel >> sShift.nG) & 0xff;
+					int nB = (nPixel >> sShift.nB) & 0xff;
+
+					if (bPremultiplied)
+					{
+						int nA = nPixel >> 24;
+						if (0 == nA)
+						{
+							nR = nG = nB = 0;
+						}
+						else if (nA != 0xff)
+						{
+							nR = qMin(255, (nR * 255 + nA / 2) / nA);
+							nG = qMin(255, (nG * 255 + nA / 2) / nA);
+							nB = qMin(255, (nB * 255 + nA / 2) / nA);
+						}
+					}
+
+					pR[x] = Store(nR, pR);
+					pG[x] = Store(nG, pG);
+					pB[x] = Store(nB, pB);
+				}
+			}
+
+			//! 4 pixels per step: shift, mask, convert and scale, no shuffles so SSE2 is enough
+			void Row32Normalized(const uint32_t *pSrc, int nWidth, const ChannelShift &sShift, bool bPremultiplied, float *pR, float *pG, float *pB)
+			{
+				int x = 0;
+
+#ifdef BGMATT_SSE2
+				if (!bPremultiplied)
+				{
+					const auto vMask = _mm_set1_epi32(0xff);
+					const auto vScale = _mm_set1_ps(NORMALIZE_SCALE);
+					const auto vShiftR = _mm_cvtsi32_si128(sShift.nR);
+					const auto vShiftG = _mm_cvtsi32_si128(sShift.nG);
+					const auto vShiftB = _mm_cvtsi32_si128(sShift.nB);
+
+					for (; x + 4 <= nWidth; x += 4)
+					{
+						auto vPixel = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + x));
+						auto vR = _mm_and_si128(_mm_srl_epi32(vPixel, vShiftR), vMask);
+						auto vG = _mm_and_si128(_mm_srl_epi32(vPixel, vShiftG), vMask);
+						auto vB = _mm_and_si128(_mm_srl_epi32(vPixel, vShiftB), vMask);
+						_mm_storeu_ps(pR + x, _mm_mul_ps(_mm_cvtepi32_ps(vR), vScale));
+						_mm_storeu_ps(pG + x, _mm_mul_ps(_mm_cvtepi32_ps(vG), vScale));
+						_mm_storeu_ps(pB + x, _mm_mul_ps(_mm_cvtepi32_ps(vB), vScale));
+					}
+				}
+#endif
+
+				Row32(pSrc, nWidth, sShift, bPremultiplied, pR, pG, pB, x);
+			}
+
+			void Row32Raw(const uint32_t *pSrc, int nWidth, const ChannelShift &sShift, bool bPremultiplied, uint8_t *pR, uint8_t *pG, uint8_t *pB)
+			{
+				Row32(pSrc, nWidth, sShift, bPremultiplied, pR, pG, pB, 0);
+			}
+
+			template<typename T>
+			void Row24(const uchar *pSrc, int nWidth, T *pR, T *pG, T *pB)
+			{
+				for (int x = 0; x < nWidth; ++x, pSrc += 3)
+				{
+					pR[x] = Store(pSrc[0], pR);
+					pG[x] = Store(pSrc[1], pG);
+					pB[x] = Store(pSrc[2], pB);
+				}
+			}
+
+			template<typename T, typename Row32Fn>
+			void ToPlanar(const QImage &img, T *pDst, int64_t nPlaneStride, Row32Fn fnRow32)
+			{
+				if (!IsIngestFormat(img.format()))
+				{
+					ToPlanar(img.convertToFormat(QImage::Format_RGB32), pDst, nPlaneStride, fnRow32);
+					return;
+				}
+
+				const auto eFormat = img.format();
+				const auto nWidth = img.width();
+				const auto sShift = ShiftOf(eFormat);
+				const bool bPremultiplied = QImage::Format_ARGB32_Premultiplied == eFormat;
+				const bool bPacked24 = QImage::Format_RGB888 == eFormat;
+
+				at::parallel_for(0, img.height(), ROW_GRAIN, [&](int64_t nBegin, int64_t nEnd) {
+					for (auto y = nBegin; y < nEnd; ++y)
+					{
+						auto pLine = img.constScanLine(static_cast<int>(y));
+						auto pR = pDst + y * nWidth;
+						auto pG = pR + nPlaneStride;
+						auto pB = pG + nPlaneStride;
+
+						if (bPacked24)
+						{
+							Row24(pLine, nWidth, pR, pG, pB);
+						}
+						else
+						{
+							fnRow32(reinterpret_cast<const uint32_t *>(pLine), nWidth, sShift, bPremultiplied, pR, pG, pB);
+						}
+					}
+				});
+			}
+
+			//! Pointers of one row, the background planes are unused for a solid color
+			struct CompositeRow
+			{
+				const float *pPha = nullptr;
+				const float *pR = nullptr;
+				const float *pG = nullptr;
+				const float *pB = nullptr;
+				const float *pBgR = nullptr;
+				const float *pBgG = nullptr;
+				const float *pBgB = nullptr;
+				float afColor[3] = {};
+				ChannelShift sShift = {};
+				uint32_t nOpaque = 0;
+				int nAlphaShift = 24;
+			};
+
+			typedef void(*CompositeRowFn)(const CompositeRow &sRow, int nWidth, uint32_t *pDst);
+
+			//! bgr + pha * (fgr - bgr), the same as pha * fgr + (1 - pha) * bgr with one multiply
+			inline uint32_t ComposeChannel(float fPha, float fFgr, float fBgr)
+			{
+				return ToByte(fBgr + fPha * (fFgr - fBgr));
+			}
+
+			//! bAlpha stores pha in the alpha byte instead of nOpaque, used with a black background for premultiplied output
+			template<bool bSolid, bool bAlpha>
+			void CompositeTail(const CompositeRow &sRow, int nBegin, int nWidth, uint32_t *pDst)
+			{
+				for (int x = nBegin; x < nWidth; ++x)
+				{
+					const auto fPha = sRow.pPha[x];
+					const auto nR = ComposeChannel(fPha, sRow.pR[x], bSolid ? sRow.afColor[0] : sRow.pBgR[x]);
+					const auto nG = ComposeChannel(fPha, sRow.pG[x], bSolid ? sRow.afColor[1] : sRow.pBgG[x]);
+					const auto nB = ComposeChannel(fPha, sRow.pB[x], bSolid ? sRow.afColor[2] : sRow.pBgB[x]);
+					const auto nA = bAlpha ? ToByte(fPha) << sRow.nAlphaShift : sRow.nOpaque;
+					pDst[x] = nA | (nR << sRow.sShift.nR) | (nG << sRow.sShift.nG) | (nB << sRow.sShift.nB);
+				}
+			}
+
+			template<bool bSolid, bool bAlpha>
+			void CompositeRowScalar(const CompositeRow &sRow, int nWidth, uint32_t *pDst)
+			{
+				CompositeTail<bSolid, bAlpha>(sRow, 0, nWidth, pDst);
+			}
+
+#ifdef BGMATT_AVX
+			BGMATT_TARGET_AVX2 inline __m256i ToByteAvx2(__m256 v, __m128i vShift)
+			{
+				v = _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(255.f)), _mm256_set1_ps(0.5f));
+				v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.f));
+				return _mm256_sll_epi32(_mm256_cvttps_epi32(v), vShift);
+			}
+
+			BGMATT_TARGET_AVX2 inline __m256i ComposeChannelAvx2(__m256 vPha, __m256 vFgr, __m256 vBgr, __m128i vShift)
+			{
+				return ToByteAvx2(_mm256_add_ps(vBgr, _mm256_mul_ps(vPha, _mm256_sub_ps(vFgr, vBgr))), vShift);
+			}
+
+			//! 8 pixels per step
+			template<bool bSolid, bool bAlpha>
+			BGMATT_TARGET_AVX2 void CompositeRowAvx2(const CompositeRow &sRow, int nWidth, uint32_t *pDst)
+			{
+				const auto vOpaque = _mm256_set1_epi32(static_cast<int>(sRow.nOpaque));
+				const auto vShiftR = _mm_cvtsi32_si128(sRow.sShift.nR);
+				const auto vShiftG = _mm_cvtsi32_si128(sRow.sShift.nG);
+				const auto vShiftB = _mm_cvtsi32_si128(sRow.sShift.nB);
+				const auto vShiftA = _mm_cvtsi32_si128(sRow.nAlphaShift);
+				const auto vColorR = _mm256_set1_ps(sRow.afColor[0]);
+				const auto vColorG = _mm256_set1_ps(sRow.afColor[1]);
+				const auto vColorB = _mm256_set1_ps(sRow.afColor[2]);
+
+				int x = 0;
+				for (; x + 8 <= nWidth; x += 8)
+				{
+					const auto vPha = _mm256_loadu_ps(sRow.pPha + x);
+					auto vPixel = _mm256_or_si256(bAlpha ? ToByteAvx2(vPha, vShiftA) : vOpaque, ComposeChannelAvx2(vPha, _mm256_loadu_ps(sRow.pR + x), bSolid ? vColorR : _mm256_loadu_ps(sRow.pBgR + x), vShiftR));
+					vPixel = _mm256_or_si256(vPixel, ComposeChannelAvx2(vPha, _mm256_loadu_ps(sRow.pG + x), bSolid ? vColorG : _mm256_loadu_ps(sRow.pBgG + x), vShiftG));
+					vPixel = _mm256_or_si256(vPixel, ComposeChannelAvx2(vPha, _mm256_loadu_ps(sRow.pB + x), bSolid ? vColorB : _mm256_loadu_ps(sRow.pBgB + x), vShiftB));
+					_mm256_storeu_si256(reinterpret_cast<__m256i *>(pDst + x), vPixel);
+				}
+
+				CompositeTail<bSolid, bAlpha>(sRow, x, nWidth, pDst);
+			}
+
+			BGMATT_TARGET_AVX512 inline __m512i ToByteAvx512(__m512 v, __m128i vShift)
+			{
+				v = _mm512_add_ps(_mm512_mul_ps(v, _mm512_set1_ps(255.f)), _mm512_set1_ps(0.5f));
+				v = _mm512_min_ps(_mm512_max_ps(v, _mm512_setzero_ps()), _mm512_set1_ps(255.f));
+				return _mm512_sll_epi32(_mm512_cvttps_epi32(v), vShift);
+			}
+
+			BGMATT_TARGET_AVX512 inline __m512i ComposeChannelAvx512(__m512 vPha, __m512 vFgr, __m512 vBgr, __m128i vShift)
+			{
+				return ToByteAvx512(_mm512_add_ps(vBgr, _mm512_mul_ps(vPha, _mm512_sub_ps(vFgr, vBgr))), vShift);
+			}
+
+			//! 16 pixels per step
+			template<bool bSolid, bool bAlpha>
+			BGMATT_TARGET_AVX512 void CompositeRowAvx512(const CompositeRow &sRow, int nWidth, uint32_t *pDst)
+			{
+				const auto vOpaque = _mm512_set1_epi32(static_cast<int>(sRow.nOpaque));
+				const auto vShiftR = _mm_cvtsi32_si128(sRow.sShift.nR);
+				const auto vShiftG = _mm_cvtsi32_si128(sRow.sShift.nG);
+				const auto vShiftB = _mm_cvtsi32_si128(sRow.sShift.nB);
+				const auto vShiftA = _mm_cvtsi32_si128(sRow.nAlphaShift);
+				const auto vColorR = _mm512_set1_ps(sRow.afColor[0]);
+				const auto vColorG = _mm512_set1_ps(sRow.afColor[1]);
+				const auto vColorB = _mm512_set1_ps(sRow.afColor[2]);
+
+				int x = 0;
+				for (; x + 16 <= nWidth; x += 16)
+				{
+					const auto vPha = _mm512_loadu_ps(sRow.pPha + x);
+					auto vPixel = _mm512_or_si512(bAlpha ? ToByteAvx512(vPha, vShiftA) : vOpaque, ComposeChannelAvx512(vPha, _mm512_loadu_ps(sRow.pR + x), bSolid ? vColorR : _mm512_loadu_ps(sRow.pBgR + x), vShiftR));
+					vPixel = _mm512_or_si512(vPixel, ComposeChannelAvx512(vPha, _mm512_loadu_ps(sRow.pG + x), bSolid ? vColorG : _mm512_loadu_ps(sRow.pBgG + x), vShiftG));
+					vPixel = _mm512_or_si512(vPixel, ComposeChannelAvx512(vPha, _mm512_loadu_ps(sRow.pB + x), bSolid ? vColorB : _mm512_loadu_ps(sRow.pBgB + x), vShiftB));
+					_mm512_storeu_si512(pDst + x, vPixel);
+				}
+
+				CompositeTail<bSolid, bAlpha>(sRow, x, nWidth, pDst);
+			}
+#endif
+
+			SimdLevel DetectSimdLevel()
+			{
+#if defined(BGMATT_AVX) && defined(_MSC_VER)
+				int anInfo[4];
+				__cpuid(anInfo, 0);
+				const auto nMaxLeaf = anInfo[0];
+
+				//! AVX state must be enabled by the OS (OSXSAVE + XCR0)
+				__cpuid(anInfo, 1);
+				if (nMaxLeaf < 7 || !(anInfo[2] & (1 << 27)) || !(anInfo[2] & (1 << 28)))
+				{
+					return SimdLevel::SL_SCALAR;
+				}
+
+				const auto nXcr0 = _xgetbv(0);
+				if ((nXcr0 & 0x6) != 0x6)
+				{
+					return SimdLevel::SL_SCALAR;
+				}
+
+				__cpuidex(anInfo, 7, 0);
+				if ((anInfo[1] & (1 << 16)) && (nXcr0 & 0xe6) == 0xe6)
+				{
+					return SimdLevel::SL_AVX512;
+				}
+
+				if (anInfo[1] & (1 << 5))
+				{
+					return SimdLevel::SL_AVX2;
+				}
+#elif defined(BGMATT_AVX)
+				__builtin_cpu_init();
+				if (__builtin_cpu_supports("avx512f"))
+				{
+					return SimdLevel::SL_AVX512;
+				}
+
+				if (__builtin_cpu_supports("avx2"))
+				{
+					return SimdLevel::SL_AVX2;
+				}
+#endif
+				return SimdLevel::SL_SCALAR;
+			}
+
+			//! AVX512_BF16 is CPUID leaf 7, sub-leaf 1, EAX bit 5, its state is the AVX-512 state
+			bool DetectBf16()
+			{
+				if (SimdLevel::SL_AVX512 != GetSimdLevel())
+				{
+					return false;
+				}
+
+#if defined(BGMATT_AVX) && defined(_MSC_VER)
+				int anInfo[4];
+				__cpuidex(anInfo, 7, 0);
+				if (anInfo[0] < 1)
+				{
+					return false;
+				}
+
+				__cpuidex(anInfo, 7, 1);
+				return 0 != (anInfo[0] & (1 << 5));
+#elif defined(BGMATT_AVX)
+				unsigned int nEax = 0, nEbx = 0, nEcx = 0, nEdx = 0;
+				if (!__get_cpuid_count(7, 0, &nEax, &nEbx, &nEcx, &nEdx) || nEax < 1)
+				{
+					return false;
+				}
+
+				__get_cpuid_count(7, 1, &nEax, &nEbx, &nEcx, &nEdx);
+				return 0 != (nEax & (1 << 5));
+#else
+				return false;
+#endif
+			}
+
+			template<bool bAlpha>
+			CompositeRowFn SelectRow(SimdLevel eLevel, bool bSolid)
+			{
+				switch (eLevel)
+				{
+#ifdef BGMATT_AVX
+				case SimdLevel::SL_AVX512:
+					return bSolid ? CompositeRowAvx512<true, bAlpha> : CompositeRowAvx512<false, bAlpha>;
+
+				case SimdLevel::SL_AVX2:
+					return bSolid ? CompositeRowAvx2<true, bAlpha> : CompositeRowAvx2<false, bAlpha>;
+#endif
+				default:
+					return bSolid ? CompositeRowScalar<true, bAlpha> : CompositeRowScalar<false, bAlpha>;
+				}
+			}
+
+			void CompositeImage(const float *pPha, const float *pFgr, int64_t nPlaneStride, const CompositeBgr &sBgr, bool bAlpha, QImage &img)
+			{
+				Q_ASSERT(IsOutputFormat(img.format()));
+
+				const auto eFormat = img.format();
+				const auto nWidth = img.width();
+				const bool bPacked24 = QImage::Format_RGB888 == eFormat;
+
+				CompositeRow sRow;
+				sRow.sShift = bPacked24 ? ChannelShift{ 0, 8, 16 } : ShiftOf(eFormat);
+				sRow.nOpaque = bPacked24 ? 0 : OpaqueOf(eFormat);
+				sRow.nAlphaShift = 48 - sRow.sShift.nR - sRow.sShift.nG - sRow.sShift.nB;
+				std::copy(sBgr.afColor, sBgr.afColor + 3, sRow.afColor);
+
+				const bool bSolid = nullptr == sBgr.pPlanes;
+				const auto fnRow = bAlpha ? SelectRow<true>(GetSimdLevel(), bSolid) : SelectRow<false>(GetSimdLevel(), bSolid);
+
+				//! bits() detaches once here, not per row
+				auto pBits = img.bits();
+				const auto nBytesPerLine = img.bytesPerLine();
+
+				at::parallel_for(0, img.height(), ROW_GRAIN, [&](int64_t nBegin, int64_t nEnd) {
+					std::vector<uint32_t> vPacked(bPacked24 ? nWidth : 0);
+					auto sTask = sRow;
+
+					for (auto y = nBegin; y < nEnd; ++y)
+					{
+						const auto nOffset = y * nWidth;
+						sTask.pPha = pPha + nOffset;
+						sTask.pR = pFgr + nOffset;
+						sTask.pG = sTask.pR + nPlaneStride;
+						sTask.pB = sTask.pG + nPlaneStride;
+
+						if (!bSolid)
+						{
+							sTask.pBgR = sBgr.pPlanes + nOffset;
+							sTask.pBgG = sTask.pBgR + nPlaneStride;
+							sTask.pBgB = sTask.pBgG + nPlaneStride;
+						}
+
+						auto pLine = pBits + y * nBytesPerLine;
+						if (!bPacked24)
+						{
+							fnRow(sTask, nWidth, reinterpret_cast<uint32_t *>(pLine));
+							continue;
+						}
+
+						//! RGB888 is packed as R | G << 8 | B << 16 and narrowed to 3 bytes
+						fnRow(sTask, nWidth, vPacked.data());
+						for (int x = 0; x < nWidth; ++x, pLine += 3)
+						{
+							pLine[0] = static_cast<uchar>(vPacked[x]);
+							pLine[1] = static_cast<uchar>(vPacked[x] >> 8);
+							pLine[2] = static_cast<uchar>(vPacked[x] >> 16);
+						}
+					}
+				});
+			}
+
+			//! 16 pixels per step, convert, saturate to 16 and then 8 bits
+			void AlphaRow(const float *pPha, int nWidth, uchar *pDst)
+			{
+				int x = 0;
+
+#ifdef BGMATT_SSE2
+				const auto vScale = _mm_set1_ps(255.f);
+				const auto vHalf = _mm_set1_ps(0.5f);
+
+				for (; x + 16 <= nWidth; x += 16)
+				{
+					__m128i av[4];
+					for (int i = 0; i < 4; ++i)
+					{
+						av[i] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(pPha + x + 4 * i), vScale), vHalf));
+					}
+
+					auto vLow = _mm_packs_epi32(av[0], av[1]);
+					auto vHigh = _mm_packs_epi32(av[2], av[3]);
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + x), _mm_packus_epi16(vLow, vHigh));
+				}
+#endif
+
+				for (; x < nWidth; ++x)
+				{
+					pDst[x] = static_cast<uchar>(ToByte(pPha[x]));
+				}
+			}
+		}
+
+		bool IsIngestFormat(QImage::Format eFormat)
+		{
+			switch (eFormat)
+			{
+			case QImage::Format_RGB32:
+			case QImage::Format_ARGB32:
+			case QImage::Format_ARGB32_Premultiplied:
+			case QImage::Format_RGBX8888:
+			case QImage::Format_RGBA8888:
+			case QImage::Format_RGB888:
+				return true;
+
+			default:
+				return false;
+			}
+		}
+
+		void ImageToPlanar(const QImage &img, float *pDst, int64_t nPlaneStride)
+		{
+			ToPlanar(img, pDst, nPlaneStride, Row32Normalized);
+		}
+
+		void ImageToPlanar(const QImage &img, uint8_t *pDst, int64_t nPlaneStride)
+		{
+			ToPlanar(img, pDst, nPlaneStride, Row32Raw);
+		}
+
+		bool IsOutputFormat(QImage::Format eFormat)
+		{
+			return IsIngestFormat(eFormat);
+		}
+
+		int OutputLayout(QImage::Format eFormat, int anByte[4])
+		{
+			if (!IsOutputFormat(eFormat))
+			{
+				return 0;
+			}
+
+			if (QImage::Format_RGB888 == eFormat)
+			{
+				anByte[0] = 0;
+				anByte[1] = 1;
+				anByte[2] = 2;
+				anByte[3] = -1;
+				return 3;
+			}
+
+			auto sShift = ShiftOf(eFormat);
+			const int anShift[4] = { sShift.nR, sShift.nG, sShift.nB, 24 + 16 + 8 - sShift.nR - sShift.nG - sShift.nB };
+			for (int i = 0; i < 4; ++i)
+			{
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+				anByte[i] = 3 - anShift[i] / 8;
+#else
+				anByte[i] = anShift[i] / 8;
+#endif
+			}
+
+			return 4;
+		}
+
+		SimdLevel GetSimdLevel()
+		{
+			static const auto eLevel = DetectSimdLevel();
+			return eLevel;
+		}
+
+		bool HasBf16()
+		{
+			static const auto bBf16 = DetectBf16();
+			return bBf16;
+		}
+
+		void Composite(const float *pPha, const float *pFgr, int64_t nPlaneStride, const CompositeBgr &sBgr, QImage &img)
+		{
+			CompositeImage(pPha, pFgr, nPlaneStride, sBgr, false, img);
+		}
+
+		void Premultiply(const float *pPha, const float *pFgr, int64_t nPlaneStride, QImage &img)
+		{
+			Q_ASSERT(QImage::Format_RGB888 != img.format());
+
+			CompositeBgr sBlack;
+			std::fill(sBlack.afColor, sBlack.afColor + 3, 0.f);
+			CompositeImage(pPha, pFgr, nPlaneStride, sBlack, true, img);
+		}
+
+		void AlphaToImage(const float *pPha, QImage &img)
+		{
+			Q_ASSERT(QImage::Format_Grayscale8 == img.format() || QImage::Format_Alpha8 == img.format());
+
+			const auto nWidth = img.width();
+			auto pBits = img.bits();
+			const auto nBytesPerLine = img.bytesPerLine();
+
+			at::parallel_for(0, img.height(), ROW_GRAIN, [&](int64_t nBegin, int64_t nEnd) {
+				for (auto y = nBegin; y < nEnd; ++y)
+				{
+					AlphaRow(pPha + y * nWidth, nWidth, pBits + y * nBytesPerLine);
+				}
+			});
+		}
+
+	}
+}
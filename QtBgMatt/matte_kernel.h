@@ -0,0 +1,63 @@
+/************************************************************************
+Issue&P.S.:
+Pixel kernels shared by the matting objects.
+1. ImageToPlanar reads RGB32/ARGB32/ARGB32_Premultiplied (BGRA in memory), RGBX8888/RGBA8888 and RGB888
+straight from the scanlines, so bytesPerLine() padding is honored. Other formats are converted to RGB32 first.
+2. The planes are written in R, G, B order, nPlaneStride elements apart.
+3. Composite blends pha * fgr + (1 - pha) * bgr and packs RGB32/ARGB32/ARGB32_Premultiplied, RGBX8888/RGBA8888
+or RGB888 in the same pass, alpha is opaque. The AVX-512, AVX2 or scalar row is picked once at runtime.
+4. Premultiply writes fgr * pha with pha as alpha, AlphaToImage writes pha alone as Grayscale8/Alpha8.
+************************************************************************/
+
+#pragma once
+#include <QImage>
+
+namespace bgmatt
+{
+	namespace kernel
+	{
+		//! Whether the format is read without convertToFormat
+		bool IsIngestFormat(QImage::Format eFormat);
+
+		//! Normalized [0, 1] planar RGB
+		void ImageToPlanar(const QImage &img, float *pDst, int64_t nPlaneStride);
+
+		//! Raw [0, 255] planar RGB, used when the normalization runs on the device
+		void ImageToPlanar(const QImage &img, uint8_t *pDst, int64_t nPlaneStride);
+
+		//! Whether the format is written without convertToFormat
+		bool IsOutputFormat(QImage::Format eFormat);
+
+		//! Byte of each channel inside a pixel (R, G, B, A), returns the bytes per pixel or 0 for other formats
+		int OutputLayout(QImage::Format eFormat, int anByte[4]);
+
+		enum class SimdLevel
+		{
+			SL_SCALAR,
+			SL_AVX2,
+			SL_AVX512
+		};
+
+		//! Detected once per process
+		SimdLevel GetSimdLevel();
+
+		//! Native bf16 arithmetic (AVX512_BF16), detected once per process
+		bool HasBf16();
+
+		//! Background of a composite
+		struct CompositeBgr
+		{
+			const float *pPlanes = nullptr;  //!< Normalized planar RGB of the image size, nullptr for afColor
+			float afColor[3] = { 120.f / 255, 255.f / 255, 155.f / 255 };  //!< Solid color, the default target background
+		};
+
+		//! One pass over normalized planar pha and fgr into the scanlines of img, which must have an output format
+		void Composite(const float *pPha, const float *pFgr, int64_t nPlaneStride, const CompositeBgr &sBgr, QImage &img);
+
+		//! Premultiplied fgr with pha as alpha, img is a 32-bit premultiplied format
+		void Premultiply(const float *pPha, const float *pFgr, int64_t nPlaneStride, QImage &img);
+
+		//! pha into the scanlines of a Grayscale8/Alpha8 image
+		void AlphaToImage(const float *pPha, QImage &img);
+	}
+}
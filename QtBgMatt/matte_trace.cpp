@@ -0,0 +1,219 @@
+#include "matte_trace.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QMutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bgmatt
+{
+	namespace trace
+	{
+		namespace
+		{
+			//! 2 MB per traced thread, minutes of frames at a few events per stage
+			static constexpr int EVENTS_PER_THREAD = 1 << 16;
+
+			struct Event
+			{
+				const char *szName;
+				qint64 nFrame;
+				qint64 nTimeNs;
+				char cPhase;
+			};
+
+			//! Written by its thread only, nCount publishes the events before it
+			struct ThreadBuffer
+			{
+				int nTid = 0;
+				std::string strName;
+				std::unique_ptr<Event[]> pEvents = std::unique_ptr<Event[]>(new Event[EVENTS_PER_THREAD]);
+				std::atomic<int> nCount{ 0 };
+				std::atomic<qint64> nDropped{ 0 };
+				//! Recorded begins still waiting for their end, each one holds a slot. Thread only.
+				int nOpen = 0;
+			};
+
+			//! Buffers of every thread that recorded, kept after the thread ends
+			struct Registry
+			{
+				QMutex mutex;
+				std::vector<std::shared_ptr<ThreadBuffer>> vBuffers;
+				int nNextTid = 1;
+			};
+
+			std::atomic<bool> g_bEnabled{ false };
+
+			Registry &GetRegistry()
+			{
+				static Registry registry;
+				return registry;
+			}
+
+			qint64 NowNs()
+			{
+				static const auto start = std::chrono::steady_clock::now();
+				return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			}
+
+			//! Created on the first event, threads that never record cost nothing
+			thread_local std::shared_ptr<ThreadBuffer> t_pBuffer;
+			thread_local const char *t_szThreadName = nullptr;
+
+			ThreadBuffer &LocalBuffer()
+			{
+				if (!t_pBuffer)
+				{
+					t_pBuffer = std::make_shared<ThreadBuffer>();
+
+					auto &registry = GetRegistry();
+					QMutexLocker locker(&registry.mutex);
+					t_pBuffer->nTid = registry.nNextTid++;
+					t_pBuffer->strName = t_szThreadName ? t_szThreadName : "";
+					registry.vBuffers.push_back(t_pBuffer);
+				}
+
+				return *t_pBuffer;
+			}
+
+			bool Record(const char *szName, qint64 nFrame, char cPhase)
+			{
+				auto &buffer = LocalBuffer();
+				const auto nCount = buffer.nCount.load(std::memory_order_relaxed);
+
+				//! A begin needs its own slot and one for its end, on top of the ends already held
+				const auto nNeeded = 'B' == cPhase ? buffer.nOpen + 2 : 1;
+				if (nCount + nNeeded > EVENTS_PER_THREAD)
+				{
+					buffer.nDropped.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+
+				if ('B' == cPhase)
+				{
+					++buffer.nOpen;
+				}
+				else if (buffer.nOpen > 0)
+				{
+					--buffer.nOpen;
+				}
+
+				buffer.pEvents[nCount] = { szName, nFrame, NowNs(), cPhase };
+				buffer.nCount.store(nCount + 1, std::memory_order_release);
+				return true;
+			}
+
+			//! Names are literals of this code, only quotes and backslashes need escaping
+			QByteArray JsonString(const char *sz)
+			{
+				QByteArray ba("\"");
+				for (; *sz; ++sz)
+				{
+					if ('"' == *sz || '\\' == *sz)
+					{
+						ba.append('\\');
+					}
+
+					ba.append(*sz);
+				}
+
+				return ba.append('"');
+			}
+		}
+
+		void SetEnabled(bool bEnable)
+		{
+			g_bEnabled.store(bEnable, std::memory_order_relaxed);
+		}
+
+		bool IsEnabled()
+		{
+			return g_bEnabled.load(std::memory_order_relaxed);
+		}
+
+		void SetThreadName(const char *szName)
+		{
+			t_szThreadName = szName;
+			if (t_pBuffer)
+			{
+				QMutexLocker locker(&GetRegistry().mutex);
+				t_pBuffer->strName = szName;
+			}
+		}
+
+		bool Begin(const char *szName, qint64 nFrame)
+		{
+			return Record(szName, nFrame, 'B');
+		}
+
+		void End(const char *szName, qint64 nFrame)
+		{
+			Record(szName, nFrame, 'E');
+		}
+
+		bool WriteChromeTrace(const QString &strPath)
+		{
+			QFile file(strPath);
+			if (!file.open(QFile::WriteOnly | QFile::Truncate))
+			{
+				return false;
+			}
+
+			const auto strPid = QByteArray::number(QCoreApplication::applicationPid());
+			qint64 nDropped = 0;
+
+			auto &registry = GetRegistry();
+			QMutexLocker locker(&registry.mutex);
+
+			file.write("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+			bool bFirst = true;
+			for (const auto &pBuffer : registry.vBuffers)
+			{
+				const auto strTid = QByteArray::number(pBuffer->nTid);
+				const auto strName = pBuffer->strName.empty() ? "thread " + std::to_string(pBuffer->nTid) : pBuffer->strName;
+
+				QByteArray baLine;
+				baLine.append(bFirst ? "" : ",\n").append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":").append(strPid)
+					.append(",\"tid\":").append(strTid).append(",\"args\":{\"name\":").append(JsonString(strName.c_str())).append("}}");
+				file.write(baLine);
+				bFirst = false;
+
+				const auto nCount = pBuffer->nCount.load(std::memory_order_acquire);
+				for (int i = 0; i < nCount; ++i)
+				{
+					const auto &event = pBuffer->pEvents[i];
+
+					baLine.clear();
+					baLine.append(",\n{\"name\":").append(JsonString(event.szName)).append(",\"ph\":\"").append(event.cPhase)
+						.append("\",\"ts\":").append(QByteArray::number(event.nTimeNs / 1000.0, 'f', 3))
+						.append(",\"pid\":").append(strPid).append(",\"tid\":").append(strTid);
+					if (event.nFrame >= 0)
+					{
+						baLine.append(",\"args\":{\"frame\":").append(QByteArray::number(event.nFrame)).append('}');
+					}
+
+					file.write(baLine.append('}'));
+				}
+
+				nDropped += pBuffer->nDropped.load(std::memory_order_relaxed);
+			}
+
+			file.write(QByteArray("\n],\"otherData\":{\"dropped_events\":").append(QByteArray::number(nDropped)).append("}}\n"));
+			return true;
+		}
+
+		void Clear()
+		{
+			auto &registry = GetRegistry();
+			QMutexLocker locker(&registry.mutex);
+			for (const auto &pBuffer : registry.vBuffers)
+			{
+				pBuffer->nCount.store(0, std::memory_order_release);
+				pBuffer->nDropped.store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+}
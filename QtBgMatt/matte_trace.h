@@ -0,0 +1,61 @@
+/************************************************************************
+Issue&P.S.:
+Timeline of the frame pipeline in Chrome trace JSON, for chrome://tracing or https://ui.perfetto.dev
+1. Off by default. While on, every CScope records a begin and an end event with the thread and the frame.
+2. Each thread appends to its own buffer without locks, the buffer is registered once on its first event.
+A full buffer drops whole scopes: a begin is only recorded with room left for its end, WriteChromeTrace reports the drops.
+3. Names must outlive the trace, string literals.
+************************************************************************/
+
+#pragma once
+#include <QString>
+
+namespace bgmatt
+{
+	namespace trace
+	{
+		void SetEnabled(bool bEnable);
+		bool IsEnabled();
+
+		//! Shown for the calling thread instead of its number
+		void SetThreadName(const char *szName);
+
+		//! nFrame < 0 for events that belong to no frame. End only after a Begin that returned true.
+		bool Begin(const char *szName, qint64 nFrame = -1);
+		void End(const char *szName, qint64 nFrame = -1);
+
+		//! Every event recorded so far, false if the file cannot be written
+		bool WriteChromeTrace(const QString &strPath);
+
+		//! Drop the recorded events, call while tracing is off
+		void Clear();
+
+		//! Begin now and end when the scope is left, nothing while tracing is off
+		class CScope
+		{
+		public:
+			CScope(const char *szName, qint64 nFrame = -1) :m_szName(IsEnabled() ? szName : nullptr), m_nFrame(nFrame)
+			{
+				if (m_szName && !Begin(m_szName, m_nFrame))
+				{
+					m_szName = nullptr;
+				}
+			}
+
+			~CScope()
+			{
+				if (m_szName)
+				{
+					End(m_szName, m_nFrame);
+				}
+			}
+
+			CScope(const CScope &) = delete;
+			CScope &operator=(const CScope &) = delete;
+
+		private:
+			const char *m_szName;
+			qint64 m_nFrame;
+		};
+	}
+}
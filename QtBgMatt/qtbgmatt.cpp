@@ -4,32 +4,49 @@
 #include <QCameraInfo>
 #include <QMetaType> 
 #include <QPainter>
+#include <QTimer>
 #include <QtConcurrent>
 #include <QVideoSurfaceFormat>
+#include "matte_alloc.h"
 
 Q_DECLARE_METATYPE(QCameraInfo)
 
-static constexpr uint8_t FRAME_BUFFER_SIZE = 7;
+//! The worker reads one, the camera writes another, the third holds the newest frame in between
+static constexpr int FRAME_RING_SLOTS = 3;
+
+//! Frames submitted to the matting pipeline and not completed, each holds one pooled source image
+static constexpr int MATTE_IN_FLIGHT = 3;
+
+//! Refresh of the frame rate in the title
+static constexpr int STATS_INTERVAL_MS = 500;
+
+//! Path of the Chrome trace written on exit, tracing is off when unset
+static const char *TRACE_PATH_VARIABLE = "BGMATT_TRACE";
+
+//! MiB of freed tensor storage the workspace keeps for the next frames, the workspace is off when unset
+static const char *WORKSPACE_MB_VARIABLE = "BGMATT_WORKSPACE_MB";
 
 //////////////////////////////////////////////////////////////////////////
 
-void QRVMWidget::setImageInfo(int nWidth, int nHeight, QImage::Format eFormat)
+void QRVMWidget::setImage(const QImage &img)
 {
-	m_nImageWidth = nWidth;
-	m_nImageHeight = nHeight;
-	m_eImageFormat = eFormat;
+	m_imgRes = img;
+	update();
 }
 
 void QRVMWidget::paintEvent(QPaintEvent * event)
 {
+	bgmatt::trace::CScope scope("paint");
 	__super::paintEvent(event);
 
+	const auto imgRes = m_imgRes;
+
 	//! Resizing maybe cause crash. Try to use QOpenGLWidget to repaint. 
-	if (!m_vResCache.empty())
+	if (!imgRes.isNull())
 	{
 		QPainter painter(this);
 
-		auto img = QImage(reinterpret_cast<uchar*>(m_vResCache.data()), m_nImageWidth, m_nImageHeight, m_eImageFormat).mirrored(false, true);
+		auto img = imgRes.mirrored(false, true);
 		painter.drawImage(QRect(0, 0, img.width(), img.height()), img);
 	}
 }
@@ -37,39 +54,217 @@ void QRVMWidget::paintEvent(QPaintEvent * event)
 //////////////////////////////////////////////////////////////////////////
 
 QtBgMatt::QtBgMatt(QWidget *parent)
-    : QWidget(parent)
+    : QWidget(parent), m_ringFrames(FRAME_RING_SLOTS)
 {
     ui.setupUi(this);
 
+	m_strTracePath = QString::fromLocal8Bit(qgetenv(TRACE_PATH_VARIABLE));
+	if (!m_strTracePath.isEmpty())
+	{
+		bgmatt::trace::SetThreadName("demo.ui");
+		bgmatt::trace::SetEnabled(true);
+	}
+
 	m_pRVMWidget = new QRVMWidget(this);
 	m_pRVMWidget->setAttribute(Qt::WA_OpaquePaintEvent);
 	ui.pGridLayoutRVM->addWidget(m_pRVMWidget, 0, 1, 2, 1);
 
+	//! Tensors of a steady video size reuse the storage of the previous frame, the warm-up fills it.
+	//! The allocator serves every CPU tensor of the process, so it is only installed on request.
+	const auto nWorkspaceMb = qgetenv(WORKSPACE_MB_VARIABLE).toLongLong();
+	if (nWorkspaceMb > 0)
+	{
+		bgmatt::alloc::SetWorkspace(true, nWorkspaceMb * 1024 * 1024);
+	}
+
 	m_pBgMatte = bgmatt::CreateMatteObj(bgmatt::ModuleType::MT_BGM);
 	m_pVideoMatte = bgmatt::CreateMatteObj(bgmatt::ModuleType::MT_VIDEOM);
 
 	if (!m_pBgMatte->LoadModuleFile("torchscript_mobilenetv2_fp16.pth"))
 	{
-		QMessageBox::critical(this, "Error", "Cuda or the model file torchscript_mobilenetv2_fp16.pth is not availabel!");
+		QMessageBox::critical(this, "Error", "The model file torchscript_mobilenetv2_fp16.pth is not available!");
 	}
 
 	if (!m_pVideoMatte->LoadModuleFile("rvm_mobilenetv3_fp16.torchscript"))
 	{
-		QMessageBox::critical(this, "Error", "Cuda or the model file rvm_mobilenetv3_fp16.torchscript is not availabel!");
+		QMessageBox::critical(this, "Error", "The model file rvm_mobilenetv3_fp16.torchscript is not available!");
 	}
 
+	//! Display stage: the callback runs on the post thread of the engine, the result is queued to the widget
+	//! on the GUI thread, sharing it. The engine recycles the buffer once the widget moves on.
+	m_pVideoMatte->SetInFlightDepth(MATTE_IN_FLIGHT);
+	m_pVideoMatte->SetCompletionCallback([this](const QImage &imgRes, quint64) {
+		if (m_bMatting && !imgRes.isNull())
+		{
+			QMetaObject::invokeMethod(m_pRVMWidget, "setImage", Qt::QueuedConnection, Q_ARG(QImage, imgRes));
+		}
+	});
+
 	m_pCameraSurface = new QVideoSurface(this);
 	m_pVideoSurface = new QVideoSurface(this);
 
+#if BGMATT_ENABLE_STATS
+	m_strTitle = windowTitle();
+	auto pTimerStats = new QTimer(this);
+	connect(pTimerStats, &QTimer::timeout, [this] {
+		if (!m_bMatting)
+		{
+			setWindowTitle(m_strTitle);
+			return;
+		}
+
+		const auto sStats = m_pVideoMatte->GetStats();
+		const auto &sForward = sStats.asStages[static_cast<int>(bgmatt::MatteStage::MS_FORWARD)];
+		setWindowTitle(QString("%1 - %2 fps, forward %3 ms, %4 frames dropped").arg(m_strTitle).arg(sStats.fFps, 0, 'f', 1)
+			.arg(sForward.fP50Ms, 0, 'f', 1).arg(m_ringFrames.GetDropped()));
+	});
+	pTimerStats->start(STATS_INTERVAL_MS);
+#endif
+
 	setConnection();
 }
 
 QtBgMatt::~QtBgMatt()
 {
-	m_bExitThread = true;
+	stopWorker();
+	m_pVideoMatte->WaitForDone();
+
+	if (!m_strTracePath.isEmpty())
+	{
+		bgmatt::trace::SetEnabled(false);
+		bgmatt::trace::WriteChromeTrace(m_strTracePath);
+	}
+}
+
+void QtBgMatt::startWorker()
+{
+	if (!m_future.isRunning())
+	{
+		{
+			QMutexLocker locker(&m_mutexWorker);
+			m_bExitThread = false;
+			m_bFramePending = false;
+		}
+
+		m_future = QtConcurrent::run([this]() {
+			runWorker();
+		});
+	}
+}
+
+void QtBgMatt::stopWorker()
+{
+	{
+		QMutexLocker locker(&m_mutexWorker);
+		m_bExitThread = true;
+	}
+
+	m_condWorker.wakeAll();
 	m_future.waitForFinished();
 }
 
+void QtBgMatt::notifyWorker()
+{
+	{
+		QMutexLocker locker(&m_mutexWorker);
+		m_bFramePending = true;
+	}
+
+	m_condWorker.wakeOne();
+}
+
+void QtBgMatt::runWorker()
+{
+	bgmatt::trace::SetThreadName("demo.worker");
+	for (;;)
+	{
+		{
+			QMutexLocker locker(&m_mutexWorker);
+			while (!m_bFramePending && !m_bExitThread)
+			{
+				m_condWorker.wait(&m_mutexWorker);
+			}
+
+			if (m_bExitThread)
+			{
+				return;
+			}
+
+			//! Frames written from here on wake the next round, none is missed
+			m_bFramePending = false;
+		}
+
+		//! Each camera frame is matted once, the newest one when the worker falls behind.
+		//! After a pause the first new frame supersedes the ones left in the ring.
+		auto pSlot = m_bMatting ? m_ringFrames.BeginRead() : nullptr;
+		if (!pSlot)
+		{
+			continue;
+		}
+
+		const auto nFrame = pSlot->nFrame;
+		QImage *pImage = nullptr;
+		{
+			bgmatt::trace::CScope scope("preprocess", nFrame);
+
+			auto &frame = pSlot->value;
+			const auto eFormat = QVideoFrame::imageFormatFromPixelFormat(frame.pixelFormat());
+			if (QImage::Format_Invalid != eFormat && frame.map(QAbstractVideoBuffer::ReadOnly))
+			{
+				pImage = sourceImage(frame.width(), frame.height(), eFormat);
+
+				const auto nRowBytes = qMin(frame.bytesPerLine(), pImage->bytesPerLine());
+				for (int y = 0; y < frame.height(); ++y)
+				{
+					memcpy(pImage->scanLine(y), frame.bits() + y * frame.bytesPerLine(), nRowBytes);
+				}
+
+				frame.unmap();
+			}
+
+			//! The camera gets its buffer back before the frame waits for the pipeline
+			m_ringFrames.EndRead(pSlot);
+		}
+
+		if (pImage)
+		{
+			QImage imgVideoBgr;
+			{
+				QMutexLocker locker(&m_mutexVideoBgr);
+				imgVideoBgr = m_imgVideoBgr;
+			}
+
+			//! Blocks while MATTE_IN_FLIGHT frames are in the pipeline. The video frame travels with the camera
+			//! frame, the frames in flight keep theirs.
+			m_pVideoMatte->Submit(*pImage, static_cast<quint64>(nFrame), imgVideoBgr);
+		}
+	}
+}
+
+QImage *QtBgMatt::sourceImage(int nWidth, int nHeight, QImage::Format eFormat)
+{
+	for (auto &img : m_vSourcePool)
+	{
+		if (img.isDetached() && img.width() == nWidth && img.height() == nHeight && img.format() == eFormat)
+		{
+			return &img;
+		}
+	}
+
+	//! In flight frames hold the others, a new size replaces a free image of the old one
+	for (auto &img : m_vSourcePool)
+	{
+		if (img.isDetached())
+		{
+			img = QImage(nWidth, nHeight, eFormat);
+			return &img;
+		}
+	}
+
+	m_vSourcePool.append(QImage(nWidth, nHeight, eFormat));
+	return &m_vSourcePool.last();
+}
+
 void QtBgMatt::setConnection()
 {
 	connect(ui.pButtonTargetBgrImage, &QPushButton::clicked, [this] {
@@ -80,6 +275,10 @@ void QtBgMatt::setConnection()
 			ui.pWidgetTargetBgrImage->setPixmap(QPixmap(strFilePath));
 			m_pBgMatte->SetTargetBgrImage(QImage(strFilePath));
 			m_pVideoMatte->SetTargetBgrImage(QImage(strFilePath));
+
+			//! The image shows until the background video sends its next frame
+			QMutexLocker locker(&m_mutexVideoBgr);
+			m_imgVideoBgr = QImage();
 		}
 	});
 
@@ -153,93 +352,43 @@ void QtBgMatt::setConnection()
 	connect(ui.pButtonMatte, &QPushButton::clicked, [this] (bool checked){
 		m_bMatting = checked;
 
-		if (m_listSpare.isEmpty())
+		if (checked)
 		{
-			for (uint8_t i = 0; i < FRAME_BUFFER_SIZE; i++)
-			{
-				m_listSpare.push_back(QByteArray());
-			}
-
-			m_future = QtConcurrent::run([this]() {
-				while (!m_bExitThread)
-				{
-					if (m_bMatting && 
-						QCamera::ActiveStatus == m_pCamera->status() && 
-						m_pCameraSurface->isActive() && 
-						!m_listBuffer.isEmpty())
-					{
-						const auto &formatVideoSurface = m_pCameraSurface->surfaceFormat();
-						auto byteArrayBuffer = m_listBuffer.front();
-						
-						auto imgRes = m_pVideoMatte->SetImage(
-							QImage(reinterpret_cast<uchar*>(byteArrayBuffer.data()),
-										  formatVideoSurface.frameWidth(), 
-										  formatVideoSurface.frameHeight(),
-										  QVideoFrame::imageFormatFromPixelFormat(formatVideoSurface.pixelFormat())));
-
-						auto nSize = imgRes.bytesPerLine()*imgRes.height();
-						if (m_pRVMWidget->m_vResCache.size() != nSize)
-						{
-							m_pRVMWidget->m_vResCache.resize(nSize);
-						}
-
-						memcpy(m_pRVMWidget->m_vResCache.data(), imgRes.bits(), nSize);
-
-						m_pRVMWidget->update();
-					}
-				}
-			});
+			startWorker();
 		}
 	});
 
 	connect(m_pCameraSurface, &QVideoSurface::frameAvailable, [&](QVideoFrame &frame) {
-		if (frame.map(QAbstractVideoBuffer::ReadOnly))
+		const auto nFrame = m_nCaptureFrame++;
+		bgmatt::trace::CScope scope("capture", nFrame);
+		if (m_bMatting)
 		{
-			if (!m_bMatting)
-			{
-				m_pRVMWidget->setImageInfo(frame.width(), frame.height(), QVideoFrame::imageFormatFromPixelFormat(frame.pixelFormat()));
-
-				auto nSize = frame.bytesPerLine()*frame.height();
-				if (m_pRVMWidget->m_vResCache.size() != nSize)
-				{
-					m_pRVMWidget->m_vResCache.resize(nSize);
-				}
-
-				memcpy(m_pRVMWidget->m_vResCache.data(), frame.bits(), nSize);
-
-				m_pRVMWidget->update();
-			}
-			else
-			{
-				auto byteArraySpare = m_listSpare.front();
-				m_listSpare.pop_front();
-
-				if (!byteArraySpare.isEmpty())
-				{
-					byteArraySpare.clear();
-				}
-
-				byteArraySpare = std::move(QByteArray(reinterpret_cast<char *>(frame.bits()), frame.bytesPerLine()*frame.height()));
-				m_listBuffer.push_back(byteArraySpare);
-				if (m_listBuffer.size() + 2 > FRAME_BUFFER_SIZE)
-				{
-					auto byteArray = m_listBuffer.front();
-					m_listBuffer.pop_front();
-					m_listSpare.push_back(byteArray);
-				}
-			}
+			//! Only the shared handle is queued, the worker maps and copies the pixels
+			auto pSlot = m_ringFrames.BeginWrite();
+			pSlot->value = frame;
+			pSlot->nFrame = nFrame;
+			m_ringFrames.EndWrite(pSlot);
+			notifyWorker();
+		}
+		else if (frame.map(QAbstractVideoBuffer::ReadOnly))
+		{
+			//! The frame is unmapped below, so the preview takes a copy
+			m_pRVMWidget->setImage(QImage(frame.bits(), frame.width(), frame.height(), frame.bytesPerLine(), 
+				QVideoFrame::imageFormatFromPixelFormat(frame.pixelFormat())).copy());
 
 			frame.unmap();
 		}
 	});
 
 	connect(m_pVideoSurface, &QVideoSurface::frameAvailable, [&](QVideoFrame &frame) {
-		if (frame.map(QAbstractVideoBuffer::ReadOnly) && m_bMatting)
+		if (m_bMatting && frame.map(QAbstractVideoBuffer::ReadOnly))
 		{
+			//! mirrored copies the pixels, the frame is unmapped below
 			auto recvImage = QImage(frame.bits(), frame.width(), frame.height(), QVideoFrame::imageFormatFromPixelFormat(frame.pixelFormat())).mirrored(false, true);
-			m_pVideoMatte->SetTargetBgrImage(recvImage);
-
 			frame.unmap();
+
+			QMutexLocker locker(&m_mutexVideoBgr);
+			m_imgVideoBgr = recvImage;
 		}
 	});
 }
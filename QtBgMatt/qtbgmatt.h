@@ -4,28 +4,34 @@
 #include <QAbstractVideoSurface>
 #include <QMediaPlayer> 
 #include <QFuture> 
+#include <QMutex>
+#include <QVideoFrame>
+#include <QWaitCondition>
+#include <atomic>
 #include "ui_qtbgmatt.h"
 #include "bg_matte.h"
+#include "matte_trace.h"
+#include "frame_ring.h"
 
 class QCamera;
 
 class QRVMWidget :public QWidget
 {
+	Q_OBJECT
+
 public:
 	QRVMWidget(QWidget *parent = Q_NULLPTR):QWidget(parent){}
 	~QRVMWidget() = default;
 
-	void setImageInfo(int nWidth, int nHeight, QImage::Format eFormat);
-	
-	std::vector<uint8_t> m_vResCache;
+public slots:
+	//! GUI thread, other threads queue the call. The image is shared rather than copied.
+	void setImage(const QImage &img);
 
 protected:
 	void paintEvent(QPaintEvent *event) override;
 
 private:
-	QImage::Format m_eImageFormat = QImage::Format_ARGB32;
-	int m_nImageWidth = 0;
-	int m_nImageHeight = 0;
+	QImage m_imgRes;
 };
 
 class QVideoSurface : public QAbstractVideoSurface
@@ -80,6 +86,7 @@ public:
 	bool present(const QVideoFrame &frame)
 	{
 		// Handle the frame and do your processing
+		bgmatt::trace::CScope scope("present");
 		if (frame.isValid())
 		{
 			QVideoFrame cloneFrame(frame);
@@ -106,11 +113,28 @@ public:
 private:
 	void setConnection();
 
+	//! Stages of the camera path, one thread each:
+	//! capture (GUI thread) -> preprocess (worker) -> ingest, forward, composite (CMatte::Submit) -> paint (GUI thread).
+	//! Capture only queues the frame handle, the worker copies the pixels and blocks in Submit while
+	//! the in-flight frames are at the depth, the ring then drops the stale frames.
+	//! The worker sleeps until the camera writes a frame, pausing only stops the frames
+	void startWorker();
+	void stopWorker();
+	void runWorker();
+	void notifyWorker();
+
+	//! Pooled source image of the size, not shared by a frame in flight. Worker thread only.
+	QImage *sourceImage(int nWidth, int nHeight, QImage::Format eFormat);
+
 private:
     Ui::QtBgMattClass ui;
 	QString m_strLastDirectory;
-	QByteArrayList m_listSpare;
-	QByteArrayList m_listBuffer;
+	QString m_strTitle;
+	QString m_strTracePath;
+	qint64 m_nCaptureFrame = 0;
+	//! Camera frames from the GUI thread to the matting worker
+	CFrameRing<QVideoFrame> m_ringFrames;
+	QVector<QImage> m_vSourcePool;
 	QFuture<void> m_future;
 
 	std::unique_ptr<bgmatt::CMatte> m_pBgMatte;
@@ -120,6 +144,15 @@ private:
 	QMediaPlayer *m_pMediaPlayer = nullptr;
 	QCamera *m_pCamera = nullptr;
 	QRVMWidget *m_pRVMWidget = nullptr;
-	bool m_bMatting = false;
+	std::atomic<bool> m_bMatting{ false };
+
+	//! Latest frame of the background video, submitted with each camera frame
+	QMutex m_mutexVideoBgr;
+	QImage m_imgVideoBgr;
+
+	//! Guarded by m_mutexWorker
+	QMutex m_mutexWorker;
+	QWaitCondition m_condWorker;
+	bool m_bFramePending = false;
 	bool m_bExitThread = false;
 };
@@ -0,0 +1,415 @@
+/************************************************************************
+Issue&P.S.:
+Headless benchmark of CBgMatte and CRVMMatte.
+1. Every model runs the SD and HD samples of input_img/{src,bg,target} and a 4K frame scaled up from the HD sample.
+2. Each case runs --warmup frames that are not measured, then --iterations frames with stage timing on.
+3. p50/p95/p99 and the mean of ingest, upload, model, composite, download, output conversion and the whole frame are printed
+and written to --out as JSON, with the label, device and machine, so runs of different commits can be compared.
+4. --stub runs CreateStubModule stand-ins instead of the model files, for machines without them.
+5. --trace writes the stages of every frame as a Chrome trace, open it in chrome://tracing or ui.perfetto.dev.
+6. Tensor storage and operator new are counted over the timed frames, --workspace serves the tensors from
+the allocation workspace of the frame size. With it a case that still misses the workspace or calls operator new
+for LARGE_NEW_BYTES or more after the warm-up fails, and the bench exits with 1.
+7. --profile prints the slowest operators of each case and writes their trace to bgmatte_ops_<model>_<case>.json.
+e.g. bgmatte_bench --iterations 200 --device cpu --label 6040a70 --out bench_6040a70.json
+************************************************************************/
+
+#include "../QtBgMatt/bg_matte.h"
+#include "../QtBgMatt/matte_trace.h"
+#include "../QtBgMatt/matte_alloc.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFile>
+#include <QDir>
+#include <QSysInfo>
+#include <QThread>
+#include <QDateTime>
+#include <QPair>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+
+namespace
+{
+	struct BenchCase
+	{
+		QString strName;
+		QImage imgSrc;
+		QImage imgBgr;
+		QImage imgTarget;
+	};
+
+	//! Milliseconds of one stage over all measured frames
+	class CStageSamples
+	{
+	public:
+		void Add(double fMs)
+		{
+			m_vMs.push_back(fMs);
+		}
+
+		//! Nearest rank
+		double Percentile(double fRank) const
+		{
+			if (m_vMs.empty())
+			{
+				return 0;
+			}
+
+			auto vSorted = m_vMs;
+			std::sort(vSorted.begin(), vSorted.end());
+			const auto nRank = static_cast<int>(std::ceil(fRank / 100 * vSorted.size()));
+			return vSorted[qBound(1, nRank, static_cast<int>(vSorted.size())) - 1];
+		}
+
+		double Mean() const
+		{
+			double fSum = 0;
+			for (auto fMs : m_vMs)
+			{
+				fSum += fMs;
+			}
+
+			return m_vMs.empty() ? 0 : fSum / m_vMs.size();
+		}
+
+		QJsonObject ToJson() const
+		{
+			QJsonObject obj;
+			obj["p50_ms"] = Percentile(50);
+			obj["p95_ms"] = Percentile(95);
+			obj["p99_ms"] = Percentile(99);
+			obj["mean_ms"] = Mean();
+			return obj;
+		}
+
+	private:
+		std::vector<double> m_vMs;
+	};
+
+	QImage LoadSample(const QString &strDir, const QString &strName)
+	{
+		QImage img(strDir + "/" + strName);
+		if (img.isNull())
+		{
+			fprintf(stderr, "Missing sample %s\n", qPrintable(strDir + "/" + strName));
+		}
+
+		return img;
+	}
+
+	QVector<BenchCase> LoadCases(const QString &strInputDir)
+	{
+		QVector<BenchCase> vCases;
+		for (const auto &strRes : { QString("sd"), QString("hd") })
+		{
+			BenchCase sCase;
+			sCase.strName = strRes;
+			sCase.imgSrc = LoadSample(strInputDir + "/src", "src_" + strRes + ".png");
+			sCase.imgBgr = LoadSample(strInputDir + "/bg", "bg_" + strRes + ".png");
+			sCase.imgTarget = LoadSample(strInputDir + "/target", "target_" + strRes + ".png");
+
+			if (!sCase.imgSrc.isNull() && !sCase.imgBgr.isNull())
+			{
+				vCases.append(sCase);
+			}
+		}
+
+		//! Synthetic 4K, the HD sample scaled up
+		if (!vCases.isEmpty())
+		{
+			const auto &sHd = vCases.last();
+			BenchCase sCase;
+			sCase.strName = "4k";
+			sCase.imgSrc = sHd.imgSrc.scaled(3840, 2160, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+			sCase.imgBgr = sHd.imgBgr.scaled(3840, 2160, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+			sCase.imgTarget = sHd.imgTarget;
+			vCases.append(sCase);
+		}
+
+		return vCases;
+	}
+
+	//! bCheckAlloc fails the case on tensor misses or large operator new calls of the timed frames
+	QJsonObject RunCase(bgmatt::CMatte &matte, const QString &strModel, const BenchCase &sCase, int nWarmup, int nIterations, bool bCheckAlloc)
+	{
+		matte.SetInputSize(sCase.imgSrc.size());
+		matte.SetSrcBgrImage(sCase.imgBgr);
+		matte.SetTargetBgrImage(sCase.imgTarget);
+		matte.SetStageTiming(true);
+
+		QImage imgRes;
+		for (int i = 0; i < nWarmup; ++i)
+		{
+			matte.SetImage(sCase.imgSrc, imgRes);
+		}
+
+		CStageSamples sIngest, sUpload, sModel, sComposite, sDownload, sConvert, sFrame;
+		int nFailed = 0;
+		bgmatt::alloc::ResetCounts();
+		QElapsedTimer timerTotal;
+		timerTotal.start();
+
+		for (int i = 0; i < nIterations; ++i)
+		{
+			QElapsedTimer timer;
+			timer.start();
+			if (!matte.SetImage(sCase.imgSrc, imgRes))
+			{
+				++nFailed;
+				continue;
+			}
+
+			sFrame.Add(timer.nsecsElapsed() / 1e6);
+
+			const auto sTimes = matte.GetLastStageTimes();
+			sIngest.Add(sTimes.fIngestMs);
+			sUpload.Add(sTimes.fUploadMs);
+			sModel.Add(sTimes.fModelMs);
+			sComposite.Add(sTimes.fCompositeMs);
+			sDownload.Add(sTimes.fDownloadMs);
+			sConvert.Add(sTimes.fConvertMs);
+		}
+
+		const auto fTotalMs = timerTotal.nsecsElapsed() / 1e6;
+		const auto fFps = fTotalMs > 0 ? (nIterations - nFailed) * 1000.0 / fTotalMs : 0;
+		const auto sCounts = bgmatt::alloc::GetCounts();
+
+		printf("%-4s %-3s %4dx%-4d  frame p50 %8.2f p95 %8.2f p99 %8.2f ms | ingest %7.2f model %8.2f composite %7.2f convert %7.2f ms (p50) | %7.2f fps | %.1f tensor misses %.1f large new/frame\n",
+			qPrintable(strModel), qPrintable(sCase.strName), sCase.imgSrc.width(), sCase.imgSrc.height(),
+			sFrame.Percentile(50), sFrame.Percentile(95), sFrame.Percentile(99),
+			sIngest.Percentile(50), sModel.Percentile(50), sComposite.Percentile(50), sConvert.Percentile(50), fFps,
+			static_cast<double>(sCounts.nTensorMisses) / nIterations, static_cast<double>(sCounts.nLargeNewCalls) / nIterations);
+
+		//! The small operator new calls are TorchScript bookkeeping per op and never reach zero
+		const auto bSteady = 0 == sCounts.nTensorMisses && 0 == sCounts.nLargeNewCalls;
+		if (bCheckAlloc && !bSteady)
+		{
+			fprintf(stderr, "%s %s allocates after the warm-up: %llu tensor misses, %llu operator new calls of %d bytes or more\n",
+				qPrintable(strModel), qPrintable(sCase.strName), static_cast<unsigned long long>(sCounts.nTensorMisses),
+				static_cast<unsigned long long>(sCounts.nLargeNewCalls), static_cast<int>(bgmatt::alloc::LARGE_NEW_BYTES));
+		}
+
+		QJsonObject objAllocations;
+		objAllocations["tensor_allocs"] = static_cast<double>(sCounts.nTensorAllocs) / nIterations;
+		objAllocations["tensor_bytes"] = static_cast<double>(sCounts.nTensorBytes) / nIterations;
+		objAllocations["tensor_misses"] = static_cast<double>(sCounts.nTensorMisses) / nIterations;
+		objAllocations["new_calls"] = static_cast<double>(sCounts.nNewCalls) / nIterations;
+		objAllocations["new_bytes"] = static_cast<double>(sCounts.nNewBytes) / nIterations;
+		objAllocations["new_large_calls"] = static_cast<double>(sCounts.nLargeNewCalls) / nIterations;
+		objAllocations["steady"] = bSteady;
+
+		QJsonObject objStages;
+		objStages["ingest"] = sIngest.ToJson();
+		objStages["upload"] = sUpload.ToJson();
+		objStages["model"] = sModel.ToJson();
+		objStages["composite"] = sComposite.ToJson();
+		objStages["download"] = sDownload.ToJson();
+		objStages["convert"] = sConvert.ToJson();
+		objStages["frame"] = sFrame.ToJson();
+
+		QJsonObject obj;
+		obj["model"] = strModel;
+		obj["case"] = sCase.strName;
+		obj["width"] = sCase.imgSrc.width();
+		obj["height"] = sCase.imgSrc.height();
+		obj["iterations"] = nIterations;
+		obj["failed"] = nFailed;
+		obj["fps"] = fFps;
+		obj["stages"] = objStages;
+		obj["allocations_per_frame"] = objAllocations;
+		return obj;
+	}
+
+	QString DeviceName(bgmatt::MatteDevice eDevice)
+	{
+		switch (eDevice)
+		{
+		case bgmatt::MatteDevice::MD_CPU:
+			return "cpu";
+		case bgmatt::MatteDevice::MD_CUDA:
+			return "cuda";
+		default:
+			return "auto";
+		}
+	}
+
+	const QVector<QPair<QString, bgmatt::MattePrecision>> PRECISION_NAMES = {
+		qMakePair(QString("auto"), bgmatt::MattePrecision::MP_AUTO),
+		qMakePair(QString("fp32"), bgmatt::MattePrecision::MP_FP32),
+		qMakePair(QString("fp16"), bgmatt::MattePrecision::MP_FP16),
+		qMakePair(QString("bf16"), bgmatt::MattePrecision::MP_BF16),
+		qMakePair(QString("int8"), bgmatt::MattePrecision::MP_INT8) };
+
+	QString PrecisionName(bgmatt::MattePrecision ePrecision)
+	{
+		for (const auto &precision : PRECISION_NAMES)
+		{
+			if (precision.second == ePrecision)
+			{
+				return precision.first;
+			}
+		}
+
+		return "auto";
+	}
+
+	bgmatt::MattePrecision PrecisionFromName(const QString &strName)
+	{
+		for (const auto &precision : PRECISION_NAMES)
+		{
+			if (precision.first == strName)
+			{
+				return precision.second;
+			}
+		}
+
+		return bgmatt::MattePrecision::MP_AUTO;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Per-stage latency of the matting models");
+	parser.addHelpOption();
+	parser.addOption({ "bgm", "BackgroundMattingV2 TorchScript module, empty to skip.", "path", "torchscript_mobilenetv2_fp16.pth" });
+	parser.addOption({ "rvm", "RobustVideoMatting TorchScript module, empty to skip.", "path", "rvm_mobilenetv3_fp16.torchscript" });
+	parser.addOption({ "input", "Folder with src, bg and target samples.", "dir", QCoreApplication::applicationDirPath() + "/input_img" });
+	parser.addOption({ "iterations", "Measured frames per case.", "n", "100" });
+	parser.addOption({ "warmup", "Frames per case before measuring.", "n", "10" });
+	parser.addOption({ "device", "auto, cpu or cuda.", "device", "auto" });
+	parser.addOption({ "precision", "auto, fp32, fp16, bf16 or int8. int8 calibrates on the first sample.", "precision", "auto" });
+	parser.addOption({ "stub", "Run stub modules with this many hidden layers instead of --bgm and --rvm.", "layers" });
+	parser.addOption({ "stub-channels", "Channels of the stub layers.", "n", "32" });
+	parser.addOption({ "label", "Stored with the results, e.g. the commit.", "label" });
+	parser.addOption({ "out", "JSON result file.", "path", "bgmatte_bench.json" });
+	parser.addOption({ "trace", "Chrome trace of the frames after loading, empty for none.", "path" });
+	parser.addOption({ "workspace", "Serve CPU tensors from the allocation workspace, fail on allocations after the warm-up." });
+	parser.addOption({ "profile", "Frames per case under the operator profiler, after the timed ones.", "n" });
+	parser.process(app);
+
+	const auto strDevice = parser.value("device");
+	const auto eDevice = "cpu" == strDevice ? bgmatt::MatteDevice::MD_CPU :
+		("cuda" == strDevice ? bgmatt::MatteDevice::MD_CUDA : bgmatt::MatteDevice::MD_AUTO);
+	const auto nIterations = qMax(1, parser.value("iterations").toInt());
+	const auto nWarmup = qMax(0, parser.value("warmup").toInt());
+	const auto ePrecision = PrecisionFromName(parser.value("precision"));
+
+	const auto vCases = LoadCases(parser.value("input"));
+	if (vCases.isEmpty())
+	{
+		fprintf(stderr, "No samples in %s\n", qPrintable(parser.value("input")));
+		return 1;
+	}
+
+	//! Before loading, so the warm-up of the buckets fills the workspace
+	bgmatt::alloc::SetCounting(true);
+	bgmatt::alloc::SetWorkspace(parser.isSet("workspace"));
+
+	QJsonArray arrResults;
+	int nUnsteady = 0;
+	QString strResolvedDevice = DeviceName(eDevice);
+	QString strResolvedPrecision = PrecisionName(ePrecision);
+
+	const QVector<QPair<QString, bgmatt::ModuleType>> vModels = {
+		qMakePair(QString("bgm"), bgmatt::ModuleType::MT_BGM),
+		qMakePair(QString("rvm"), bgmatt::ModuleType::MT_VIDEOM) };
+
+	for (const auto &model : vModels)
+	{
+		auto strPath = parser.value(model.first);
+		if (parser.isSet("stub"))
+		{
+			bgmatt::StubModuleOptions sOptions;
+			sOptions.nLayers = parser.value("stub").toInt();
+			sOptions.nChannels = parser.value("stub-channels").toInt();
+
+			strPath = QDir(QDir::tempPath()).absoluteFilePath("bgmatte_bench_stub_" + model.first + ".pt");
+			if (!bgmatt::CreateStubModule(model.second, strPath, sOptions))
+			{
+				fprintf(stderr, "Cannot create the stub module %s\n", qPrintable(strPath));
+				continue;
+			}
+		}
+
+		if (strPath.isEmpty())
+		{
+			continue;
+		}
+
+		auto pMatte = bgmatt::CreateMatteObj(model.second, eDevice);
+		pMatte->SetPrecision(ePrecision);
+		pMatte->SetCalibrationImages({ vCases.first().imgSrc });
+		pMatte->SetInputSize(vCases.first().imgSrc.size());
+		pMatte->SetSrcBgrImage(vCases.first().imgBgr);
+
+		if (!pMatte->LoadModuleFile(QDir(QCoreApplication::applicationDirPath()).absoluteFilePath(strPath)))
+		{
+			fprintf(stderr, "Cannot load %s\n", qPrintable(strPath));
+			continue;
+		}
+
+		strResolvedDevice = DeviceName(pMatte->GetDevice());
+		strResolvedPrecision = PrecisionName(pMatte->GetPrecision());
+		if (!pMatte->GetPrecisionNote().isEmpty())
+		{
+			fprintf(stderr, "%s: %s\n", qPrintable(model.first), qPrintable(pMatte->GetPrecisionNote()));
+		}
+		bgmatt::trace::SetEnabled(parser.isSet("trace"));
+		for (const auto &sCase : vCases)
+		{
+			const auto objCase = RunCase(*pMatte, model.first, sCase, nWarmup, nIterations, parser.isSet("workspace"));
+			nUnsteady += objCase.value("allocations_per_frame").toObject().value("steady").toBool() ? 0 : 1;
+			arrResults.append(objCase);
+
+			if (parser.isSet("profile"))
+			{
+				const auto strTrace = QString("bgmatte_ops_%1_%2.json").arg(model.first).arg(sCase.strName);
+				const auto sProfile = pMatte->ProfileOperators(sCase.imgSrc, qMax(1, parser.value("profile").toInt()), strTrace);
+				printf("\n%s %s operators\n%s\n", qPrintable(model.first), qPrintable(sCase.strName), qPrintable(bgmatt::FormatOperatorProfile(sProfile)));
+			}
+		}
+
+		bgmatt::trace::SetEnabled(false);
+	}
+
+	if (parser.isSet("trace") && !bgmatt::trace::WriteChromeTrace(parser.value("trace")))
+	{
+		fprintf(stderr, "Cannot write %s\n", qPrintable(parser.value("trace")));
+	}
+
+	QJsonObject objRoot;
+	objRoot["label"] = parser.value("label");
+	objRoot["date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+	objRoot["device"] = strResolvedDevice;
+	objRoot["precision"] = strResolvedPrecision;
+	objRoot["stub_layers"] = parser.isSet("stub") ? parser.value("stub").toInt() : -1;
+	objRoot["stub_channels"] = parser.isSet("stub") ? parser.value("stub-channels").toInt() : -1;
+	objRoot["cpu"] = QSysInfo::currentCpuArchitecture();
+	objRoot["os"] = QSysInfo::prettyProductName();
+	objRoot["host"] = QSysInfo::machineHostName();
+	objRoot["threads"] = QThread::idealThreadCount();
+	objRoot["iterations"] = nIterations;
+	objRoot["warmup"] = nWarmup;
+	objRoot["workspace"] = parser.isSet("workspace");
+	objRoot["results"] = arrResults;
+
+	QFile file(parser.value("out"));
+	if (!file.open(QFile::WriteOnly | QFile::Truncate))
+	{
+		fprintf(stderr, "Cannot write %s\n", qPrintable(parser.value("out")));
+		return 1;
+	}
+
+	file.write(QJsonDocument(objRoot).toJson());
+	//! Without the workspace the misses are expected, they are only reported
+	return arrResults.isEmpty() || (parser.isSet("workspace") && nUnsteady > 0) ? 1 : 0;
+}
@@ -0,0 +1,543 @@
+/************************************************************************
+Issue&P.S.:
+Console checks of the pieces of QtBgMatt that have an exact answer, no model files needed.
+1. The composite, premultiply, alpha and ingest kernels at the SIMD level of this CPU against scalar loops written here,
+over every output format and widths that leave a tail after the vector loop.
+2. CFrameRing: the consumer gets the newest frame, every written frame is read or dropped exactly once, also under
+a producer and a consumer thread.
+3. Tiling: a stub BackgroundMattingV2 module with a receptive field far below the overlap, matted whole and in
+feathered tiles, agrees within a few 8-bit levels.
+4. Trace: scopes that overflow the event buffer of a thread still leave every begin with its end.
+Prints one line per check and exits with the number of failed checks.
+e.g. bgmatte_test
+************************************************************************/
+
+#include "../QtBgMatt/bg_matte.h"
+#include "../QtBgMatt/matte_kernel.h"
+#include "../QtBgMatt/matte_trace.h"
+#include "../QtBgMatt/frame_ring.h"
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QVector>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	//! Not a multiple of 16, the vector loops of every SIMD level leave a tail
+	static constexpr int KERNEL_WIDTH = 37;
+	static constexpr int KERNEL_HEIGHT = 5;
+
+	//! Float rounding of the vector and scalar blends may differ by one level
+	static constexpr int KERNEL_TOLERANCE = 1;
+
+	//! Overlap far above the 2 pixel receptive field of the stub, so the zero padding at the tile edges is
+	//! feathered down to a few levels
+	static constexpr int TILE_SIZE = 192;
+	static constexpr int TILE_OVERLAP = 96;
+	static constexpr int TILE_MAX_TOLERANCE = 8;
+	static constexpr double TILE_MEAN_TOLERANCE = 0.5;
+
+	//! Above the 64K events a thread buffers
+	static constexpr int TRACE_SCOPES = 50000;
+
+	//! Bytes of R, G, B and alpha (-1 for none) inside a pixel in memory, little endian
+	struct PixelLayout
+	{
+		QImage::Format eFormat;
+		int nR;
+		int nG;
+		int nB;
+		int nA;
+		int nBytes;
+	};
+
+	const QVector<PixelLayout> OUTPUT_LAYOUTS = {
+		{ QImage::Format_RGB32, 2, 1, 0, 3, 4 },
+		{ QImage::Format_ARGB32, 2, 1, 0, 3, 4 },
+		{ QImage::Format_ARGB32_Premultiplied, 2, 1, 0, 3, 4 },
+		{ QImage::Format_RGBX8888, 0, 1, 2, 3, 4 },
+		{ QImage::Format_RGBA8888, 0, 1, 2, 3, 4 },
+		{ QImage::Format_RGB888, 0, 1, 2, -1, 3 } };
+
+	int ToByte(float fValue)
+	{
+		return static_cast<int>(qBound(0.f, fValue * 255 + 0.5f, 255.f));
+	}
+
+	std::vector<float> RandomPlanes(std::mt19937 &random, int nCount)
+	{
+		std::uniform_real_distribution<float> distribution(0.f, 1.f);
+		std::vector<float> vPlanes(nCount);
+		for (auto &fValue : vPlanes)
+		{
+			fValue = distribution(random);
+		}
+
+		//! The exact ends of the range as well
+		vPlanes[0] = 0.f;
+		vPlanes[1] = 1.f;
+		return vPlanes;
+	}
+
+	QImage RandomImage(std::mt19937 &random, int nWidth, int nHeight, QImage::Format eFormat)
+	{
+		QImage img(nWidth, nHeight, eFormat);
+		for (int y = 0; y < nHeight; ++y)
+		{
+			auto pLine = img.scanLine(y);
+			for (int x = 0; x < img.bytesPerLine(); ++x)
+			{
+				pLine[x] = static_cast<uchar>(random() & 0xff);
+			}
+
+			//! Premultiplied channels never exceed alpha
+			if (QImage::Format_ARGB32_Premultiplied == eFormat)
+			{
+				for (int x = 0; x < nWidth; ++x)
+				{
+					auto pPixel = pLine + 4 * x;
+					pPixel[3] = x % 4 ? pPixel[3] : (x % 8 ? 0 : 0xff);
+					for (int i = 0; i < 3; ++i)
+					{
+						pPixel[i] = qMin(pPixel[i], pPixel[3]);
+					}
+				}
+			}
+		}
+
+		return img;
+	}
+
+	//! Compare the pixels of img with fnExpected(x, y, channel), channel 3 is alpha
+	bool CheckPixels(const char *szCase, const QImage &img, const PixelLayout &sLayout, int nTolerance,
+		const std::function<int(int x, int y, int nChannel)> &fnExpected)
+	{
+		const int anByte[4] = { sLayout.nR, sLayout.nG, sLayout.nB, sLayout.nA };
+		for (int y = 0; y < img.height(); ++y)
+		{
+			auto pLine = img.constScanLine(y);
+			for (int x = 0; x < img.width(); ++x)
+			{
+				for (int c = 0; c < 4; ++c)
+				{
+					if (anByte[c] < 0)
+					{
+						continue;
+					}
+
+					const int nActual = pLine[x * sLayout.nBytes + anByte[c]];
+					const int nExpected = fnExpected(x, y, c);
+					if (qAbs(nActual - nExpected) > nTolerance)
+					{
+						fprintf(stderr, "  %s format %d at (%d, %d) channel %d: %d, expected %d\n",
+							szCase, static_cast<int>(sLayout.eFormat), x, y, c, nActual, nExpected);
+						return false;
+					}
+				}
+			}
+		}
+
+		return true;
+	}
+
+	bool TestComposite()
+	{
+		std::mt19937 random(1);
+		const int nPixels = KERNEL_WIDTH * KERNEL_HEIGHT;
+		const auto vPha = RandomPlanes(random, nPixels);
+		const auto vFgr = RandomPlanes(random, 3 * nPixels);
+		const auto vBgr = RandomPlanes(random, 3 * nPixels);
+
+		bool bOk = true;
+		for (const auto &sLayout : OUTPUT_LAYOUTS)
+		{
+			for (const bool bSolid : { true, false })
+			{
+				bgmatt::kernel::CompositeBgr sBgr;
+				sBgr.pPlanes = bSolid ? nullptr : vBgr.data();
+
+				QImage img(KERNEL_WIDTH, KERNEL_HEIGHT, sLayout.eFormat);
+				bgmatt::kernel::Composite(vPha.data(), vFgr.data(), nPixels, sBgr, img);
+
+				bOk = CheckPixels(bSolid ? "composite on color" : "composite on image", img, sLayout, KERNEL_TOLERANCE, [&](int x, int y, int c) {
+					const auto i = y * KERNEL_WIDTH + x;
+					if (3 == c)
+					{
+						return 255;
+					}
+
+					const auto fBgr = bSolid ? sBgr.afColor[c] : vBgr[c * nPixels + i];
+					return ToByte(vPha[i] * vFgr[c * nPixels + i] + (1 - vPha[i]) * fBgr);
+				}) && bOk;
+			}
+		}
+
+		return bOk;
+	}
+
+	bool TestPremultiplyAndAlpha()
+	{
+		std::mt19937 random(2);
+		const int nPixels = KERNEL_WIDTH * KERNEL_HEIGHT;
+		const auto vPha = RandomPlanes(random, nPixels);
+		const auto vFgr = RandomPlanes(random, 3 * nPixels);
+
+		QImage img(KERNEL_WIDTH, KERNEL_HEIGHT, QImage::Format_ARGB32_Premultiplied);
+		bgmatt::kernel::Premultiply(vPha.data(), vFgr.data(), nPixels, img);
+		bool bOk = CheckPixels("premultiply", img, OUTPUT_LAYOUTS[2], KERNEL_TOLERANCE, [&](int x, int y, int c) {
+			const auto i = y * KERNEL_WIDTH + x;
+			return 3 == c ? ToByte(vPha[i]) : ToByte(vPha[i] * vFgr[c * nPixels + i]);
+		});
+
+		for (const auto eFormat : { QImage::Format_Grayscale8, QImage::Format_Alpha8 })
+		{
+			QImage imgAlpha(KERNEL_WIDTH, KERNEL_HEIGHT, eFormat);
+			bgmatt::kernel::AlphaToImage(vPha.data(), imgAlpha);
+			const PixelLayout sLayout = { eFormat, 0, -1, -1, -1, 1 };
+			bOk = CheckPixels("alpha", imgAlpha, sLayout, 0, [&](int x, int y, int) {
+				return ToByte(vPha[y * KERNEL_WIDTH + x]);
+			}) && bOk;
+		}
+
+		return bOk;
+	}
+
+	bool TestIngest()
+	{
+		std::mt19937 random(3);
+		const int nPixels = KERNEL_WIDTH * KERNEL_HEIGHT;
+
+		bool bOk = true;
+		for (const auto &sLayout : OUTPUT_LAYOUTS)
+		{
+			const auto img = RandomImage(random, KERNEL_WIDTH, KERNEL_HEIGHT, sLayout.eFormat);
+			const bool bPremultiplied = QImage::Format_ARGB32_Premultiplied == sLayout.eFormat;
+
+			std::vector<float> vFloat(3 * nPixels);
+			std::vector<uint8_t> vRaw(3 * nPixels);
+			bgmatt::kernel::ImageToPlanar(img, vFloat.data(), nPixels);
+			bgmatt::kernel::ImageToPlanar(img, vRaw.data(), nPixels);
+
+			const int anByte[3] = { sLayout.nR, sLayout.nG, sLayout.nB };
+			for (int y = 0; y < KERNEL_HEIGHT && bOk; ++y)
+			{
+				auto pLine = img.constScanLine(y);
+				for (int x = 0; x < KERNEL_WIDTH && bOk; ++x)
+				{
+					auto pPixel = pLine + x * sLayout.nBytes;
+					for (int c = 0; c < 3 && bOk; ++c)
+					{
+						int nExpected = pPixel[anByte[c]];
+						if (bPremultiplied)
+						{
+							const int nA = pPixel[sLayout.nA];
+							nExpected = 0 == nA ? 0 : qMin(255, (nExpected * 255 + nA / 2) / nA);
+						}
+
+						const auto i = c * nPixels + y * KERNEL_WIDTH + x;
+						if (vRaw[i] != nExpected || std::fabs(vFloat[i] - nExpected / 255.f) > 1e-6f)
+						{
+							fprintf(stderr, "  ingest format %d at (%d, %d) channel %d: %d and %f, expected %d\n",
+								static_cast<int>(sLayout.eFormat), x, y, c, vRaw[i], vFloat[i], nExpected);
+							bOk = false;
+						}
+					}
+				}
+			}
+		}
+
+		return bOk;
+	}
+
+	bool TestFrameRingLatestWins()
+	{
+		CFrameRing<std::shared_ptr<int>> ring(3);
+
+		//! Five frames into three slots, the two oldest are overwritten
+		auto pPayload = std::make_shared<int>(0);
+		for (int i = 0; i < 5; ++i)
+		{
+			auto pSlot = ring.BeginWrite();
+			pSlot->value = pPayload;
+			pSlot->nFrame = i;
+			ring.EndWrite(pSlot);
+		}
+
+		bool bOk = 5 == ring.GetWritten() && 2 == ring.GetDropped();
+
+		auto pSlot = ring.BeginRead();
+		bOk = bOk && pSlot && 4 == pSlot->nFrame;
+
+		//! The newest frame is held, the two older ready ones are dropped and their payloads released
+		bOk = bOk && 1 == ring.GetRead() && 4 == ring.GetDropped() && 2 == pPayload.use_count();
+		bOk = bOk && !ring.BeginRead();
+
+		if (pSlot)
+		{
+			ring.EndRead(pSlot);
+		}
+
+		bOk = bOk && 1 == pPayload.use_count() && ring.GetWritten() == ring.GetRead() + ring.GetDropped();
+		if (!bOk)
+		{
+			fprintf(stderr, "  written %llu read %llu dropped %llu\n", static_cast<unsigned long long>(ring.GetWritten()),
+				static_cast<unsigned long long>(ring.GetRead()), static_cast<unsigned long long>(ring.GetDropped()));
+		}
+
+		return bOk;
+	}
+
+	bool TestFrameRingThreads()
+	{
+		static constexpr int FRAMES = 200000;
+		CFrameRing<qint64> ring(3);
+		std::atomic<bool> bDone{ false };
+		bool bOrdered = true;
+
+		std::thread threadConsumer([&]() {
+			qint64 nLast = -1;
+			for (;;)
+			{
+				const bool bLast = bDone.load(std::memory_order_acquire);
+				while (auto pSlot = ring.BeginRead())
+				{
+					//! Newer than anything read before, and the payload is the one written with the frame
+					bOrdered = bOrdered && pSlot->nFrame > nLast && pSlot->value == pSlot->nFrame;
+					nLast = pSlot->nFrame;
+					ring.EndRead(pSlot);
+				}
+
+				if (bLast)
+				{
+					return;
+				}
+			}
+		});
+
+		for (qint64 i = 0; i < FRAMES; ++i)
+		{
+			auto pSlot = ring.BeginWrite();
+			pSlot->value = i;
+			pSlot->nFrame = i;
+			ring.EndWrite(pSlot);
+		}
+
+		bDone.store(true, std::memory_order_release);
+		threadConsumer.join();
+
+		const bool bOk = bOrdered && FRAMES == ring.GetWritten() && ring.GetWritten() == ring.GetRead() + ring.GetDropped();
+		if (!bOk)
+		{
+			fprintf(stderr, "  ordered %d written %llu read %llu dropped %llu\n", bOrdered ? 1 : 0,
+				static_cast<unsigned long long>(ring.GetWritten()), static_cast<unsigned long long>(ring.GetRead()),
+				static_cast<unsigned long long>(ring.GetDropped()));
+		}
+
+		return bOk;
+	}
+
+	bool TestTiling()
+	{
+		//! No hidden layers and backbone_scale 1: two 3x3 convolutions, nothing global
+		bgmatt::StubModuleOptions sOptions;
+		sOptions.nLayers = 0;
+		sOptions.nChannels = 8;
+
+		const auto strPath = QDir(QDir::tempPath()).absoluteFilePath("bgmatte_test_stub_bgm.pt");
+		if (!bgmatt::CreateStubModule(bgmatt::ModuleType::MT_BGM, strPath, sOptions))
+		{
+			fprintf(stderr, "  cannot create %s\n", qPrintable(strPath));
+			return false;
+		}
+
+		//! Smooth with some detail, like a photo
+		const QSize size(520, 400);
+		QImage imgSrc(size, QImage::Format_RGB32);
+		QImage imgBgr(size, QImage::Format_RGB32);
+		for (int y = 0; y < size.height(); ++y)
+		{
+			for (int x = 0; x < size.width(); ++x)
+			{
+				const int nWave = static_cast<int>(64 * std::sin(x * 0.05) * std::cos(y * 0.07));
+				imgSrc.setPixel(x, y, qRgb(qBound(0, 128 + nWave, 255), x * 255 / size.width(), y * 255 / size.height()));
+				imgBgr.setPixel(x, y, qRgb(96, x * 255 / size.width(), 160));
+			}
+		}
+
+		bgmatt::CBgMatte matte(bgmatt::MatteDevice::MD_CPU);
+		matte.SetInputSize(size, qMax(size.width(), size.height()));
+		matte.SetSrcBgrImage(imgBgr);
+		if (!matte.LoadModuleFile(strPath))
+		{
+			fprintf(stderr, "  cannot load %s\n", qPrintable(strPath));
+			return false;
+		}
+
+		QImage imgWhole;
+		QImage imgTiled;
+		const bool bWhole = matte.SetImage(imgSrc, imgWhole);
+		matte.SetTiling(TILE_SIZE, TILE_OVERLAP);
+		const bool bTiled = matte.SetImage(imgSrc, imgTiled);
+		QFile::remove(strPath);
+
+		if (!bWhole || !bTiled || imgWhole.size() != size || imgTiled.size() != size || imgWhole.format() != imgTiled.format())
+		{
+			fprintf(stderr, "  whole %d tiled %d\n", bWhole ? 1 : 0, bTiled ? 1 : 0);
+			return false;
+		}
+
+		int nMax = 0;
+		double fSum = 0;
+		for (int y = 0; y < size.height(); ++y)
+		{
+			for (int x = 0; x < size.width(); ++x)
+			{
+				const auto rgbWhole = imgWhole.pixel(x, y);
+				const auto rgbTiled = imgTiled.pixel(x, y);
+				for (const auto nDiff : { qRed(rgbWhole) - qRed(rgbTiled), qGreen(rgbWhole) - qGreen(rgbTiled), qBlue(rgbWhole) - qBlue(rgbTiled) })
+				{
+					nMax = qMax(nMax, qAbs(nDiff));
+					fSum += qAbs(nDiff);
+				}
+			}
+		}
+
+		const auto fMean = fSum / (3.0 * size.width() * size.height());
+		if (nMax > TILE_MAX_TOLERANCE || fMean > TILE_MEAN_TOLERANCE)
+		{
+			fprintf(stderr, "  tiled differs from whole by %d levels at most, %.3f on average\n", nMax, fMean);
+			return false;
+		}
+
+		return true;
+	}
+
+	bool TestTraceBalance()
+	{
+		bgmatt::trace::Clear();
+		bgmatt::trace::SetEnabled(true);
+
+		//! A thread of its own starts with an empty buffer. Nested scopes overflow it with begins still open.
+		std::thread threadTrace([]() {
+			bgmatt::trace::SetThreadName("test.trace");
+			for (int i = 0; i < TRACE_SCOPES; ++i)
+			{
+				bgmatt::trace::CScope scopeOuter("outer", i);
+				bgmatt::trace::CScope scopeInner("inner", i);
+			}
+		});
+
+		threadTrace.join();
+		bgmatt::trace::SetEnabled(false);
+
+		const auto strPath = QDir(QDir::tempPath()).absoluteFilePath("bgmatte_test_trace.json");
+		if (!bgmatt::trace::WriteChromeTrace(strPath))
+		{
+			fprintf(stderr, "  cannot write %s\n", qPrintable(strPath));
+			return false;
+		}
+
+		QFile file(strPath);
+		file.open(QFile::ReadOnly);
+		const auto doc = QJsonDocument::fromJson(file.readAll());
+		file.close();
+		QFile::remove(strPath);
+		bgmatt::trace::Clear();
+
+		//! Every end closes the innermost open begin of its thread, nothing is left open
+		std::map<int, QVector<QString>> mapOpen;
+		int nEvents = 0;
+		bool bOk = doc.isObject();
+		for (const auto &value : doc.object().value("traceEvents").toArray())
+		{
+			const auto obj = value.toObject();
+			const auto strPhase = obj.value("ph").toString();
+			auto &vOpen = mapOpen[obj.value("tid").toInt()];
+			if ("B" == strPhase)
+			{
+				vOpen.append(obj.value("name").toString());
+				++nEvents;
+			}
+			else if ("E" == strPhase)
+			{
+				bOk = bOk && !vOpen.isEmpty() && vOpen.last() == obj.value("name").toString();
+				if (!vOpen.isEmpty())
+				{
+					vOpen.removeLast();
+				}
+
+				++nEvents;
+			}
+		}
+
+		for (const auto &open : mapOpen)
+		{
+			bOk = bOk && open.second.isEmpty();
+		}
+
+		const auto nDropped = doc.object().value("otherData").toObject().value("dropped_events").toInt();
+		bOk = bOk && nDropped > 0 && nEvents > 0;
+		if (!bOk)
+		{
+			fprintf(stderr, "  %d events, %d dropped, begins and ends do not pair up or nothing overflowed\n", nEvents, nDropped);
+		}
+
+		return bOk;
+	}
+
+	struct TestCase
+	{
+		const char *szName;
+		bool(*fnTest)();
+	};
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	const TestCase aTests[] = {
+		{ "composite kernels", TestComposite },
+		{ "premultiply and alpha kernels", TestPremultiplyAndAlpha },
+		{ "ingest kernels", TestIngest },
+		{ "frame ring latest wins", TestFrameRingLatestWins },
+		{ "frame ring threads", TestFrameRingThreads },
+		{ "tiled against whole", TestTiling },
+		{ "trace begin and end balance", TestTraceBalance } };
+
+	const char *aszSimd[] = { "scalar", "avx2", "avx512" };
+	printf("simd level %s\n", aszSimd[static_cast<int>(bgmatt::kernel::GetSimdLevel())]);
+
+	int nFailed = 0;
+	for (const auto &test : aTests)
+	{
+		bool bOk = false;
+		try
+		{
+			bOk = test.fnTest();
+		}
+		catch (const std::exception &e)
+		{
+			fprintf(stderr, "  %s\n", e.what());
+		}
+
+		printf("%s %s\n", bOk ? "PASS" : "FAIL", test.szName);
+		nFailed += bOk ? 0 : 1;
+	}
+
+	printf("%d of %d failed\n", nFailed, static_cast<int>(sizeof(aTests) / sizeof(aTests[0])));
+	return nFailed;
+}